@@ -1,80 +1,1105 @@
 ﻿#include "my_malloc.h"
 #include<iostream>
+#include<mutex>
 #include<vector>
 #include<cstdio>
+#include<cstring>
+#include<algorithm>
+#include<chrono>
+#include<condition_variable>
+#include<ctime>
+#include<deque>
+#include<random>
+#include<string>
+#include<thread>
+#ifdef _WIN32
+#include<Windows.h>
+#include<psapi.h>
+#else
+#include<sys/wait.h>
+#include<unistd.h>
+#endif
+#if defined(_MSC_VER)
+#include<intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include<x86intrin.h>
+#endif
+
+//プロセスの常駐メモリ(RSS)のバイト数を取得
+size_t CurrentRssBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return 0;
+	}
+	return counters.WorkingSetSize;
+#else
+	size_t num_page_total = 0, num_page_resident = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (nullptr == fp) {
+		return 0;
+	}
+	if (2 != fscanf(fp, "%zu %zu", &num_page_total, &num_page_resident)) {
+		num_page_resident = 0;
+	}
+	fclose(fp);
+	return num_page_resident * sysconf(_SC_PAGESIZE);
+#endif
+}
 
 void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds) {
 	std::vector<std::thread> vthread(nworks);
-	size_t malloc_costtime = 0;
-	size_t free_costtime = 0;
+	//各スレッドの経過時間(マイクロ秒)の合計
+	std::atomic<size_t> malloc_costtime{ 0 };
+	std::atomic<size_t> free_costtime{ 0 };
 	for (size_t k = 0; k < nworks; ++k) {
 		vthread[k] = std::thread([&, k]() {
 			std::vector<void*> v;
 			v.reserve(ntimes);
 			for (size_t j = 0; j < rounds; ++j) {
-				size_t begin1 = clock();
+				auto begin1 = std::chrono::steady_clock::now();
 				for (size_t i = 0; i < ntimes; i++) {
 					v.push_back(malloc(16));
 				}
-				size_t end1 = clock();
-				size_t begin2 = clock();
+				auto end1 = std::chrono::steady_clock::now();
+				auto begin2 = std::chrono::steady_clock::now();
 				for (size_t i = 0; i < ntimes; i++) {
 					free(v[i]);
 				}
-				size_t end2 = clock();
+				auto end2 = std::chrono::steady_clock::now();
 				v.clear();
-				malloc_costtime += end1 - begin1;
-				free_costtime += end2 - begin2;
+				malloc_costtime += static_cast<size_t>(std::chrono::duration_cast<std::chrono::microseconds>(end1 - begin1).count());
+				free_costtime += static_cast<size_t>(std::chrono::duration_cast<std::chrono::microseconds>(end2 - begin2).count());
 			}
 			});
 	}
 	for (auto& t : vthread) {
 		t.join();
 	}
-	printf("%u threads run concurrently, each thread runs %u rounds, call malloc for %u times per round, costs %u ms\n",
-		nworks, rounds, ntimes, malloc_costtime);
-	printf("%u threads run concurrently, each thread runs %u rounds, call free for %u times per round, costs %u ms\n",
-		nworks, rounds, ntimes, free_costtime);
-	printf("%u threads run concurrently, call malloc and free for %u times, costs %u ms\n",
-		nworks, nworks * rounds * ntimes, malloc_costtime + free_costtime);
+	printf("%zu threads run concurrently, each thread runs %zu rounds, call malloc for %zu times per round, costs %zu ms\n",
+		nworks, rounds, ntimes, malloc_costtime / 1000);
+	printf("%zu threads run concurrently, each thread runs %zu rounds, call free for %zu times per round, costs %zu ms\n",
+		nworks, rounds, ntimes, free_costtime / 1000);
+	printf("%zu threads run concurrently, call malloc and free for %zu times, costs %zu ms\n",
+		nworks, nworks * rounds * ntimes, (malloc_costtime + free_costtime) / 1000);
 }
 void BenchmarkMyMalloc(size_t ntimes, size_t nworks, size_t rounds) {
 	std::vector<std::thread> vthread(nworks);
-	size_t malloc_costtime = 0;
-	size_t free_costtime = 0;
+	//各スレッドの経過時間(マイクロ秒)の合計
+	std::atomic<size_t> malloc_costtime{ 0 };
+	std::atomic<size_t> free_costtime{ 0 };
+	std::mutex stats_mtx;
+	FreeListStats total_stats;
 	for (size_t k = 0; k < nworks; ++k) {
 		vthread[k] = std::thread([&]() {
 			std::vector<void*> v;
 			v.reserve(ntimes);
 			for (size_t j = 0; j < rounds; ++j) {
-				size_t begin1 = clock();
+				auto begin1 = std::chrono::steady_clock::now();
 				for (size_t i = 0; i < ntimes; i++) {
 					v.push_back(MyMalloc(16));
 				}
-				size_t end1 = clock();
-				size_t begin2 = clock();
+				auto end1 = std::chrono::steady_clock::now();
+				auto begin2 = std::chrono::steady_clock::now();
 				for (size_t i = 0; i < ntimes; i++) {
 					MyFree(v[i]);
 				}
-				size_t end2 = clock();
+				auto end2 = std::chrono::steady_clock::now();
 				v.clear();
-				malloc_costtime += end1 - begin1;
-				free_costtime += end2 - begin2;
+				malloc_costtime += static_cast<size_t>(std::chrono::duration_cast<std::chrono::microseconds>(end1 - begin1).count());
+				free_costtime += static_cast<size_t>(std::chrono::duration_cast<std::chrono::microseconds>(end2 - begin2).count());
+			}
+			FreeListStats stats = GetThreadCache()->GetStats(SizeClass::Index(16));
+			std::lock_guard<std::mutex> lck(stats_mtx);
+			total_stats.num_fetch += stats.num_fetch;
+			total_stats.num_fetch_object += stats.num_fetch_object;
+			total_stats.num_release += stats.num_release;
+			total_stats.num_release_object += stats.num_release_object;
+			});
+	}
+	for (auto& t : vthread) {
+		t.join();
+	}
+	printf("%zu threads run concurrently, each thread runs %zu rounds, call MyMalloc for %zu times per round, costs %zu ms\n",
+		nworks, rounds, ntimes, malloc_costtime / 1000);
+	printf("%zu threads run concurrently, each thread runs %zu rounds, call MyFree for %zu times per round, costs %zu ms\n",
+		nworks, rounds, ntimes, free_costtime / 1000);
+	printf("%zu threads run concurrently, call MyMalloc and MyFree for %zu times, costs %zu ms\n",
+		nworks, nworks * rounds * ntimes, (malloc_costtime + free_costtime) / 1000);
+	printf("ThreadCache fetched %zu objects from CentralCache in %zu calls, released %zu objects in %zu calls\n",
+		total_stats.num_fetch_object, total_stats.num_fetch, total_stats.num_release_object, total_stats.num_release);
+}
+void BenchmarkMyFreeSized(size_t ntimes, size_t nworks, size_t rounds) {
+	std::vector<std::thread> vthread(nworks);
+	//各スレッドの経過時間(マイクロ秒)の合計
+	std::atomic<size_t> malloc_costtime{ 0 };
+	std::atomic<size_t> free_costtime{ 0 };
+	for (size_t k = 0; k < nworks; ++k) {
+		vthread[k] = std::thread([&]() {
+			std::vector<void*> v;
+			v.reserve(ntimes);
+			for (size_t j = 0; j < rounds; ++j) {
+				auto begin1 = std::chrono::steady_clock::now();
+				for (size_t i = 0; i < ntimes; i++) {
+					v.push_back(MyMalloc(16));
+				}
+				auto end1 = std::chrono::steady_clock::now();
+				auto begin2 = std::chrono::steady_clock::now();
+				for (size_t i = 0; i < ntimes; i++) {
+					MyFreeSized(v[i], 16);
+				}
+				auto end2 = std::chrono::steady_clock::now();
+				v.clear();
+				malloc_costtime += static_cast<size_t>(std::chrono::duration_cast<std::chrono::microseconds>(end1 - begin1).count());
+				free_costtime += static_cast<size_t>(std::chrono::duration_cast<std::chrono::microseconds>(end2 - begin2).count());
+			}
+			});
+	}
+	for (auto& t : vthread) {
+		t.join();
+	}
+	printf("%zu threads run concurrently, each thread runs %zu rounds, call MyMalloc for %zu times per round, costs %zu ms\n",
+		nworks, rounds, ntimes, malloc_costtime / 1000);
+	printf("%zu threads run concurrently, each thread runs %zu rounds, call MyFreeSized for %zu times per round, costs %zu ms\n",
+		nworks, rounds, ntimes, free_costtime / 1000);
+	printf("%zu threads run concurrently, call MyMalloc and MyFreeSized for %zu times, costs %zu ms\n",
+		nworks, nworks * rounds * ntimes, (malloc_costtime + free_costtime) / 1000);
+}
+//短命なスレッドを大量に作成、終了させ、RSSの推移を確認
+//各スレッドは色々な大きさの領域を確保して解放するため、終了時にThreadCacheに領域が残る
+void BenchmarkThreadChurn(size_t ntimes, size_t nworks, size_t rounds) {
+	size_t rss_begin = CurrentRssBytes();
+	for (size_t j = 0; j < rounds; ++j) {
+		std::vector<std::thread> vthread(nworks);
+		for (size_t k = 0; k < nworks; ++k) {
+			vthread[k] = std::thread([&, k]() {
+				std::vector<void*> v;
+				v.reserve(ntimes);
+				for (size_t i = 0; i < ntimes; i++) {
+					v.push_back(MyMalloc(((i + k) % 128 + 1) * 16));
+				}
+				for (size_t i = 0; i < ntimes; i++) {
+					MyFree(v[i]);
+				}
+				});
+		}
+		for (auto& t : vthread) {
+			t.join();
+		}
+		if (0 == (j + 1) % (rounds / 4 == 0 ? 1 : rounds / 4)) {
+			printf("%zu threads created and joined, RSS %zu KB (started at %zu KB)\n",
+				(j + 1) * nworks, CurrentRssBytes() >> 10, rss_begin >> 10);
+		}
+	}
+}
+
+//生産者スレッドが確保した領域を消費者スレッドが解放する場合のスループットとRSSを計測
+//remote_freeがtrueの場合、消費者が解放した領域は生産者のThreadCacheに戻る
+void BenchmarkProducerConsumer(size_t ntimes, size_t nproducers, size_t nconsumers, bool remote_free) {
+	const size_t kBatch = 256;
+	const size_t kMaxQueue = 64;
+	bool prev_remote_free = ThreadCache::IsRemoteFree();
+	ThreadCache::SetRemoteFree(remote_free);
+	std::mutex mtx;
+	std::condition_variable cv_push, cv_pop;
+	std::deque<std::vector<void*>> queue;
+	size_t num_producing = nproducers;
+	size_t rss_begin = CurrentRssBytes();
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> vthread;
+	for (size_t k = 0; k < nproducers; ++k) {
+		vthread.emplace_back([&]() {
+			for (size_t i = 0; i < ntimes; i += kBatch) {
+				std::vector<void*> batch;
+				batch.reserve(kBatch);
+				for (size_t j = 0; j < kBatch; ++j) {
+					batch.push_back(MyMalloc(64));
+				}
+				std::unique_lock<std::mutex> lck(mtx);
+				cv_push.wait(lck, [&]() { return queue.size() < kMaxQueue; });
+				queue.push_back(std::move(batch));
+				cv_pop.notify_one();
+			}
+			std::lock_guard<std::mutex> lck(mtx);
+			--num_producing;
+			cv_pop.notify_all();
+			});
+	}
+	for (size_t k = 0; k < nconsumers; ++k) {
+		vthread.emplace_back([&]() {
+			while (true) {
+				std::vector<void*> batch;
+				{
+					std::unique_lock<std::mutex> lck(mtx);
+					cv_pop.wait(lck, [&]() { return !queue.empty() || 0 == num_producing; });
+					if (queue.empty()) {
+						break;
+					}
+					batch = std::move(queue.front());
+					queue.pop_front();
+					cv_push.notify_one();
+				}
+				for (void* ptr : batch) {
+					MyFree(ptr);
+				}
+			}
+			});
+	}
+	for (auto& t : vthread) {
+		t.join();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	printf("remote free %s: %zu producers, %zu consumers, %zu objects, %.2f Mops/s, RSS %zu KB -> %zu KB\n",
+		remote_free ? "on " : "off", nproducers, nconsumers, nproducers * ntimes,
+		nproducers * ntimes / seconds / 1e6, rss_begin >> 10, CurrentRssBytes() >> 10);
+	ThreadCache::SetRemoteFree(prev_remote_free);
+}
+
+//nworks個のスレッドが色々な大きさの領域の確保と解放を繰り返す場合のスループットと、
+//全スレッドが終了する前(ThreadCacheが残っている状態)のRSSを、ThreadCacheとCpuCacheで比較
+void BenchmarkFrontEnd(size_t ntimes, size_t nworks, bool cpu_cache) {
+	const size_t kBatch = 64;
+	CpuCache::SetEnabled(cpu_cache);
+	std::mutex mtx;
+	std::condition_variable cv_done, cv_exit;
+	size_t num_done = 0;
+	bool exit = false;
+	size_t rss_begin = CurrentRssBytes();
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k) {
+		vthread[k] = std::thread([&, k]() {
+			void* v[kBatch];
+			for (size_t i = 0; i < ntimes; i += kBatch) {
+				for (size_t j = 0; j < kBatch; ++j) {
+					v[j] = MyMalloc(((i + j + k) % 64 + 1) * 16);
+				}
+				for (size_t j = 0; j < kBatch; ++j) {
+					MyFree(v[j]);
+				}
+			}
+			std::unique_lock<std::mutex> lck(mtx);
+			if (++num_done == nworks) {
+				cv_done.notify_one();
+			}
+			cv_exit.wait(lck, [&]() { return exit; });
+			});
+	}
+	size_t rss_peak = 0;
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		cv_done.wait(lck, [&]() { return num_done == nworks; });
+		rss_peak = CurrentRssBytes();
+		exit = true;
+		cv_exit.notify_all();
+	}
+	auto end = std::chrono::steady_clock::now();
+	for (auto& t : vthread) {
+		t.join();
+	}
+
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	printf("%s: %4zu threads, %.2f Mops/s, RSS %zu KB -> %zu KB before exit",
+		cpu_cache ? (CpuCache::GetInsatnce().IsRseq() ? "CpuCache(rseq)    " : "CpuCache(spinlock)") : "ThreadCache       ",
+		nworks, 2.0 * nworks * ntimes / seconds / 1e6, rss_begin >> 10, rss_peak >> 10);
+	if (cpu_cache) {
+		printf(", %zu KB cached", CpuCache::GetInsatnce().GetCachedBytes() >> 10);
+	}
+	printf("\n");
+	CpuCache::SetEnabled(false);
+}
+
+//nworks個のスレッドが16バイトの領域をThreadCacheの上限を超えて確保、解放し、CentralCacheのロックを取り合う場合の
+//スループットとロックを待った時間を、CentralCacheのシャード数ごとに計測
+void BenchmarkCentralContention(size_t ntimes, size_t nworks, size_t num_shard) {
+	const size_t kBatch = 4096;
+	CentralCache& central_cache = CentralCache::GetInsatnce();
+	size_t num_shard_default = central_cache.getShardCount();
+	central_cache.SetShardCount(num_shard);
+	size_t num_wait_begin = 0, wait_ns_begin = 0;
+	central_cache.GetLockWaitStats(num_wait_begin, wait_ns_begin);
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k) {
+		vthread[k] = std::thread([&]() {
+			std::vector<void*> v(kBatch);
+			for (size_t i = 0; i < ntimes; i += kBatch) {
+				for (size_t j = 0; j < kBatch; ++j) {
+					v[j] = MyMalloc(16);
+				}
+				for (size_t j = 0; j < kBatch; ++j) {
+					MyFree(v[j]);
+				}
+			}
+			});
+	}
+	for (auto& t : vthread) {
+		t.join();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	size_t num_wait_end = 0, wait_ns_end = 0;
+	central_cache.GetLockWaitStats(num_wait_end, wait_ns_end);
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	printf("%2zu shards, %2zu threads, %.2f Mops/s, waited for CentralCache locks %zu times, %.3f ms in total\n",
+		central_cache.getShardCount(), nworks, 2.0 * nworks * ntimes / seconds / 1e6,
+		num_wait_end - num_wait_begin, (wait_ns_end - wait_ns_begin) / 1e6);
+	central_cache.SetShardCount(num_shard_default);
+}
+
+//nworks個のスレッドが(64KB, 512KB]の領域をPageCacheから直接確保、解放し、PageCacheのロックを取り合う場合の
+//スループットとロックを待った時間を計測
+void BenchmarkLargeObject(size_t ntimes, size_t nworks) {
+	const size_t kLive = 8;
+	PageCache& page_cache = PageCache::GetInsatnce();
+	size_t num_wait_begin = 0, wait_ns_begin = 0;
+	page_cache.GetLockWaitStats(num_wait_begin, wait_ns_begin);
+	size_t rss_begin = CurrentRssBytes();
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k) {
+		vthread[k] = std::thread([&, k]() {
+			std::mt19937 rng(static_cast<unsigned>(k));
+			std::uniform_int_distribution<size_t> dist(kMaxBytes + 1, kMaxPage << kPageShift);
+			void* v[kLive] = {};
+			for (size_t i = 0; i < ntimes; ++i) {
+				void*& ptr = v[i % kLive];
+				if (nullptr != ptr) {
+					MyFree(ptr);
+				}
+				ptr = MyMalloc(dist(rng));
+			}
+			for (void* ptr : v) {
+				if (nullptr != ptr) {
+					MyFree(ptr);
+				}
+			}
+			});
+	}
+	for (auto& t : vthread) {
+		t.join();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	size_t num_wait_end = 0, wait_ns_end = 0;
+	page_cache.GetLockWaitStats(num_wait_end, wait_ns_end);
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	printf("%zu arenas, %2zu threads, %.2f Mops/s, waited for PageCache locks %zu times, %.3f ms in total, RSS %zu KB -> %zu KB\n",
+		page_cache.getArenaCount(), nworks, 2.0 * nworks * ntimes / seconds / 1e6,
+		num_wait_end - num_wait_begin, (wait_ns_end - wait_ns_begin) / 1e6, rss_begin >> 10, CurrentRssBytes() >> 10);
+}
+
+//プロセスの常駐メモリのうち、THPのヒュージページに載っているバイト数を取得、取得できない場合は0
+size_t AnonHugePageBytes() {
+#ifdef __linux__
+	size_t kb = 0;
+	FILE* fp = fopen("/proc/self/smaps_rollup", "r");
+	if (nullptr == fp) {
+		return 0;
+	}
+	char line[256];
+	while (nullptr != fgets(line, sizeof(line), fp)) {
+		if (1 == sscanf(line, "AnonHugePages: %zu kB", &kb)) {
+			break;
+		}
+	}
+	fclose(fp);
+	return kb << 10;
+#else
+	return 0;
+#endif
+}
+
+//(64KB, 512KB]の領域をnum_object個確保してランダムな順に読み書きし、TLBミスの影響を受けやすいアクセスの速さと、
+//PageCacheがヒュージページ単位でコミットしたバイト数を計測
+void BenchmarkHugePage(size_t num_object, size_t ntimes) {
+	const size_t kObjectBytes = kMaxBytes * 2;
+	std::vector<char*> v(num_object);
+	for (auto& ptr : v) {
+		ptr = static_cast<char*>(MyMalloc(kObjectBytes));
+		memset(ptr, 1, kObjectBytes);
+	}
+
+	std::mt19937 rng(12345);
+	std::uniform_int_distribution<size_t> dist(0, num_object * kObjectBytes - 1);
+	size_t sum = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < ntimes; ++i) {
+		size_t offset = dist(rng);
+		char& c = v[offset / kObjectBytes][offset % kObjectBytes];
+		sum += c;
+		c = static_cast<char>(sum);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	size_t huge_bytes = 0, huge_tlb_bytes = 0;
+	PageCache::GetInsatnce().GetHugePageStats(huge_bytes, huge_tlb_bytes);
+	double ns = std::chrono::duration<double, std::nano>(end - begin).count() / ntimes;
+	printf("%zu MB working set, %.2f ns per random access (checksum %zu)\n",
+		(num_object * kObjectBytes) >> 20, ns, sum & 0xff);
+	printf("PageCache committed %zu KB in hugepages (%zu KB by MAP_HUGETLB), AnonHugePages %zu KB\n",
+		huge_bytes >> 10, huge_tlb_bytes >> 10, AnonHugePageBytes() >> 10);
+	for (auto ptr : v) {
+		MyFree(ptr);
+	}
+}
+
+//(64KB, 512KB]の領域で合計bytesを一気に確保してから解放し(トラフィックの急増)、
+//その後ReleaseFreeMemoryとバックグラウンドのスレッドでRSSが下がるか、再利用時にページフォルトで戻るかを計測
+void BenchmarkRelease(size_t bytes) {
+	const size_t kObjectBytes = kMaxBytes * 2;
+	PageCache& page_cache = PageCache::GetInsatnce();
+	auto print = [&](const char* label) {
+		size_t huge_bytes = 0, huge_tlb_bytes = 0;
+		page_cache.GetHugePageStats(huge_bytes, huge_tlb_bytes);
+		printf("%-30s: RSS %7zu KB, committed %7zu KB, released %7zu KB\n",
+			label, CurrentRssBytes() >> 10, huge_bytes >> 10, page_cache.GetReleasedBytes() >> 10);
+	};
+	auto spike = [&]() {
+		std::vector<void*> v(bytes / kObjectBytes);
+		for (auto& ptr : v) {
+			ptr = MyMalloc(kObjectBytes);
+			memset(ptr, 1, kObjectBytes);
+		}
+		for (auto ptr : v) {
+			MyFree(ptr);
+		}
+	};
+
+	print("before spike");
+	spike();
+	print("after spike");
+	auto begin = std::chrono::steady_clock::now();
+	size_t bytes_released = page_cache.ReleaseFreeMemory(static_cast<size_t>(-1));
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	printf("ReleaseFreeMemory released %zu KB in %.3f ms\n", bytes_released >> 10, ms);
+	print("after ReleaseFreeMemory");
+	spike();
+	print("after second spike");
+	page_cache.SetReleaseInterval(std::chrono::milliseconds(50));
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+	page_cache.SetReleaseInterval(std::chrono::milliseconds(0));
+	print("after 50 ms background release");
+}
+
+//nworks個のスレッドが[1MB, 16MB]の領域の確保と解放を繰り返し、各ページに書き込む場合のスループットと、
+//解放した領域のキャッシュの再利用率を計測、limitはキャッシュの上限(0はキャッシュしない)
+void BenchmarkHugeObject(size_t ntimes, size_t nworks, size_t limit) {
+	PageCache& page_cache = PageCache::GetInsatnce();
+	page_cache.SetLargeCacheLimit(limit);
+	size_t num_hit_begin = 0, num_miss_begin = 0, cached_bytes = 0;
+	page_cache.GetLargeCacheStats(num_hit_begin, num_miss_begin, cached_bytes);
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k) {
+		vthread[k] = std::thread([&, k]() {
+			std::mt19937 rng(static_cast<unsigned>(k));
+			std::uniform_int_distribution<size_t> dist(1, 16);
+			for (size_t i = 0; i < ntimes; ++i) {
+				size_t bytes = dist(rng) << 20;
+				char* ptr = static_cast<char*>(MyMalloc(bytes));
+				for (size_t offset = 0; offset < bytes; offset += 1 << kPageShift) {
+					ptr[offset] = static_cast<char>(i);
+				}
+				MyFree(ptr);
 			}
 			});
 	}
 	for (auto& t : vthread) {
 		t.join();
 	}
-	printf("%u threads run concurrently, each thread runs %u rounds, call MyMalloc for %u times per round, costs %u ms\n",
-		nworks, rounds, ntimes, malloc_costtime);
-	printf("%u threads run concurrently, each thread runs %u rounds, call MyFree for %u times per round, costs %u ms\n",
-		nworks, rounds, ntimes, free_costtime);
-	printf("%u threads run concurrently, call MyMalloc and MyFree for %u times, costs %u ms\n",
-		nworks, nworks * rounds * ntimes, malloc_costtime + free_costtime);
+
+	auto end = std::chrono::steady_clock::now();
+	size_t num_hit_end = 0, num_miss_end = 0;
+	page_cache.GetLargeCacheStats(num_hit_end, num_miss_end, cached_bytes);
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	size_t num_hit = num_hit_end - num_hit_begin, num_miss = num_miss_end - num_miss_begin;
+	printf("cache limit %6zu KB, %2zu threads, %.2f Kops/s, hit rate %5.1f%% (%zu hits, %zu misses), %zu KB cached\n",
+		limit >> 10, nworks, 1.0 * nworks * ntimes / seconds / 1e3,
+		100.0 * num_hit / (num_hit + num_miss), num_hit, num_miss, cached_bytes >> 10);
+	page_cache.SetLargeCacheLimit(kDefaultLargeCacheBytes);
+}
+
+//1MBの領域を16MBまで1MBずつ広げる場合に、mremapとコピーにかかる時間を計測
+void BenchmarkHugeRealloc(size_t rounds) {
+	const size_t kMaxHugeBytes = 16 << 20;
+	PageCache& page_cache = PageCache::GetInsatnce();
+	auto begin1 = std::chrono::steady_clock::now();
+	size_t num_remap = 0;
+	for (size_t j = 0; j < rounds; ++j) {
+		char* ptr = static_cast<char*>(MyMalloc(1 << 20));
+		memset(ptr, 1, 1 << 20);
+		for (size_t bytes = 2 << 20; bytes <= kMaxHugeBytes; bytes += 1 << 20) {
+			char* new_ptr = static_cast<char*>(page_cache.SystemReallocPage(ptr, bytes >> kPageShift));
+			if (nullptr == new_ptr) {
+				new_ptr = static_cast<char*>(MyMalloc(bytes));
+				memcpy(new_ptr, ptr, bytes - (1 << 20));
+				MyFree(ptr);
+			}
+			else {
+				++num_remap;
+			}
+			ptr = new_ptr;
+			memset(ptr + bytes - (1 << 20), 1, 1 << 20);
+		}
+		MyFree(ptr);
+	}
+	auto end1 = std::chrono::steady_clock::now();
+
+	auto begin2 = std::chrono::steady_clock::now();
+	for (size_t j = 0; j < rounds; ++j) {
+		char* ptr = static_cast<char*>(MyMalloc(1 << 20));
+		memset(ptr, 1, 1 << 20);
+		for (size_t bytes = 2 << 20; bytes <= kMaxHugeBytes; bytes += 1 << 20) {
+			char* new_ptr = static_cast<char*>(MyMalloc(bytes));
+			memcpy(new_ptr, ptr, bytes - (1 << 20));
+			MyFree(ptr);
+			ptr = new_ptr;
+			memset(ptr + bytes - (1 << 20), 1, 1 << 20);
+		}
+		MyFree(ptr);
+	}
+	auto end2 = std::chrono::steady_clock::now();
+	printf("grow 1MB -> 16MB: mremap %.3f ms per chain (%zu remaps), copy %.3f ms per chain\n",
+		std::chrono::duration<double, std::milli>(end1 - begin1).count() / rounds, num_remap,
+		std::chrono::duration<double, std::milli>(end2 - begin2).count() / rounds);
+}
+
+//HeapProfilerのサンプリングのオーバーヘッドを計測
+//num_object個の領域を確保して解放するのを繰り返し、サンプリングしない場合と、16KBごとにサンプリングする場合の時間の差から
+//サンプル一回のコストを求め、各間隔でのスループットの低下(オーバーヘッド)を見積もる
+//数%の差は一つのCPUで直接測ってもぶれに埋もれるため、サンプルの多い間隔で測ったコストを確保したバイト数の比で換算する
+//サンプリングの回数は確保したバイト数に比例するため、大きさはRunWorkloadsのlognormalと同じ分布(中央値約90b)にする
+void BenchmarkHeapProfiler(size_t num_object, size_t rounds) {
+	const size_t kDenseInterval = 16 << 10;
+	std::vector<size_t> sizes(num_object);
+	std::mt19937 rng(12345);
+	std::lognormal_distribution<double> dist(4.5, 1.5);
+	size_t bytes_total = 0;
+	for (auto& bytes : sizes) {
+		bytes = static_cast<size_t>(dist(rng));
+		bytes = bytes < 1 ? 1 : (bytes > kMaxBytes ? kMaxBytes : bytes);
+		bytes_total += bytes;
+	}
+	std::vector<void*> v(num_object);
+	size_t prev_interval = HeapProfiler::getSampleInterval();
+	//二つの間隔を交互に切り替えながら5回ずつ測り、一回の確保と解放にかかった時間(ナノ秒)の最も速い結果を使う
+	double best_off = 0, best_dense = 0;
+	for (size_t k = 0; k < 6; ++k) {
+		for (size_t interval : { size_t(0), kDenseInterval }) {
+			HeapProfiler::SetSampleInterval(interval);
+			auto begin = std::chrono::steady_clock::now();
+			for (size_t j = 0; j < rounds; ++j) {
+				for (size_t i = 0; i < num_object; ++i) {
+					v[i] = MyMalloc(sizes[i]);
+				}
+				for (size_t i = 0; i < num_object; ++i) {
+					MyFree(v[i]);
+				}
+			}
+			double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / (num_object * rounds);
+			//1回目はThreadCacheを温めるためだけに使う
+			double& best = 0 == interval ? best_off : best_dense;
+			if (k > 0 && (0 == best || ns < best)) {
+				best = ns;
+			}
+		}
+	}
+	HeapProfiler::SetSampleInterval(prev_interval);
+
+	double bytes_per_op = static_cast<double>(bytes_total) / num_object;
+	double ns_per_sample = (best_dense - best_off) * kDenseInterval / bytes_per_op;
+	printf("sampling off: %.1f ns per malloc+free, %.0f bytes per malloc on average\n", best_off, bytes_per_op);
+	printf("sampling every %zu KB: %.1f ns per malloc+free, %.0f ns per sample\n", kDenseInterval >> 10, best_dense, ns_per_sample);
+	for (size_t interval : { size_t(512) << 10, size_t(1) << 20, size_t(2) << 20, size_t(4) << 20 }) {
+		printf("sampling every %4zu KB: estimated overhead %.2f%%%s\n", interval >> 10,
+			100.0 * ns_per_sample * bytes_per_op / interval / best_off, kDefaultHeapSampleInterval == interval ? " (default)" : "");
+	}
+}
+
+//呼び出し一回分の時間を計る時計、x86ではrdtscで読み、起動時にsteady_clockと比べてナノ秒に換算する
+//steady_clock::nowは数十ナノ秒かかり、MyMalloc一回分と同程度のため、x86以外でのみ使う
+class LatencyClock {
+public:
+	static uint64_t Now() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+	}
+
+	//Nowの差をナノ秒に換算
+	static double ToNanoseconds(uint64_t ticks) {
+		static const double kNanosecondsPerTick = Calibrate();
+		return ticks * kNanosecondsPerTick;
+	}
+private:
+	static double Calibrate() {
+		auto begin = std::chrono::steady_clock::now();
+		uint64_t ticks_begin = Now();
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		uint64_t ticks_end = Now();
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+		return ns / (ticks_end - ticks_begin);
+	}
+};
+
+//呼び出し一回分の時間の分布、2のべき乗ごとに8段階のバケットで数える
+//スレッドごとに持ち、全スレッドの終了後にMergeする
+class LatencyHistogram {
+public:
+	void Add(uint64_t ticks) {
+		++_counts[Bucket(ticks)];
+		++_num;
+	}
+
+	void Merge(const LatencyHistogram& another) {
+		for (size_t i = 0; i < kNumBucket; ++i) {
+			_counts[i] += another._counts[i];
+		}
+		_num += another._num;
+	}
+
+	//下からratioの位置の時間(ナノ秒)、バケットの上限で近似する
+	double Percentile(double ratio) const {
+		uint64_t rank = static_cast<uint64_t>(ratio * _num);
+		uint64_t sum = 0;
+		for (size_t i = 0; i < kNumBucket; ++i) {
+			sum += _counts[i];
+			if (sum > rank) {
+				return LatencyClock::ToNanoseconds(UpperBound(i));
+			}
+		}
+		return 0;
+	}
+private:
+	static const size_t kNumBucket = 64 * 8;
+
+	static size_t Bucket(uint64_t ticks) {
+		if (ticks < 8) {
+			return static_cast<size_t>(ticks);
+		}
+		size_t log2 = FloorLog2(ticks);
+		return log2 * 8 + ((ticks >> (log2 - 3)) & 7);
+	}
+
+	static uint64_t UpperBound(size_t bucket) {
+		if (bucket < 8) {
+			return bucket + 1;
+		}
+		size_t log2 = bucket / 8;
+		return (uint64_t(8 + bucket % 8 + 1) << (log2 - 3));
+	}
+
+	uint64_t _counts[kNumBucket] = {};
+	uint64_t _num = 0;
+};
+
+//ワークロードの確保する大きさの分布
+enum class SizeDistribution {
+	kUniform,	//[min_bytes, max_bytes]の一様分布
+	kLogNormal,	//対数正規分布、[min_bytes, max_bytes]に収める
+	kTrace,		//実際のプログラムで記録した大きさを順に使う
+};
+
+//ワークロードの設定
+struct Workload {
+	const char* name = "";
+	SizeDistribution distribution = SizeDistribution::kUniform;
+	size_t min_bytes = 1;
+	size_t max_bytes = 1024;
+	//対数正規分布の、大きさの対数の平均と標準偏差
+	double log_mean = 0;
+	double log_sigma = 0;
+	//kTraceで使う大きさの列
+	const std::vector<size_t>* trace = nullptr;
+	//スレッドごとの操作の回数
+	size_t ntimes = 200000;
+	//短命な領域を保持しておく数、これを超えると古いものから解放する
+	size_t num_short_lived = 1024;
+	//確保した領域のうち、最後まで解放しない(長命な)ものの割合
+	double long_lived_ratio = 0;
+	//解放のうち、隣のスレッドに渡して解放してもらうものの割合
+	double remote_free_ratio = 0;
+	//操作のうち、確保の代わりに短命な領域をreallocで1.5倍に広げるものの割合(max_bytesを超えたら解放して確保し直す)
+	double realloc_ratio = 0;
+};
+
+//ワークロードから呼び出す確保、解放の関数
+struct SystemAllocator {
+	static const char* Name() { return "malloc"; }
+	static void* Malloc(size_t bytes) { return malloc(bytes); }
+	static void Free(void* ptr) { free(ptr); }
+	static void* Realloc(void* ptr, size_t bytes) { return realloc(ptr, bytes); }
+};
+
+struct PoolAllocator {
+	static const char* Name() { return "MyMalloc"; }
+	static void* Malloc(size_t bytes) { return MyMalloc(bytes); }
+	static void Free(void* ptr) { MyFree(ptr); }
+	static void* Realloc(void* ptr, size_t bytes) { return MyRealloc(ptr, bytes); }
+};
+
+//スレッドごとの状態、他のスレッドからも読み書きする部分はキャッシュラインを分ける
+struct alignas(64) WorkloadThread {
+	//他のスレッドから渡された、このスレッドが解放する領域
+	std::mutex mtx;
+	std::vector<void*> remote;
+	//このスレッドが確保したまま解放していないバイト数
+	std::atomic<size_t> live_bytes{ 0 };
+	LatencyHistogram malloc_latency;
+	LatencyHistogram free_latency;
+	LatencyHistogram realloc_latency;
+	size_t num_op = 0;
+};
+
+//確保した領域の[begin, end)のページに書き込み、RSSに反映させる
+inline void Touch(void* ptr, size_t begin, size_t end) {
+	for (size_t offset = begin; offset < end; offset += 1 << kPageShift) {
+		static_cast<char*>(ptr)[offset] = 1;
+	}
+}
+
+//ワークロードをnworks個のスレッドで実行し、スループット、一回の呼び出しの時間の分布、RSSの最大値と断片化を出力
+//出力はCSVの一行で、RunWorkloadsが最初にヘッダを出力する
+template <class Allocator>
+void RunWorkload(const Workload& workload, size_t nworks) {
+	std::vector<WorkloadThread> threads(nworks);
+	std::atomic<bool> running{ true };
+	size_t rss_begin = CurrentRssBytes();
+	size_t rss_peak = rss_begin, live_peak = 0;
+	//別のスレッドで1msごとにRSSと使用中のバイト数を調べ、最大値を記録
+	std::thread monitor([&]() {
+		while (running.load(std::memory_order_relaxed)) {
+			size_t rss = CurrentRssBytes();
+			size_t live = 0;
+			for (auto& t : threads) {
+				live += t.live_bytes.load(std::memory_order_relaxed);
+			}
+			rss_peak = rss > rss_peak ? rss : rss_peak;
+			live_peak = live > live_peak ? live : live_peak;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		});
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k) {
+		vthread[k] = std::thread([&, k]() {
+			WorkloadThread& self = threads[k];
+			WorkloadThread& next = threads[(k + 1) % nworks];
+			std::mt19937_64 rng(k + 1);
+			std::uniform_real_distribution<double> coin(0, 1);
+			std::uniform_int_distribution<size_t> uniform(workload.min_bytes, workload.max_bytes);
+			std::lognormal_distribution<double> lognormal(workload.log_mean, workload.log_sigma);
+			size_t trace_pos = k * 7919;
+			auto next_bytes = [&]() -> size_t {
+				size_t bytes = 0;
+				switch (workload.distribution) {
+				case SizeDistribution::kUniform:
+					return uniform(rng);
+				case SizeDistribution::kLogNormal:
+					bytes = static_cast<size_t>(lognormal(rng));
+					break;
+				case SizeDistribution::kTrace:
+					bytes = (*workload.trace)[trace_pos++ % workload.trace->size()];
+					break;
+				}
+				return bytes < workload.min_bytes ? workload.min_bytes : (bytes > workload.max_bytes ? workload.max_bytes : bytes);
+			};
+			size_t live_bytes = 0;
+			auto do_malloc = [&](size_t bytes) {
+				uint64_t t0 = LatencyClock::Now();
+				void* ptr = Allocator::Malloc(bytes);
+				self.malloc_latency.Add(LatencyClock::Now() - t0);
+				Touch(ptr, 0, bytes);
+				live_bytes += bytes;
+				return ptr;
+			};
+			auto do_free = [&](void* ptr) {
+				uint64_t t0 = LatencyClock::Now();
+				Allocator::Free(ptr);
+				self.free_latency.Add(LatencyClock::Now() - t0);
+			};
+
+			struct Object {
+				void* ptr;
+				size_t bytes;
+			};
+			std::vector<Object> short_lived(workload.num_short_lived, Object{ nullptr, 0 });
+			std::vector<void*> long_lived;
+			std::vector<void*> remote;
+			for (size_t i = 0; i < workload.ntimes; ++i) {
+				Object& slot = short_lived[i % short_lived.size()];
+				//短命な領域を広げる
+				if (nullptr != slot.ptr && coin(rng) < workload.realloc_ratio && slot.bytes * 3 / 2 <= workload.max_bytes) {
+					size_t bytes = slot.bytes * 3 / 2;
+					uint64_t t0 = LatencyClock::Now();
+					slot.ptr = Allocator::Realloc(slot.ptr, bytes);
+					self.realloc_latency.Add(LatencyClock::Now() - t0);
+					Touch(slot.ptr, slot.bytes, bytes);
+					live_bytes += bytes - slot.bytes;
+					slot.bytes = bytes;
+					++self.num_op;
+					continue;
+				}
+				//古い短命な領域を解放、一部は隣のスレッドに渡す
+				if (nullptr != slot.ptr) {
+					live_bytes -= slot.bytes;
+					if (nworks > 1 && coin(rng) < workload.remote_free_ratio) {
+						remote.push_back(slot.ptr);
+					}
+					else {
+						do_free(slot.ptr);
+						++self.num_op;
+					}
+					slot.ptr = nullptr;
+				}
+				size_t bytes = next_bytes();
+				void* ptr = do_malloc(bytes);
+				++self.num_op;
+				if (coin(rng) < workload.long_lived_ratio) {
+					long_lived.push_back(ptr);
+				}
+				else {
+					slot = Object{ ptr, bytes };
+				}
+				//64回ごとに、渡す領域を隣のスレッドに渡し、渡された領域を解放
+				if (0 == i % 64) {
+					if (!remote.empty()) {
+						std::lock_guard<std::mutex> lck(next.mtx);
+						next.remote.insert(next.remote.end(), remote.begin(), remote.end());
+						remote.clear();
+					}
+					std::vector<void*> received;
+					{
+						std::lock_guard<std::mutex> lck(self.mtx);
+						received.swap(self.remote);
+					}
+					for (void* p : received) {
+						do_free(p);
+						++self.num_op;
+					}
+				}
+				self.live_bytes.store(live_bytes, std::memory_order_relaxed);
+			}
+			for (auto& slot : short_lived) {
+				if (nullptr != slot.ptr) {
+					do_free(slot.ptr);
+				}
+			}
+			for (void* p : long_lived) {
+				do_free(p);
+			}
+			std::lock_guard<std::mutex> lck(next.mtx);
+			next.remote.insert(next.remote.end(), remote.begin(), remote.end());
+			});
+	}
+	for (auto& t : vthread) {
+		t.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+	running = false;
+	monitor.join();
+
+	LatencyHistogram malloc_latency, free_latency, realloc_latency;
+	size_t num_op = 0;
+	for (auto& t : threads) {
+		for (void* p : t.remote) {
+			Allocator::Free(p);
+		}
+		malloc_latency.Merge(t.malloc_latency);
+		free_latency.Merge(t.free_latency);
+		realloc_latency.Merge(t.realloc_latency);
+		num_op += t.num_op;
+	}
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	size_t rss_delta = rss_peak - rss_begin;
+	printf("%s,%s,%zu,%zu,%.2f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%zu,%zu,%.2f\n",
+		workload.name, Allocator::Name(), nworks, num_op, num_op / seconds / 1e6,
+		malloc_latency.Percentile(0.5), malloc_latency.Percentile(0.99), malloc_latency.Percentile(0.999),
+		free_latency.Percentile(0.5), free_latency.Percentile(0.99), free_latency.Percentile(0.999),
+		realloc_latency.Percentile(0.5), realloc_latency.Percentile(0.99), realloc_latency.Percentile(0.999),
+		rss_delta >> 10, live_peak >> 10, 0 == live_peak ? 0.0 : static_cast<double>(rss_delta) / live_peak);
+	fflush(stdout);
+}
+
+//RunWorkloadを実行、POSIXではRSSを他の実行と分けるため、fork()した子プロセスで実行する
+//子プロセスは実行前のヒープを引き継ぐため、ヒープをあまり使っていないプロセスから呼び出すこと
+template <class Allocator>
+void RunWorkloadIsolated(const Workload& workload, size_t nworks) {
+#ifdef _WIN32
+	RunWorkload<Allocator>(workload, nworks);
+#else
+	fflush(stdout);
+	pid_t pid = fork();
+	if (0 == pid) {
+		RunWorkload<Allocator>(workload, nworks);
+		_exit(0);
+	}
+	if (pid < 0) {
+		RunWorkload<Allocator>(workload, nworks);
+		return;
+	}
+	waitpid(pid, nullptr, 0);
+#endif
+}
+
+//trace_pathのファイル(一行に一つの大きさ)から大きさの列を読み込む、読めない場合は空
+std::vector<size_t> LoadTraceSizes(const char* trace_path) {
+	std::vector<size_t> sizes;
+	FILE* fp = fopen(trace_path, "r");
+	if (nullptr == fp) {
+		return sizes;
+	}
+	size_t bytes = 0;
+	while (1 == fscanf(fp, "%zu", &bytes)) {
+		if (bytes > 0) {
+			sizes.push_back(bytes);
+		}
+	}
+	fclose(fp);
+	return sizes;
+}
+
+//色々なワークロードをmallocとMyMallocで実行し、CSVで比較する
+//rdtscで呼び出し一回ずつの時間を計り、malloc、free、reallocごとにp50、p99、p99.9を出力する(reallocしないワークロードでは0)
+//rss_peak_kbは開始時からのRSSの増加の最大値、rss_per_liveはそれを使用中のバイト数の最大値で割った値(断片化の目安)
+//trace_pathを指定した場合、そのファイルの大きさの列を使うワークロードも実行する
+void RunWorkloads(const char* trace_path) {
+	std::vector<Workload> workloads;
+	Workload uniform;
+	uniform.name = "uniform";
+	uniform.min_bytes = 1;
+	uniform.max_bytes = 1024;
+	workloads.push_back(uniform);
+
+	Workload lognormal;
+	lognormal.name = "lognormal";
+	lognormal.distribution = SizeDistribution::kLogNormal;
+	lognormal.max_bytes = 1 << 20;
+	lognormal.log_mean = 4.5;
+	lognormal.log_sigma = 1.5;
+	workloads.push_back(lognormal);
+
+	Workload mixed = lognormal;
+	mixed.name = "long-lived-mix";
+	mixed.long_lived_ratio = 0.05;
+	mixed.ntimes = 100000;
+	workloads.push_back(mixed);
+
+	Workload remote = lognormal;
+	remote.name = "cross-thread";
+	remote.remote_free_ratio = 0.5;
+	workloads.push_back(remote);
+
+	Workload chain;
+	chain.name = "realloc-chain";
+	chain.min_bytes = 16;
+	chain.max_bytes = 1 << 20;
+	chain.realloc_ratio = 0.3;
+	chain.num_short_lived = 64;
+	chain.ntimes = 20000;
+	workloads.push_back(chain);
+
+	std::vector<size_t> trace;
+	if (nullptr != trace_path) {
+		trace = LoadTraceSizes(trace_path);
+		if (trace.empty()) {
+			printf("could not read sizes from %s, skipping the trace workload\n", trace_path);
+		}
+		else {
+			Workload recorded;
+			recorded.name = "trace";
+			recorded.distribution = SizeDistribution::kTrace;
+			recorded.trace = &trace;
+			recorded.max_bytes = static_cast<size_t>(-1);
+			workloads.push_back(recorded);
+		}
+	}
+
+	printf("workload,allocator,threads,ops,mops,malloc_p50_ns,malloc_p99_ns,malloc_p999_ns,"
+		"free_p50_ns,free_p99_ns,free_p999_ns,realloc_p50_ns,realloc_p99_ns,realloc_p999_ns,rss_peak_kb,live_peak_kb,rss_per_live\n");
+	for (const Workload& workload : workloads) {
+		for (size_t nworks : { 1, 4, 16 }) {
+			RunWorkloadIsolated<SystemAllocator>(workload, nworks);
+			RunWorkloadIsolated<PoolAllocator>(workload, nworks);
+		}
+	}
+}
+
+void BenchmarkSizeClass(size_t rounds) {
+	//[1,kMaxBytes]のすべてのバイト数をシャッフルし、240個のサイズクラスを満遍なく引く
+	std::vector<size_t> v;
+	v.reserve(kMaxBytes);
+	for (size_t bytes = 1; bytes <= kMaxBytes; ++bytes) {
+		v.push_back(bytes);
+	}
+	std::shuffle(v.begin(), v.end(), std::mt19937(12345));
+
+	//表と分岐での計算結果が一致するか確認
+	size_t num_mismatch = 0;
+	for (size_t bytes : v) {
+		size_t index = SizeClass::Index(bytes);
+		const SizeClassInfo& info = SizeClass::Info(index);
+		if (index != SizeClassFormula::Index(bytes)
+			|| info.bytes_object != SizeClassFormula::RoundUp(bytes)
+			|| info.num_fetch_object != SizeClassFormula::NumFetchObject(info.bytes_object)
+			|| info.num_fetch_page != SizeClassFormula::NumFetchPage(info.bytes_object)) {
+			++num_mismatch;
+		}
+	}
+
+	//ThreadCache::Deallocateが一回の呼び出しで必要とするIndex、RoundUp、NumFetchObjectを計測
+	volatile size_t sink = 0;
+	size_t sum = 0;
+	auto begin1 = std::chrono::steady_clock::now();
+	for (size_t j = 0; j < rounds; ++j) {
+		for (size_t bytes : v) {
+			size_t bytes_aligned = SizeClassFormula::RoundUp(bytes);
+			sum += SizeClassFormula::Index(bytes) + SizeClassFormula::NumFetchObject(bytes_aligned);
+		}
+	}
+	auto end1 = std::chrono::steady_clock::now();
+	sink = sum;
+	sum = 0;
+	auto begin2 = std::chrono::steady_clock::now();
+	for (size_t j = 0; j < rounds; ++j) {
+		for (size_t bytes : v) {
+			size_t index = SizeClass::Index(bytes);
+			sum += index + SizeClass::Info(index).num_fetch_object;
+		}
+	}
+	auto end2 = std::chrono::steady_clock::now();
+	sink = sum;
+	(void)sink;
+
+	double num_call = static_cast<double>(rounds * v.size());
+	double formula_ns = std::chrono::duration<double, std::nano>(end1 - begin1).count() / num_call;
+	double table_ns = std::chrono::duration<double, std::nano>(end2 - begin2).count() / num_call;
+	printf("%zu size classes, %zu sizes, %zu mismatches between table and formula\n",
+		kNumFreeList, v.size(), num_mismatch);
+	printf("formula(RoundUp + Index + NumFetchObject) costs %.2f ns per call\n", formula_ns);
+	printf("table(Index + Info) costs %.2f ns per call\n", table_ns);
 }
-int main()
+//引数なし: RunWorkloads以外の計測を実行
+//workload [trace]: RunWorkloadsのみ実行、traceは一行に一つの大きさを書いたファイル
+//RunWorkloadsは実行ごとにfork()して時間がかかるため、引数なしでは実行しない
+int main(int argc, char** argv)
 {
+	if (argc >= 2 && std::string(argv[1]) == "workload") {
+		//RunWorkloadsは子プロセスでRSSを測るため、ヒープを使う前に実行
+		RunWorkloads(argc >= 3 ? argv[2] : nullptr);
+		return 0;
+	}
 	std::cout << "=========================================malloc=========================================" << std::endl;
 	BenchmarkMalloc(10000, 4, 100);
 	std::cout << "========================================================================================" << std::endl;
@@ -82,5 +1107,64 @@ int main()
 	std::cout << "========================================MyMalloc========================================" << std::endl;
 	BenchmarkMyMalloc(10000, 4, 100);
 	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "======================================MyFreeSized=======================================" << std::endl;
+	BenchmarkMyFreeSized(10000, 4, 100);
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "======================================ThreadChurn=======================================" << std::endl;
+	BenchmarkThreadChurn(1000, 8, 500);
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "===================================ProducerConsumer=====================================" << std::endl;
+	BenchmarkProducerConsumer(1000000, 2, 4, false);
+	BenchmarkProducerConsumer(1000000, 2, 4, true);
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "=======================================FrontEnd=========================================" << std::endl;
+	for (size_t nworks : { 4, 64, 1024 }) {
+		BenchmarkFrontEnd(200000, nworks, true);
+		BenchmarkFrontEnd(200000, nworks, false);
+	}
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "===================================CentralContention====================================" << std::endl;
+	for (size_t nworks : { 1, 4, 16, 64 }) {
+		BenchmarkCentralContention(200000, nworks, 1);
+		if (GetCpuCount() > 1) {
+			BenchmarkCentralContention(200000, nworks, GetCpuCount());
+		}
+	}
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "======================================LargeObject=======================================" << std::endl;
+	for (size_t nworks : { 1, 4, 16 }) {
+		BenchmarkLargeObject(20000, nworks);
+	}
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "======================================HugeObject========================================" << std::endl;
+	for (size_t nworks : { 1, 4 }) {
+		BenchmarkHugeObject(500, nworks, 0);
+		BenchmarkHugeObject(500, nworks, kDefaultLargeCacheBytes);
+	}
+	BenchmarkHugeRealloc(20);
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "======================================HeapProfiler======================================" << std::endl;
+	BenchmarkHeapProfiler(1000, 2000);
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "=======================================HugePage=========================================" << std::endl;
+	BenchmarkHugePage(1024, 10000000);
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "========================================Release=========================================" << std::endl;
+	BenchmarkRelease(256 << 20);
+	std::cout << "========================================================================================" << std::endl;
+	std::cout << std::endl << std::endl;;
+	std::cout << "=======================================SizeClass========================================" << std::endl;
+	BenchmarkSizeClass(100);
+	std::cout << "========================================================================================" << std::endl;
 	return 0;
 }
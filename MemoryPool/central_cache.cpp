@@ -7,44 +7,86 @@ CentralCache& CentralCache::GetInsatnce() {
 	std::unique_lock<std::mutex> lck(_mtx, std::defer_lock);
 	lck.lock();
 	if (nullptr == _p_instance) {
-		_p_instance.reset(new CentralCache());
+		_p_instance = NewObject<CentralCache>();
 	}
 	lck.unlock();
 	return *_p_instance;
 }
 
+//サイズクラスごとに、TransferCacheが保持できるバッチの数をkTransferCacheBytesから決める
+CentralCache::CentralCache() {
+	for (size_t index = 0; index < kNumFreeList; ++index) {
+		const SizeClassInfo& info = SizeClass::Info(index);
+		size_t max_batch = kTransferCacheBytes / (info.bytes_object * info.num_fetch_object);
+		if (max_batch < 1) max_batch = 1;
+		if (max_batch > kMaxTransferBatch) max_batch = kMaxTransferBatch;
+		_transfer_caches[index].max_batch = max_batch;
+	}
+	SetShardCount(GetCpuCount());
+}
+
+//サイズクラスごとのSpanListを分割する数を設定、[1, kMaxCentralShard]に丸める
+void CentralCache::SetShardCount(size_t num_shard) {
+	if (num_shard < 1) num_shard = 1;
+	if (num_shard > kMaxCentralShard) num_shard = kMaxCentralShard;
+	_num_shard.store(num_shard, std::memory_order_relaxed);
+}
+
+//shard番目のShardを取得、まだない場合は作成
+CentralCache::Shard& CentralCache::GetShard(size_t shard) {
+	Shard* p_shard = _shards[shard].load(std::memory_order_acquire);
+	if (nullptr != p_shard) {
+		return *p_shard;
+	}
+	std::lock_guard<std::mutex> lck(_mtx);
+	p_shard = _shards[shard].load(std::memory_order_relaxed);
+	if (nullptr == p_shard) {
+		p_shard = NewObject<Shard>();
+		_shards[shard].store(p_shard, std::memory_order_release);
+	}
+	return *p_shard;
+}
+
 //大きさがbytes_objectの領域をnum_object個取得するのを申し込み、実際にnum_acture個を取得
-size_t CentralCache::FetchRange(void*& start, void*& end, size_t num_object, size_t bytes_object) {
+//一度に取得する数以上を申し込んだ場合、TransferCacheにバッチがあればそれをそのまま渡す
+//取得元のSpanにはownerが取得したことを記録する
+size_t CentralCache::FetchRange(void*& start, void*& end, size_t num_object, size_t bytes_object, uint64_t owner) {
 	Span* p_span = nullptr;
 	size_t index = SizeClass::Index(bytes_object);
-	SpanList& span_list = _span_lists[index];
-
-	//マルチスレッド対応
-	span_list.Lock();
-
-	//span_listを走査し、未使用のメモリ領域を保有するSpanを取得
-	auto itr = span_list.Begin();
-	while (span_list.End() != itr) {
-		if (!itr->Empty()) {
-			p_span = &itr;
-			break;
-		}
-		else {
-			++itr;
+	MEMORY_POOL_LATENCY_SCOPE(kCentralFetchRange, index);
+	size_t num_fetch_object = SizeClass::Info(index).num_fetch_object;
+	if (num_object >= num_fetch_object && RemoveBatch(index, start, end)) {
+		if (kNoSpanOwner != owner) {
+			AddBatchOwner(start, end, owner);
 		}
+		return num_fetch_object;
 	}
+	//呼び出し元のCPUのシャードから取得
+	size_t shard = GetCurrentCpu() % getShardCount();
+	Shard& r_shard = GetShard(shard);
+	SpanList& span_list = r_shard.span_lists[index];
+
+	//マルチスレッド対応
+	span_list.Lock(_lock_wait_stats, index);
 
-	//span_listにあるすべてのSpanが余剰メモリがない場合、PageCacheからSpanを一つ取得
-	if (span_list.End() == itr) {
+	//span_listには未使用のメモリ領域を保有するSpanのみあるため、先頭のSpanから取得
+	//span_listが空の場合、PageCacheからSpanを一つ取得
+	if (span_list.Empty()) {
 		p_span = FetchSpanFromPageCache(bytes_object);
+		p_span->setShard(shard);
 		span_list.PushFront(p_span);
+		++r_shard.num_span_fetch[index];
+	}
+	else {
+		p_span = &span_list.Begin();
 	}
 	size_t num_acture = p_span->FetchRange(start, end, num_object);
+	p_span->AddOwner(owner);
 
-	//p_spanからメモリ取得後p_spanが空になった場合、それをspan_listの最後に置き、チューニング
+	//p_spanからメモリ取得後p_spanが空になった場合、それをempty_span_listsに移す
 	if (p_span->Empty()) {
 		span_list.Erase(p_span);
-		span_list.PushBack(p_span);
+		r_shard.empty_span_lists[index].PushFront(p_span);
 	}
 
 	//マルチスレッド対応
@@ -53,6 +95,25 @@ size_t CentralCache::FetchRange(void*& start, void*& end, size_t num_object, siz
 	return num_acture;
 }
 
+//TransferCacheから渡す[start, end]の領域が所属するSpanに、ownerが取得したことを記録
+//バッチの領域は同じSpanに続けて並んでいることが多いため、直前のSpanの範囲内であればページIDから引き直さない
+//領域が使用中のSpanはPageCacheに戻らないため、ロックなしで範囲を読んでもよい
+void CentralCache::AddBatchOwner(void* start, void* end, uint64_t owner) {
+	PageId begin_id = 0, end_id = 0;
+	for (void* ptr = start; ; ptr = NextObject(ptr)) {
+		PageId id = reinterpret_cast<PageId>(ptr) >> kPageShift;
+		if (id < begin_id || id >= end_id) {
+			Span* p_span = PageCache::GetInsatnce().GetSpanRefFromPageId(id);
+			begin_id = p_span->getStartPageId();
+			end_id = begin_id + p_span->getTotalPageCount();
+			p_span->AddOwner(owner);
+		}
+		if (ptr == end) {
+			break;
+		}
+	}
+}
+
 //CentralCacheにメモリ領域が足りない場合、PageCacheからSpanを一つ取得し、そのFreeListを用意
 Span* CentralCache::FetchSpanFromPageCache(size_t bytes_object) {
 
@@ -65,7 +126,7 @@ Span* CentralCache::FetchSpanFromPageCache(size_t bytes_object) {
 	char* start = (char*)(p_span->getStartPageId() << kPageShift);
 	char* end = start + (p_span->getTotalPageCount() << kPageShift);
 	//bytes_object区切りでメモリを小さい領域に切って、一個ずつp_spanのFreeListに入れる
-	while (start < end) {
+	while (start + bytes_object <= end) {
 		char* obj = start;
 		start += bytes_object;
 		p_span->AddObject(obj);
@@ -76,11 +137,16 @@ Span* CentralCache::FetchSpanFromPageCache(size_t bytes_object) {
 }
 
 //メモリ領域のリストをそれが所属するSpanに返す
+//一度に取得する数ちょうどのリストは、TransferCacheに空きがあればSpanに戻さずにそのまま保持する
 void CentralCache::ReleaseListToSpans(void* start, void* end, size_t num_free, size_t bytes_object) {
 	size_t index = SizeClass::Index(bytes_object);
-	SpanList& span_list = _span_lists[index];
-	//マルチスレッド対応
-	span_list.Lock();
+	if (num_free == SizeClass::Info(index).num_fetch_object && InsertBatch(index, start, end)) {
+		return;
+	}
+	//Spanが所属するシャードのロックを保持し、シャードが変わる場合のみロックを取り直す
+	//同じスレッドが取得した領域はほとんど同じシャードのため、ロックの取り直しは少ない
+	size_t shard = kMaxCentralShard;
+	Shard* p_shard = nullptr;
 
 	//ThreadCacheから返還したメモリ領域リストの領域を一つずつそれが所属するSpanに戻す
 	while (start) {
@@ -90,26 +156,45 @@ void CentralCache::ReleaseListToSpans(void* start, void* end, size_t num_free, s
 		//ページのIDからそのページが所属するSpanを取得し、メモリ領域を返還
 		Span* p_span = PageCache::GetInsatnce().GetSpanRefFromPageId(id);
 		if (p_span) {
+			//マルチスレッド対応
+			if (p_span->getShard() != shard) {
+				if (nullptr != p_shard) {
+					p_shard->span_lists[index].UnLock();
+				}
+				shard = p_span->getShard();
+				p_shard = &GetShard(shard);
+				p_shard->span_lists[index].Lock(_lock_wait_stats, index);
+			}
+			//空だったSpanは再び取得できるようになるため、span_listの最後に戻す
+			//先頭のSpanから取得し続けることで、使用中の領域が少数のSpanに集まる
+			if (p_span->Empty()) {
+				p_shard->empty_span_lists[index].Erase(p_span);
+				p_shard->span_lists[index].PushBack(p_span);
+			}
 			p_span->RestoreObject(start);
-		}
 
-		//上記取得したp_spanが保有するメモリ領域は一つでも利用されていない場合、p_spanをPageCacheに返す
-		if (p_span->Full()) {
-			ReleaseSpanToPageCache(p_span);
+			//上記取得したp_spanが保有するメモリ領域は一つでも利用されていない場合、p_spanをPageCacheに返す
+			if (p_span->Full()) {
+				ReleaseSpanToPageCache(p_span);
+			}
 		}
 
 		start = next;
 	}
 
 	//マルチスレッド対応
-	span_list.UnLock();
+	if (nullptr != p_shard) {
+		p_shard->span_lists[index].UnLock();
+	}
 }
 
 //保有するメモリ領域が一つも利用されていない場合、SpanをPageCacheに返還
 void CentralCache::ReleaseSpanToPageCache(Span* p_span) {
-	//CentralCacheのSpanListからp_spanを削除
+	//CentralCacheのSpanListからp_spanを削除、すべての領域が返されたSpanはspan_listsにある
 	size_t index = SizeClass::Index(p_span->getObjectSize());
-	_span_lists[index].Erase(p_span);
+	Shard& r_shard = GetShard(p_span->getShard());
+	r_shard.span_lists[index].Erase(p_span);
+	++r_shard.num_span_release[index];
 
 	//p_spanのFreeListをクリアし、メモリ領域に関する情報を削除
 	//ページに関する情報のみそのまま保持する
@@ -117,3 +202,64 @@ void CentralCache::ReleaseSpanToPageCache(Span* p_span) {
 
 	PageCache::GetInsatnce().FreeSpan(p_span);
 }
+
+//TransferCacheからバッチを一つ取り出す、空の場合はfalseを返す
+bool CentralCache::RemoveBatch(size_t index, void*& start, void*& end) {
+	TransferCache& transfer_cache = _transfer_caches[index];
+	_lock_wait_stats.Lock(transfer_cache.mtx);
+	std::lock_guard<std::mutex> lck(transfer_cache.mtx, std::adopt_lock);
+	if (0 == transfer_cache.num_batch) {
+		++transfer_cache.num_miss;
+		return false;
+	}
+	++transfer_cache.num_hit;
+	TransferCache::Batch& batch = transfer_cache.batches[--transfer_cache.num_batch];
+	start = batch.start;
+	end = batch.end;
+	return true;
+}
+
+//TransferCacheにバッチを一つ入れる、満杯の場合はfalseを返す
+bool CentralCache::InsertBatch(size_t index, void* start, void* end) {
+	TransferCache& transfer_cache = _transfer_caches[index];
+	_lock_wait_stats.Lock(transfer_cache.mtx);
+	std::lock_guard<std::mutex> lck(transfer_cache.mtx, std::adopt_lock);
+	if (transfer_cache.num_batch == transfer_cache.max_batch) {
+		return false;
+	}
+	TransferCache::Batch& batch = transfer_cache.batches[transfer_cache.num_batch++];
+	batch.start = start;
+	batch.end = end;
+	return true;
+}
+
+//サイズクラスindexの統計情報を取得、各シャードとTransferCacheのロックを順に取る
+//ロックを取る間にも他のスレッドが取得、解放するため、層をまたいだ合計はおおよその値となる
+CentralCacheStats CentralCache::GetStats(size_t index) {
+	CentralCacheStats stats;
+	size_t bytes_object = SizeClass::Info(index).bytes_object;
+	for (size_t shard = 0; shard < kMaxCentralShard; ++shard) {
+		Shard* p_shard = _shards[shard].load(std::memory_order_acquire);
+		if (nullptr == p_shard) {
+			continue;
+		}
+		SpanList& span_list = p_shard->span_lists[index];
+		std::lock_guard<std::mutex> lck(span_list.getMutex());
+		stats.num_span_fetch += p_shard->num_span_fetch[index];
+		stats.num_span_release += p_shard->num_span_release[index];
+		for (SpanList* p_list : { &span_list, &p_shard->empty_span_lists[index] }) {
+			for (SpanListIterator it = p_list->Begin(); it != p_list->End(); ++it) {
+				size_t num_object = (it->getTotalPageCount() << kPageShift) / bytes_object;
+				++stats.num_span;
+				stats.num_object += num_object;
+				stats.num_free_object += num_object - it->getUsedObjectCount();
+			}
+		}
+	}
+	TransferCache& transfer_cache = _transfer_caches[index];
+	std::lock_guard<std::mutex> lck(transfer_cache.mtx);
+	stats.num_transfer_object = transfer_cache.num_batch * SizeClass::Info(index).num_fetch_object;
+	stats.num_transfer_hit = transfer_cache.num_hit;
+	stats.num_transfer_miss = transfer_cache.num_miss;
+	return stats;
+}
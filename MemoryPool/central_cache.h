@@ -2,6 +2,23 @@
 #include "common.h"
 #include "page_cache.h"
 
+//CentralCacheのサイズクラス一つ分の統計情報
+struct CentralCacheStats {
+	//保有しているSpanの数(空いている領域がないSpanを含む)と、それらのSpanの領域の数
+	size_t num_span = 0;
+	size_t num_object = 0;
+	//Spanに戻っている空いている領域の数
+	size_t num_free_object = 0;
+	//TransferCacheが保持している領域の数
+	size_t num_transfer_object = 0;
+	//TransferCacheからバッチを渡せた回数と、空だった回数
+	size_t num_transfer_hit = 0;
+	size_t num_transfer_miss = 0;
+	//PageCacheからSpanを取得した回数と、PageCacheに返した回数
+	size_t num_span_fetch = 0;
+	size_t num_span_release = 0;
+};
+
 class CentralCache {
 public:
 	//シングルトン
@@ -12,13 +29,33 @@ public:
 	static CentralCache& GetInsatnce();
 
 	//大きさがbytes_objectの領域をnum_object個取得するのを申し込み、実際にnum_acture個を取得
-	size_t FetchRange(void*& start, void*& end, size_t num_object, size_t bytes_object);
+	//取得元のSpanにownerが取得したことを記録する(Span::AddOwner)
+	size_t FetchRange(void*& start, void*& end, size_t num_object, size_t bytes_object, uint64_t owner = kNoSpanOwner);
 	//メモリ領域のリストをそれが所属するSpanに返す
 	void ReleaseListToSpans(void* start, void* end, size_t num_free, size_t bytes_object);
+
+	//サイズクラスごとのSpanListを分割する数を設定、[1, kMaxCentralShard]に丸める
+	//Spanは取得したシャードに所属したままのため、途中で変更してもよい
+	void SetShardCount(size_t num_shard);
+
+	size_t getShardCount() {
+		return _num_shard.load(std::memory_order_relaxed);
+	}
+
+	//ロックを待った回数と時間の合計を取得
+	void GetLockWaitStats(size_t& num_wait, size_t& wait_ns) {
+		num_wait = _lock_wait_stats.getWaitCount();
+		wait_ns = _lock_wait_stats.getWaitNanoseconds();
+	}
+
+	//サイズクラスindexの統計情報を取得、各シャードとTransferCacheのロックを順に取る
+	CentralCacheStats GetStats(size_t index);
 private:
 	//シングルトン
-	CentralCache() {};
-	inline static std::unique_ptr<CentralCache> _p_instance;
+	//システムのヒープを経由しないようObjectPoolで生成し、プロセス終了まで破棄しない
+	CentralCache();
+	friend class ObjectPool<CentralCache>;
+	inline static CentralCache* _p_instance = nullptr;
 	inline static std::mutex _mtx;
 
 	//CentralCacheにメモリ領域が足りない場合、PageCacheからSpanを一つ取得し、そのFreeListを用意
@@ -26,6 +63,50 @@ private:
 	//保有するメモリ領域が一つも利用されていない場合、SpanをPageCacheに返還
 	void ReleaseSpanToPageCache(Span* p_span);
 
-	SpanList _span_lists[kNumFreeList];
+	//TransferCacheからバッチを一つ取り出す、空の場合はfalseを返す
+	bool RemoveBatch(size_t index, void*& start, void*& end);
+	//TransferCacheから渡す[start, end]の領域が所属するSpanに、ownerが取得したことを記録
+	void AddBatchOwner(void* start, void* end, uint64_t owner);
+	//TransferCacheにバッチを一つ入れる、満杯の場合はfalseを返す
+	bool InsertBatch(size_t index, void* start, void* end);
+
+	//サイズクラスごとのSpanListを、呼び出し元のCPUによって分割したもの
+	//同じサイズクラスでも、別のシャードのスレッドとはロックを取り合わない
+	struct Shard {
+		//未使用のメモリ領域を保有するSpanのリスト、FetchRangeは先頭のSpanから取得する
+		SpanList span_lists[kNumFreeList];
+		//すべてのメモリ領域が使用中のSpanのリスト、span_listsのロックで保護する
+		SpanList empty_span_lists[kNumFreeList];
+		//PageCacheからSpanを取得した回数と、PageCacheに返した回数、span_listsのロックで保護する
+		//シャードはCPUごとのため、他のCPUとカウンタを取り合わない
+		size_t num_span_fetch[kNumFreeList] = {};
+		size_t num_span_release[kNumFreeList] = {};
+	};
+	//shard番目のShardを取得、まだない場合は作成
+	Shard& GetShard(size_t shard);
+	std::atomic<Shard*> _shards[kMaxCentralShard] = {};
+	std::atomic<size_t> _num_shard{ 1 };
+
+	//SpanList、TransferCacheのロックを待った回数と時間
+	LockWaitStats _lock_wait_stats;
+
+	//ThreadCacheが一度に取得する数(num_fetch_object)ちょうどで返した領域のリスト(バッチ)を、
+	//Spanに戻さずにそのまま保持し、次に同じ数を申し込んだThreadCacheにそのまま渡す
+	//Spanを走査したりページIDからSpanを引いたりするのは、TransferCacheが空か満杯の場合のみとなる
+	struct TransferCache {
+		struct Batch {
+			void* start;
+			void* end;
+		};
+		std::mutex mtx;
+		//保持しているバッチの数と、保持できるバッチの数
+		size_t num_batch = 0;
+		size_t max_batch = 0;
+		//バッチを渡せた回数と、空だった回数
+		size_t num_hit = 0;
+		size_t num_miss = 0;
+		Batch batches[kMaxTransferBatch];
+	};
+	TransferCache _transfer_caches[kNumFreeList];
 };
 
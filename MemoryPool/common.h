@@ -1,12 +1,23 @@
 ﻿#pragma once
+#include<atomic>
 #include<cassert>
+#include<cstdint>
+#include<cstdlib>
 #include<unordered_map>
+#include <chrono>
+#include <memory>
 #include <mutex>
+#include <new>
+#include "latency_stats.h"
 
 #ifdef _WIN32
 #include<Windows.h>
 #else
-//brk、mmapなど
+#include<sys/mman.h>
+#include<unistd.h>
+#endif
+#ifdef __linux__
+#include<sched.h>
 #endif
 
 //ThreadCacheが扱うバイト数の最大値、16ページ(1ページ==4kb)
@@ -22,11 +33,240 @@ const size_t kMaxPage = 128;
 //ページIDとメモリ領域へのポインタとの変換用シフト値
 const size_t kPageShift = 12;
 
+//すべてのThreadCacheが保有できるバイト数の合計のデフォルト値、ThreadCache::SetOverallBudgetで変更可能
+const size_t kDefaultOverallThreadCacheBytes = 32 << 20;
+//ThreadCache一つが保有できるバイト数の上限の最小値と最大値
+const size_t kMinThreadCacheBytes = kMaxBytes * 4;
+const size_t kMaxThreadCacheBytes = 4 << 20;
+//ThreadCacheが上限に達した場合、一回で増やす上限のバイト数
+const size_t kStealBytes = kMaxBytes;
+//リモート解放の宛先としてThreadCacheを番号で引く表の大きさ、これを超えて同時に存在するThreadCacheにはリモート解放しない
+const size_t kMaxThreadCacheSlot = 4096;
+//Spanの所有者のうち、ThreadCacheの番号でないもの
+//所有者がいない(PageCacheから取得した直後)ことと、複数のThreadCacheが取得したことを表す
+const uint64_t kNoSpanOwner = 0;
+const uint64_t kSharedSpanOwner = 1;
+
+//CentralCacheのTransferCacheがサイズクラスごとに保持できるバッチの数の最大値と、バイト数の目安
+//バイト数の目安から決めた数が1を下回る場合も、一つは保持する
+const size_t kMaxTransferBatch = 64;
+const size_t kTransferCacheBytes = kMaxBytes * 4;
+
+//CentralCacheを分割する数の最大値、デフォルトはCPUの数
+const size_t kMaxCentralShard = 64;
+//PageCacheのアリーナの数の最大値、CPUの数がこれより少ない場合はCPUの数
+const size_t kMaxPageArena = 8;
+
+//CpuCacheのサイズクラス一つが保有できるバイト数の目安、ただし一度に取得する数を下回らない
+const size_t kCpuCacheClassBytes = kMaxBytes / 4;
+//CpuCacheを用意するCPUの数の上限
+const size_t kMaxCpu = 1024;
+
+//POSIXにおいて、mmapで一度に予約する仮想アドレス空間のページ数(64MB)
+//予約した領域からヒュージページ単位でコミットし、kMaxPageページずつPageCacheに渡す
+const size_t kRegionPageShift = 14;
+const size_t kRegionPage = 1 << kRegionPageShift;
+//ヒュージページ(2MB)のページ数
+const size_t kHugePagePage = (2 << 20) >> kPageShift;
+//PageCacheがSpanを選ぶ際、使用中のページが多いヒュージページを探すために調べるSpanの数の上限
+const size_t kMaxHugePageScan = 8;
+
+//kMaxPageを超えるページ数の確保は、2のべき乗ごとに8段階のサイズクラスに切り上げ、解放後もキャッシュして再利用する
+//サイズクラスの数と、キャッシュが保有できるバイト数のデフォルト値(PageCache::SetLargeCacheLimitで変更可能)
+const size_t kNumLargeClass = 8 * 32;
+const size_t kDefaultLargeCacheBytes = 64 << 20;
+//キャッシュに同じサイズクラスの領域がない場合に、代わりに使う一つ上のサイズクラスの数
+const size_t kLargeClassSlack = 2;
+//TraceRecorderのスレッドごとのバッファのページ数
+const size_t kTraceBufferPage = 16;
+//HeapProfilerがサンプリングする平均のバイト間隔のデフォルト値と、記録するスタックトレースの深さの上限
+const size_t kDefaultHeapSampleInterval = 2 << 20;
+const size_t kMaxStackDepth = 32;
+//HeapProfilerがサンプリングした領域をポインタから引くハッシュ表のバケット数
+const size_t kHeapProfileBuckets = 1 << 16;
+
 //FreeListのノードに保存する次のノードを取得
 inline void*& NextObject(void* obj) {
 	return *(static_cast<void**>(obj));
 }
 
+//一つのスレッドだけが書き込み、他のスレッドは読み出すだけの値にnumを足す(引く)
+//書き込みは競合しないため、fetch_addではなくload/storeで済ませ、通常の加算と同じ命令にする
+inline void RelaxedAdd(std::atomic<size_t>& value, size_t num) {
+	value.store(value.load(std::memory_order_relaxed) + num, std::memory_order_relaxed);
+}
+
+inline void RelaxedSub(std::atomic<size_t>& value, size_t num) {
+	value.store(value.load(std::memory_order_relaxed) - num, std::memory_order_relaxed);
+}
+
+//システムからnum_page個のページを直接確保、PageCacheを経由しない
+inline void* SystemAlloc(size_t num_page) {
+#ifdef _WIN32
+	void* ptr = VirtualAlloc(0, num_page << kPageShift, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void* ptr = mmap(nullptr, num_page << kPageShift, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == ptr) ptr = nullptr;
+#endif
+	if (ptr == nullptr) throw std::bad_alloc();
+	return ptr;
+}
+
+//SystemAllocで確保したnum_page個のページをシステムに解放
+inline void SystemFree(void* ptr, size_t num_page) {
+#ifdef _WIN32
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, num_page << kPageShift);
+#endif
+}
+
+//呼び出し元のスレッドが実行されているCPUの番号を取得、取得できない場合は0
+inline size_t GetCurrentCpu() {
+#if defined(_WIN32)
+	return GetCurrentProcessorNumber();
+#elif defined(__linux__)
+	int cpu = sched_getcpu();
+	return cpu < 0 ? 0 : static_cast<size_t>(cpu);
+#else
+	return 0;
+#endif
+}
+
+//CPUの数を取得
+inline size_t GetCpuCount() {
+#ifdef _WIN32
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	return system_info.dwNumberOfProcessors;
+#else
+	long num_cpu = sysconf(_SC_NPROCESSORS_CONF);
+	return num_cpu > 0 ? static_cast<size_t>(num_cpu) : 1;
+#endif
+}
+
+//xの最下位の1のbitの位置を取得、xは0でないこと
+inline size_t CountTrailingZeros(uint64_t x) {
+	assert(0 != x);
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#else
+	return static_cast<size_t>(__builtin_ctzll(x));
+#endif
+}
+
+//xの最上位の1のbitの位置を取得、xは0でないこと
+inline size_t FloorLog2(uint64_t x) {
+	assert(0 != x);
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return index;
+#else
+	return static_cast<size_t>(63 - __builtin_clzll(x));
+#endif
+}
+
+//ロックを待った回数と時間の合計を記録するクラス
+class LockWaitStats {
+public:
+	//mtxをロックし、他のスレッドが保持していて待った場合はその回数と時間を記録
+	//待たなかった場合は時刻を取得しない
+	void Lock(std::mutex& mtx) {
+		if (mtx.try_lock()) {
+			return;
+		}
+		auto begin = std::chrono::steady_clock::now();
+		mtx.lock();
+		auto wait = std::chrono::steady_clock::now() - begin;
+		_num_wait.fetch_add(1, std::memory_order_relaxed);
+		_wait_ns.fetch_add(static_cast<size_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count()),
+			std::memory_order_relaxed);
+	}
+
+	size_t getWaitCount() {
+		return _num_wait.load(std::memory_order_relaxed);
+	}
+
+	size_t getWaitNanoseconds() {
+		return _wait_ns.load(std::memory_order_relaxed);
+	}
+private:
+	std::atomic<size_t> _num_wait{ 0 };
+	std::atomic<size_t> _wait_ns{ 0 };
+};
+
+//アロケータ内部で利用する固定長オブジェクト(Span、ThreadCacheなど)のプール
+//システムから直接確保したページを切り分けて使い、解放されたオブジェクトは専用のリストで再利用する
+//mallocやoperator newを一切経由しないため、MyMallocをプロセス全体のmallocに置き換えても再帰しない
+template <class T>
+class ObjectPool {
+public:
+	//Tを一つ生成
+	T* New() {
+		void* obj = nullptr;
+		{
+			std::lock_guard<std::mutex> lck(_mtx);
+			if (nullptr != _free_list) {
+				obj = _free_list;
+				_free_list = NextObject(obj);
+			}
+			else {
+				//切り分けられる領域が足りない場合、システムから新しく確保
+				if (_remain_bytes < kObjectBytes) {
+					size_t num_page = (kObjectBytes >> kPageShift) + 1;
+					if (num_page < kMaxPage) num_page = kMaxPage;
+					_memory = static_cast<char*>(SystemAlloc(num_page));
+					_remain_bytes = num_page << kPageShift;
+				}
+				obj = _memory;
+				_memory += kObjectBytes;
+				_remain_bytes -= kObjectBytes;
+			}
+		}
+		return new(obj) T();
+	}
+
+	//Newで生成したTを破棄し、領域をリストに戻す
+	void Delete(T* obj) {
+		obj->~T();
+		std::lock_guard<std::mutex> lck(_mtx);
+		NextObject(obj) = _free_list;
+		_free_list = obj;
+	}
+private:
+	//オブジェクト一つ当たりのバイト数、リストのポインタを格納できる大きさ以上で、Tのアライメントに揃える
+	static constexpr size_t kAlign = alignof(T) < sizeof(void*) ? sizeof(void*) : alignof(T);
+	static constexpr size_t kObjectBytes = (sizeof(T) + kAlign - 1) & ~(kAlign - 1);
+
+	//システムから確保した領域のうち、まだ切り分けていない部分の先頭
+	char* _memory = nullptr;
+	//_memoryから切り分けられるバイト数
+	size_t _remain_bytes = 0;
+	//Deleteで返されたオブジェクトのリスト
+	void* _free_list = nullptr;
+	//マルチスレッド対策
+	std::mutex _mtx;
+};
+
+//型ごとに一つのObjectPool、定数初期化されるため静的初期化の順番に依存しない
+template <class T>
+inline ObjectPool<T> object_pool;
+
+//アロケータ内部で利用するオブジェクトをObjectPoolから生成
+template <class T>
+T* NewObject() {
+	return object_pool<T>.New();
+}
+
+//NewObjectで生成したオブジェクトを破棄
+template <class T>
+void DeleteObject(T* obj) {
+	object_pool<T>.Delete(obj);
+}
+
 //メモリ領域を片方向リストで管理するクラス
 class FreeList {
 public:
@@ -35,27 +275,27 @@ public:
 	}
 
 	size_t Size() {
-		return _num_object;
+		return _num_object.load(std::memory_order_relaxed);
 	}
 
 	void Push(void* obj) {
 		NextObject(obj) = _free_list;
 		_free_list = obj;
-		++_num_object;
+		RelaxedAdd(_num_object, 1);
 	}
 
 	//区切ったメモリ領域を纏めてリストに挿入、numは領域の数を表す
 	void PushRange(void* start, void* end, size_t num) {
 		NextObject(end) = _free_list;
 		_free_list = start;
-		_num_object += num;
+		RelaxedAdd(_num_object, num);
 	}
 
 	void* Pop() {
 		assert(_free_list);
 		void* ret = _free_list;
 		_free_list = NextObject(_free_list);
-		--_num_object;
+		RelaxedSub(_num_object, 1);
 		return ret;
 	}
 	//FreeListからnum_object個の領域を取得する
@@ -74,19 +314,41 @@ public:
 		end = prev;
 		NextObject(end) = nullptr;
 		_free_list = cur;
-		_num_object -= num_acture;
+		RelaxedSub(_num_object, num_acture);
 		return num_acture;
 	}
 
 	void Clear() {
 		_free_list = nullptr;
-		_num_object = 0;
+		_num_object.store(0, std::memory_order_relaxed);
+	}
+
+	size_t getMaxSize() {
+		return _max_size.load(std::memory_order_relaxed);
+	}
+
+	void setMaxSize(size_t new_size) {
+		_max_size.store(new_size, std::memory_order_relaxed);
+	}
+
+	size_t getOverageCount() {
+		return _num_overage;
+	}
+
+	void setOverageCount(size_t new_count) {
+		_num_overage = new_count;
 	}
 private:
 	//FreeListが管理するメモリ領域のリストの頭に指すポインタ
 	void* _free_list = nullptr;
 	//FreeListが管理するメモリ領域の数
-	size_t _num_object = 0;
+	//ThreadCacheの統計情報として他のスレッドから読むため、アトミックにする(書き込むのは一つのスレッドだけ)
+	std::atomic<size_t> _num_object{ 0 };
+	//ThreadCacheにおいて、保有できる領域の数の上限
+	//1から始め、CentralCacheからの取得が続くと増やし、上限を超えた解放が続くと減らす
+	std::atomic<size_t> _max_size{ 1 };
+	//ThreadCacheにおいて、上限を超えてCentralCacheに解放した連続回数
+	size_t _num_overage = 0;
 };
 #ifdef _WIN32
 typedef unsigned int PageId;
@@ -95,12 +357,12 @@ typedef unsigned long long PageId;
 #endif// _WIN32
 
 //バイト数を切り上げる関数、バイト数からFreeListの配列のindexを計算する関数
-//などのUtilを保有するクラス
-class SizeClass {
+//などを分岐で計算するクラス
+//実行時はSizeClassの表を引くため、ここの関数は表の生成(コンパイル時)とベンチマークのみに使う
+class SizeClassFormula {
 public:
 	//bytesを切り上げる
-	static inline size_t RoundUp(size_t bytes) {
-		assert(bytes <= kMaxBytes);
+	static constexpr size_t RoundUp(size_t bytes) {
 		//bytes∈[1,128]：8byteごとに切り上げ、8、16、24...128、freelist[0]～freelist[15]に対応、計16個
 		if (bytes <= 128) {
 			return RoundUp(bytes, 8);
@@ -121,51 +383,148 @@ public:
 	}
 
 	//bytesをalignごとに区切って切り上げる
-	static inline size_t RoundUp(size_t bytes, size_t align) {
+	static constexpr size_t RoundUp(size_t bytes, size_t align) {
 		return (((bytes)+align - 1) & ~(align - 1));
 	}
 
 	//bytesからFreeListの配列のindexを算出
-	static inline size_t Index(size_t bytes) {
-		assert(bytes <= kMaxBytes);
-		static int group_array[4] = { 16, 56, 56, 112 };
+	static constexpr size_t Index(size_t bytes) {
 		if (bytes <= 128) {
 			return Index(bytes, 3);
 		}
 		else if (bytes <= 1024) {
-			return Index(bytes - 128, 4) + group_array[0];
+			return Index(bytes - 128, 4) + 16;
 		}
 		else if (bytes <= 8192) {
-			return Index(bytes - 1024, 7) + group_array[1] + group_array[0];
+			return Index(bytes - 1024, 7) + 56 + 16;
 		}
 		else if (bytes <= 65536) {
-			return Index(bytes - 8192, 9) + group_array[2] + group_array[1] + group_array[0];
+			return Index(bytes - 8192, 9) + 56 + 56 + 16;
 		}
 		return -1;
 	}
 
 	//bytesとalign_shiftよりFreeListの配列のindexを計算
-	static inline size_t Index(size_t bytes, size_t align_shift) {
-		return ((bytes + (1 << align_shift) - 1) >> align_shift) - 1;
+	static constexpr size_t Index(size_t bytes, size_t align_shift) {
+		return ((bytes + (size_t(1) << align_shift) - 1) >> align_shift) - 1;
 	}
 
 	//bytes_objectよりCentralCacheから取得するメモリ領域の数を算出
-	static size_t NumFetchObject(size_t bytes_object) {
+	static constexpr size_t NumFetchObject(size_t bytes_object) {
 		if (bytes_object == 0) return 0;
-		int num = static_cast<int>(kMaxBytes / bytes_object);
+		size_t num = kMaxBytes / bytes_object;
 		if (num < 2)num = 2;
 		if (num > 512)num = 512;
 		return num;
 	}
 
 	//bytes_objectよりPageCacheから取得するページ数を算出
-	static PageId NumFetchPage(size_t bytes_object) {
+	static constexpr PageId NumFetchPage(size_t bytes_object) {
 		size_t num_object = NumFetchObject(bytes_object);
-		PageId num_page = (num_object * bytes_object) >> kPageShift;
+		PageId num_page = static_cast<PageId>((num_object * bytes_object) >> kPageShift);
 		if (num_page == 0)	num_page = 1;
 		return num_page;
 	}
+};
+
+//サイズクラス一つ分の情報
+struct SizeClassInfo {
+	//切り上げ後のバイト数
+	size_t bytes_object;
+	//CentralCacheから一度に取得する、またはCentralCacheに一度に返すメモリ領域の数
+	size_t num_fetch_object;
+	//CentralCacheがPageCacheから一度に取得するページ数
+	PageId num_fetch_page;
+	//ThreadCacheのFreeListが保有できる領域の数の上限
+	size_t num_max_cache_object;
+};
+
+//ThreadCacheのFreeListが保有できる領域の数の上限、ただし一度に取得する数を下回らない
+const size_t kMaxFreeListSize = 8192;
+//ThreadCacheのFreeListが保有できるバイト数の上限、ただし一度に取得する数を下回らない
+const size_t kMaxFreeListBytes = kMaxBytes * 4;
+
+//1024byte以下は(bytes+7)>>3、それを超える場合は(bytes+127+(120<<7))>>7でkClassArrayを引く
+//1024byteを超える部分は128byte刻みで、1024byte以下の部分の続きのindexになる
+const size_t kMaxSmallBytes = 1024;
+const size_t kClassArraySize = ((kMaxBytes + 127 + (120 << 7)) >> 7) + 1;
+
+//SizeClassが引く表
+struct SizeClassTable {
+	//ClassArrayIndex(bytes)からサイズクラスのindexへの表
+	unsigned char class_array[kClassArraySize];
+	//サイズクラスのindexからその情報への表
+	SizeClassInfo infos[kNumFreeList];
+};
+
+//SizeClassFormulaでSizeClassTableをコンパイル時に生成
+constexpr SizeClassTable MakeSizeClassTable() {
+	SizeClassTable table = {};
+	for (size_t bytes = 0; bytes <= kMaxBytes; bytes += 8) {
+		size_t array_index = (bytes <= kMaxSmallBytes) ? ((bytes + 7) >> 3) : ((bytes + 127 + (120 << 7)) >> 7);
+		size_t index = SizeClassFormula::Index(bytes == 0 ? 1 : bytes);
+		table.class_array[array_index] = static_cast<unsigned char>(index);
+	}
+	for (size_t bytes = 8; bytes <= kMaxBytes; bytes += 8) {
+		size_t bytes_object = SizeClassFormula::RoundUp(bytes);
+		SizeClassInfo& info = table.infos[SizeClassFormula::Index(bytes)];
+		info.bytes_object = bytes_object;
+		info.num_fetch_object = SizeClassFormula::NumFetchObject(bytes_object);
+		info.num_fetch_page = SizeClassFormula::NumFetchPage(bytes_object);
+		size_t num_max = kMaxFreeListBytes / bytes_object;
+		if (num_max > kMaxFreeListSize) num_max = kMaxFreeListSize;
+		if (num_max < info.num_fetch_object) num_max = info.num_fetch_object;
+		info.num_max_cache_object = num_max - num_max % info.num_fetch_object;
+	}
+	return table;
+}
+
+inline constexpr SizeClassTable kSizeClassTable = MakeSizeClassTable();
 
+//バイト数を切り上げる関数、バイト数からFreeListの配列のindexを計算する関数
+//などのUtilを保有するクラス
+//コンパイル時に生成した表を引くため、分岐がほぼなく表一回の読み込みで済む
+class SizeClass {
+public:
+	//bytesを切り上げる
+	static inline size_t RoundUp(size_t bytes) {
+		return Info(Index(bytes)).bytes_object;
+	}
+
+	//bytesをalignごとに区切って切り上げる
+	static inline size_t RoundUp(size_t bytes, size_t align) {
+		return SizeClassFormula::RoundUp(bytes, align);
+	}
+
+	//bytesからFreeListの配列のindexを算出
+	static inline size_t Index(size_t bytes) {
+		assert(bytes <= kMaxBytes);
+		return kSizeClassTable.class_array[ClassArrayIndex(bytes)];
+	}
+
+	//indexのサイズクラスの情報を取得
+	static inline const SizeClassInfo& Info(size_t index) {
+		assert(index < kNumFreeList);
+		return kSizeClassTable.infos[index];
+	}
+
+	//bytes_objectよりCentralCacheから取得するメモリ領域の数を算出
+	static inline size_t NumFetchObject(size_t bytes_object) {
+		return Info(Index(bytes_object)).num_fetch_object;
+	}
+
+	//bytes_objectよりPageCacheから取得するページ数を算出
+	static inline PageId NumFetchPage(size_t bytes_object) {
+		return Info(Index(bytes_object)).num_fetch_page;
+	}
+private:
+	//bytesからkSizeClassTable.class_arrayのindexを算出
+	static inline size_t ClassArrayIndex(size_t bytes) {
+		if (bytes <= kMaxSmallBytes) {
+			return (bytes + 7) >> 3;
+		}
+		return (bytes + 127 + (120 << 7)) >> 7;
+	}
 };
 
 //CentralCache、PageCacheにおいて、それが確保するメモリ領域を管理するクラス
@@ -199,6 +558,7 @@ public:
 		_free_list.Clear();
 		setObjectSize(0);
 		setUsedObjectCount(0);
+		owner.store(kNoSpanOwner, std::memory_order_relaxed);
 	}
 
 	bool Empty() {
@@ -209,6 +569,16 @@ public:
 		return !_free_list.Empty() && 0 == getUsedObjectCount();
 	}
 
+	//PageCacheからCentralCacheまたはユーザに渡され、利用中であるか
+	//PageCacheはこれがfalseのSpanのみMergeする
+	bool InUse() {
+		return in_use;
+	}
+
+	void setInUse(bool new_in_use) {
+		in_use = new_in_use;
+	}
+
 	PageId getStartPageId() {
 		return start_page_id;
 	}
@@ -240,6 +610,64 @@ public:
 	void setObjectSize(size_t new_size) {
 		object_size = new_size;
 	}
+
+	size_t getShard() {
+		return shard;
+	}
+
+	void setShard(size_t new_shard) {
+		shard = new_shard;
+	}
+
+	size_t getArena() {
+		return arena;
+	}
+
+	void setArena(size_t new_arena) {
+		arena = new_arena;
+	}
+
+	uint64_t getFreeSince() {
+		return free_since;
+	}
+
+	void setFreeSince(uint64_t new_free_since) {
+		free_since = new_free_since;
+	}
+
+	uint32_t getSampledObjectCount() {
+		return sampled_object_count.load(std::memory_order_relaxed);
+	}
+
+	void setSampledObjectCount(uint32_t new_count) {
+		sampled_object_count.store(new_count, std::memory_order_relaxed);
+	}
+
+	uint64_t getOwner() {
+		return owner.load(std::memory_order_relaxed);
+	}
+
+	//new_ownerがこのSpanから領域を取得したことを記録
+	//所有者がいなければnew_ownerを所有者とし、別の所有者がいる、またはnew_ownerがkNoSpanOwnerの場合は共有とする
+	//共有になったSpanはClearまで共有のままのため、所有者が記録されていれば、使用中の領域はすべてその所有者が取得したもの
+	//TransferCacheのバッチを渡す場合はSpanのロックなしで呼び出すため、所有者の設定はCASで行う
+	void AddOwner(uint64_t new_owner) {
+		uint64_t cur = owner.load(std::memory_order_relaxed);
+		if (kNoSpanOwner != new_owner) {
+			if (cur == new_owner) {
+				return;
+			}
+			if (kNoSpanOwner == cur && owner.compare_exchange_strong(cur, new_owner, std::memory_order_relaxed)) {
+				return;
+			}
+			if (cur == new_owner) {
+				return;
+			}
+		}
+		if (kSharedSpanOwner != cur) {
+			owner.store(kSharedSpanOwner, std::memory_order_relaxed);
+		}
+	}
 private:
 	//Spanが保有するメモリ領域の一番小さいページID
 	PageId start_page_id = 0;
@@ -249,6 +677,21 @@ private:
 	size_t used_object_count = 0;
 	//該当Spanが保有するメモリ領域一つ当たりの大きさ
 	size_t object_size = 0;
+	//このSpanを保有するCentralCacheのシャード
+	size_t shard = 0;
+	//このSpanのページを管理するPageCacheのアリーナ
+	size_t arena = 0;
+	//PageCacheから渡され、利用中であるか、PageCacheのアリーナのロックで保護する
+	bool in_use = false;
+	//PageCacheに返された時刻(ナノ秒)、PageCacheのアリーナのロックで保護する
+	uint64_t free_since = 0;
+	//HeapProfilerがサンプリングした使用中の領域の数、HeapProfilerのロックで保護する
+	//解放の際にロックなしで読み、0であればHeapProfilerの表を引かない
+	std::atomic<uint32_t> sampled_object_count{ 0 };
+	//このSpanから領域を取得したThreadCacheの番号(ThreadCache::getOwnerId)、他のスレッドからの解放をそこに戻す
+	//複数のThreadCacheが取得した場合はkSharedSpanOwner
+	//解放する側はロックなしで読むためアトミックにする
+	std::atomic<uint64_t> owner{ kNoSpanOwner };
 	//メモリを管理するFreeList
 	FreeList _free_list;
 };
@@ -338,7 +781,7 @@ private:
 class SpanList {
 public:
 	SpanList() {
-		_head = new Span();//TODO
+		_head = NewObject<Span>();
 		_head->next = _head;
 		_head->prev = _head;
 	}
@@ -399,11 +842,41 @@ public:
 		return SpanListIterator(_head);
 	}
 
+	std::mutex& getMutex() {
+		return _mtx;
+	}
+
 	void Lock() {
 		_mtx.lock();
 	}
 
+	//lock_wait_statsで待った回数と時間を記録しながらロック
+	//MEMORY_POOL_LATENCYの場合、待った時間と保持した時間をサイズクラスindexのヒストグラムにも記録する
+	void Lock(LockWaitStats& lock_wait_stats, size_t index) {
+#ifdef MEMORY_POOL_LATENCY
+		uint64_t begin = LatencyStats::IsEnabled() ? LatencyStats::Now() : 0;
+		lock_wait_stats.Lock(_mtx);
+		if (0 != begin) {
+			_locked_ns = LatencyStats::Now();
+			_lock_index = index;
+			LatencyStats::Record(LatencyStats::kSpanListWait, index, _locked_ns - begin);
+		}
+		else {
+			_locked_ns = 0;
+		}
+#else
+		(void)index;
+		lock_wait_stats.Lock(_mtx);
+#endif
+	}
+
 	void UnLock() {
+#ifdef MEMORY_POOL_LATENCY
+		if (0 != _locked_ns) {
+			LatencyStats::Record(LatencyStats::kSpanListHold, _lock_index, LatencyStats::Now() - _locked_ns);
+			_locked_ns = 0;
+		}
+#endif
 		_mtx.unlock();
 	}
 private:
@@ -411,4 +884,9 @@ private:
 	Span* _head;
 	//マルチスレッド対策
 	std::mutex _mtx;
+#ifdef MEMORY_POOL_LATENCY
+	//Lock(lock_wait_stats, index)でロックを取得した時刻とサイズクラス、_mtxで保護する
+	uint64_t _locked_ns = 0;
+	size_t _lock_index = 0;
+#endif
 };
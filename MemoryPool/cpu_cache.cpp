@@ -0,0 +1,326 @@
+#include "cpu_cache.h"
+#include <thread>
+#ifdef MEMORY_POOL_RSEQ
+#include <sys/rseq.h>
+#endif
+
+#ifdef MEMORY_POOL_RSEQ
+namespace {
+	//glibcが登録した呼び出し元のスレッドのrseq領域
+	inline struct rseq* RseqArea() {
+		return reinterpret_cast<struct rseq*>(static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+	}
+
+	enum RseqResult {
+		kRseqSuccess,
+		//配列が空、または満杯
+		kRseqFail,
+		//他のスレッドに割り込まれた、または別のCPUに移った
+		kRseqAbort,
+	};
+
+	//cpuで実行中であれば、slotsの*current番目の手前から一つ取り出して*currentを減らす
+	//*currentへの書き込みで確定し、それまでに割り込まれた場合はカーネルが4:に飛ばしてkRseqAbortを返す
+	inline RseqResult RseqPop(struct rseq* rs, uint32_t cpu, uint32_t* current, void** slots, void*& ptr) {
+		void* result;
+		asm goto(
+			".pushsection __rseq_cs, \"aw\"\n\t"
+			".balign 32\n\t"
+			"3:\n\t"
+			".long 0x0, 0x0\n\t"
+			".quad 1f, (2f - 1f), 4f\n\t"
+			".popsection\n\t"
+			"leaq 3b(%%rip), %%rax\n\t"
+			"movq %%rax, %[rseq_cs]\n\t"
+			"1:\n\t"
+			"cmpl %[cpu], %[cpu_id]\n\t"
+			"jnz %l[abort]\n\t"
+			"movl %[current], %%ecx\n\t"
+			"testl %%ecx, %%ecx\n\t"
+			"jz %l[empty]\n\t"
+			"movq -8(%[slots], %%rcx, 8), %[result]\n\t"
+			"decl %%ecx\n\t"
+			"movl %%ecx, %[current]\n\t"
+			"2:\n\t"
+			".pushsection __rseq_failure, \"ax\"\n\t"
+			".long 0x53053053\n\t"
+			"4:\n\t"
+			"jmp %l[abort]\n\t"
+			".popsection\n\t"
+			: [result] "=&r"(result)
+			: [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id), [cpu] "r"(cpu),
+			[current] "m"(*current), [slots] "r"(slots)
+			: "rax", "rcx", "memory", "cc"
+			: abort, empty);
+		ptr = result;
+		return kRseqSuccess;
+	abort:
+		return kRseqAbort;
+	empty:
+		return kRseqFail;
+	}
+
+	//cpuで実行中であれば、slotsの*current番目にptrを入れて*currentを増やす
+	//*currentがcapacityに達している場合はkRseqFailを返す
+	inline RseqResult RseqPush(struct rseq* rs, uint32_t cpu, uint32_t* current, void** slots, uint32_t capacity, void* ptr) {
+		asm goto(
+			".pushsection __rseq_cs, \"aw\"\n\t"
+			".balign 32\n\t"
+			"3:\n\t"
+			".long 0x0, 0x0\n\t"
+			".quad 1f, (2f - 1f), 4f\n\t"
+			".popsection\n\t"
+			"leaq 3b(%%rip), %%rax\n\t"
+			"movq %%rax, %[rseq_cs]\n\t"
+			"1:\n\t"
+			"cmpl %[cpu], %[cpu_id]\n\t"
+			"jnz %l[abort]\n\t"
+			"movl %[current], %%ecx\n\t"
+			"cmpl %[capacity], %%ecx\n\t"
+			"jae %l[full]\n\t"
+			"movq %[ptr], (%[slots], %%rcx, 8)\n\t"
+			"incl %%ecx\n\t"
+			"movl %%ecx, %[current]\n\t"
+			"2:\n\t"
+			".pushsection __rseq_failure, \"ax\"\n\t"
+			".long 0x53053053\n\t"
+			"4:\n\t"
+			"jmp %l[abort]\n\t"
+			".popsection\n\t"
+			:
+			: [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id), [cpu] "r"(cpu),
+			[current] "m"(*current), [slots] "r"(slots), [capacity] "r"(capacity), [ptr] "r"(ptr)
+			: "rax", "rcx", "memory", "cc"
+			: abort, full);
+		return kRseqSuccess;
+	abort:
+		return kRseqAbort;
+	full:
+		return kRseqFail;
+	}
+}
+#endif
+
+//シングルトン、CpuCacheのInsatnceを取得
+CpuCache& CpuCache::GetInsatnce() {
+	if (nullptr != _p_instance)return *_p_instance;
+	std::unique_lock<std::mutex> lck(_mtx, std::defer_lock);
+	lck.lock();
+	if (nullptr == _p_instance) {
+		_p_instance = NewObject<CpuCache>();
+	}
+	lck.unlock();
+	return *_p_instance;
+}
+
+//MyMalloc/MyFreeがThreadCacheの代わりにCpuCacheを使うかを設定
+void CpuCache::SetEnabled(bool enable) {
+	if (enable) {
+		GetInsatnce();
+	}
+	_enabled.store(enable, std::memory_order_relaxed);
+}
+
+//サイズクラスごとの配列の長さとSlabの大きさを決め、rseqが使えるかを確認
+CpuCache::CpuCache() {
+	size_t offset = SizeClass::RoundUp(sizeof(Slab), sizeof(void*));
+	for (size_t index = 0; index < kNumFreeList; ++index) {
+		const SizeClassInfo& info = SizeClass::Info(index);
+		size_t capacity = kCpuCacheClassBytes / info.bytes_object;
+		if (capacity < info.num_fetch_object) capacity = info.num_fetch_object;
+		_capacities[index] = static_cast<uint32_t>(capacity);
+		_slot_offsets[index] = offset;
+		offset += capacity * sizeof(void*);
+	}
+	_num_slab_page = SizeClass::RoundUp(offset, 1 << kPageShift) >> kPageShift;
+
+	size_t num_cpu = GetCpuCount();
+	_num_cpu = static_cast<uint32_t>(num_cpu < kMaxCpu ? num_cpu : kMaxCpu);
+
+#ifdef MEMORY_POOL_RSEQ
+	//glibcがrseqを登録できなかった場合(カーネルが未対応、GLIBC_TUNABLESで無効化など)はスピンロックを使う
+	_use_rseq = __rseq_size > 0 && static_cast<int32_t>(RseqArea()->cpu_id) >= 0;
+#endif
+}
+
+//呼び出し元のスレッドが実行されているCPUの番号を取得
+uint32_t CpuCache::CurrentCpu() {
+	return static_cast<uint32_t>(GetCurrentCpu() % _num_cpu);
+}
+
+//cpuのSlabを取得、まだない場合は作成
+//同時に作成した場合は先に登録した方を使い、もう一方はシステムに返す
+CpuCache::Slab* CpuCache::GetSlab(uint32_t cpu) {
+	Slab* slab = _slabs[cpu].load(std::memory_order_acquire);
+	if (nullptr != slab) {
+		return slab;
+	}
+	Slab* new_slab = new(SystemAlloc(_num_slab_page)) Slab();
+	if (_slabs[cpu].compare_exchange_strong(slab, new_slab, std::memory_order_acq_rel)) {
+		return new_slab;
+	}
+	SystemFree(new_slab, _num_slab_page);
+	return slab;
+}
+
+//呼び出し元のCPUのサイズクラスindexの配列から一つ取り出す、空の場合はfalseを返す
+bool CpuCache::Pop(size_t index, void*& ptr) {
+#ifdef MEMORY_POOL_RSEQ
+	if (_use_rseq) {
+		struct rseq* rs = RseqArea();
+		while (true) {
+			uint32_t cpu = *static_cast<volatile uint32_t*>(&rs->cpu_id_start);
+			if (cpu >= kMaxCpu) {
+				return false;
+			}
+			Slab* slab = GetSlab(cpu);
+			RseqResult result = RseqPop(rs, cpu, reinterpret_cast<uint32_t*>(&slab->currents[index]), Slots(slab, index), ptr);
+			if (kRseqAbort != result) {
+				return kRseqSuccess == result;
+			}
+		}
+	}
+#endif
+	Slab* slab = GetSlab(CurrentCpu());
+	while (slab->lock.test_and_set(std::memory_order_acquire)) {
+		std::this_thread::yield();
+	}
+	bool success = false;
+	std::atomic<uint32_t>& current = slab->currents[index];
+	uint32_t num_object = current.load(std::memory_order_relaxed);
+	if (0 != num_object) {
+		ptr = Slots(slab, index)[num_object - 1];
+		current.store(num_object - 1, std::memory_order_relaxed);
+		success = true;
+	}
+	slab->lock.clear(std::memory_order_release);
+	return success;
+}
+
+//呼び出し元のCPUのサイズクラスindexの配列に一つ入れる、満杯の場合はfalseを返す
+bool CpuCache::Push(size_t index, void* ptr) {
+#ifdef MEMORY_POOL_RSEQ
+	if (_use_rseq) {
+		struct rseq* rs = RseqArea();
+		while (true) {
+			uint32_t cpu = *static_cast<volatile uint32_t*>(&rs->cpu_id_start);
+			if (cpu >= kMaxCpu) {
+				return false;
+			}
+			Slab* slab = GetSlab(cpu);
+			RseqResult result = RseqPush(rs, cpu, reinterpret_cast<uint32_t*>(&slab->currents[index]), Slots(slab, index), _capacities[index], ptr);
+			if (kRseqAbort != result) {
+				return kRseqSuccess == result;
+			}
+		}
+	}
+#endif
+	Slab* slab = GetSlab(CurrentCpu());
+	while (slab->lock.test_and_set(std::memory_order_acquire)) {
+		std::this_thread::yield();
+	}
+	bool success = false;
+	std::atomic<uint32_t>& current = slab->currents[index];
+	uint32_t num_object = current.load(std::memory_order_relaxed);
+	if (num_object < _capacities[index]) {
+		Slots(slab, index)[num_object] = ptr;
+		current.store(num_object + 1, std::memory_order_relaxed);
+		success = true;
+	}
+	slab->lock.clear(std::memory_order_release);
+	return success;
+}
+
+//大きさがbytesのメモリ領域を確保
+void* CpuCache::Allocate(size_t bytes) {
+	size_t index = SizeClass::Index(bytes);
+	void* ptr = nullptr;
+	if (Pop(index, ptr)) {
+		return ptr;
+	}
+	return FetchFromCentralCache(index);
+}
+
+//ptrが指している大きさがbytesのメモリ領域を解放
+void CpuCache::Deallocate(void* ptr, size_t bytes) {
+	size_t index = SizeClass::Index(bytes);
+	if (!Push(index, ptr)) {
+		ReleaseToCentralCache(index, ptr);
+	}
+}
+
+//配列が空の場合、CentralCacheからサイズクラスindexの領域を取得し、一つを返して残りを配列に入れる
+//取得している間に他のスレッドが配列を埋めた場合、入りきらない分はCentralCacheに返す
+void* CpuCache::FetchFromCentralCache(size_t index) {
+	const SizeClassInfo& info = SizeClass::Info(index);
+	void* start = nullptr;
+	void* end = nullptr;
+	CentralCache::GetInsatnce().FetchRange(start, end, info.num_fetch_object, info.bytes_object);
+	void* result = start;
+	void* ptr = NextObject(start);
+	while (nullptr != ptr) {
+		void* next = NextObject(ptr);
+		if (!Push(index, ptr)) {
+			size_t num_free = 0;
+			for (void* p = ptr; nullptr != p; p = NextObject(p)) {
+				++num_free;
+			}
+			CentralCache::GetInsatnce().ReleaseListToSpans(ptr, end, num_free, info.bytes_object);
+			break;
+		}
+		ptr = next;
+	}
+	return result;
+}
+
+//配列が満杯の場合、ptrと配列から取り出した一度に取得する数分の領域をまとめてCentralCacheに解放
+void CpuCache::ReleaseToCentralCache(size_t index, void* ptr) {
+	const SizeClassInfo& info = SizeClass::Info(index);
+	void* start = ptr;
+	void* end = ptr;
+	NextObject(ptr) = nullptr;
+	size_t num_free = 1;
+	void* p = nullptr;
+	while (num_free < info.num_fetch_object && Pop(index, p)) {
+		NextObject(p) = start;
+		start = p;
+		++num_free;
+	}
+	CentralCache::GetInsatnce().ReleaseListToSpans(start, end, num_free, info.bytes_object);
+}
+
+//すべてのCPUのキャッシュが保有しているバイト数の合計を取得、他のCPUが操作中の値は多少ずれることがある
+size_t CpuCache::GetCachedBytes() {
+	size_t bytes = 0;
+	for (size_t cpu = 0; cpu < kMaxCpu; ++cpu) {
+		Slab* slab = _slabs[cpu].load(std::memory_order_acquire);
+		if (nullptr == slab) {
+			continue;
+		}
+		for (size_t index = 0; index < kNumFreeList; ++index) {
+			bytes += static_cast<size_t>(slab->currents[index].load(std::memory_order_relaxed)) * SizeClass::Info(index).bytes_object;
+		}
+	}
+	return bytes;
+}
+
+//すべてのCPUのキャッシュが保有しているサイズクラスindexの領域の数を取得
+size_t CpuCache::GetCachedObjectCount(size_t index) {
+	size_t num_object = 0;
+	for (size_t cpu = 0; cpu < kMaxCpu; ++cpu) {
+		Slab* slab = _slabs[cpu].load(std::memory_order_acquire);
+		if (nullptr != slab) {
+			num_object += slab->currents[index].load(std::memory_order_relaxed);
+		}
+	}
+	return num_object;
+}
+
+//一つのCPUのキャッシュが保有できるバイト数の上限を取得
+size_t CpuCache::GetMaxBytesPerCpu() {
+	size_t bytes = 0;
+	for (size_t index = 0; index < kNumFreeList; ++index) {
+		bytes += static_cast<size_t>(_capacities[index]) * SizeClass::Info(index).bytes_object;
+	}
+	return bytes;
+}
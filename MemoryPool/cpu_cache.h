@@ -0,0 +1,103 @@
+#pragma once
+#include "common.h"
+#include "central_cache.h"
+#include <atomic>
+#include <cstdint>
+
+//x86-64のLinuxでは、glibcが登録したrseq(restartable sequences)を使い、ロックなしでCPUごとのキャッシュを操作する
+#if defined(__linux__) && defined(__x86_64__) && defined(__GNUC__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#define MEMORY_POOL_RSEQ 1
+#endif
+#endif
+
+//ThreadCacheの代わりに、CPUコアごとにメモリ領域をキャッシュするフロントエンド
+//スレッド数が多い場合でも、キャッシュするメモリはCPU数分で済む
+//CPUごとにサイズクラスごとの固定長の配列(スラブ)を持ち、配列の末尾から出し入れする
+//rseqが使える場合、他のスレッドに割り込まれたら操作をやり直すことで、ロックなしで出し入れする
+//使えない場合、CPUごとのスピンロックで保護する
+//配列が空の場合はCentralCacheから取得し、満杯の場合はCentralCacheに解放する
+class CpuCache {
+public:
+	//シングルトン
+	CpuCache(const CpuCache&) = delete;
+	CpuCache(CpuCache&&) = delete;
+	CpuCache& operator=(const CpuCache&) = delete;
+	CpuCache& operator=(CpuCache&&) = delete;
+	static CpuCache& GetInsatnce();
+
+	//MyMalloc/MyFreeがThreadCacheの代わりにCpuCacheを使うかを設定
+	//どちらのキャッシュの領域もCentralCacheの同じSpanに所属するため、途中で切り替えてもよい
+	static void SetEnabled(bool enable);
+
+	static bool IsEnabled() {
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	//大きさがbytesのメモリ領域を確保
+	void* Allocate(size_t bytes);
+	//ptrが指している大きさがbytesのメモリ領域を解放
+	void Deallocate(void* ptr, size_t bytes);
+
+	//すべてのCPUのキャッシュが保有しているバイト数の合計を取得
+	size_t GetCachedBytes();
+	//すべてのCPUのキャッシュが保有しているサイズクラスindexの領域の数を取得
+	size_t GetCachedObjectCount(size_t index);
+	//一つのCPUのキャッシュが保有できるバイト数の上限を取得
+	size_t GetMaxBytesPerCpu();
+
+	//rseqでロックなしに操作しているか
+	bool IsRseq() {
+		return _use_rseq;
+	}
+private:
+	//シングルトン
+	//システムのヒープを経由しないようObjectPoolで生成し、プロセス終了まで破棄しない
+	CpuCache();
+	friend class ObjectPool<CpuCache>;
+	inline static CpuCache* _p_instance = nullptr;
+	inline static std::mutex _mtx;
+	inline static std::atomic<bool> _enabled{ false };
+
+	//CPU一つ分のキャッシュ
+	//この構造体の後ろに、サイズクラスごとの配列を_slot_offsetsの位置に並べる
+	struct Slab {
+		//rseqを使えない場合のロック
+		std::atomic_flag lock = ATOMIC_FLAG_INIT;
+		//サイズクラスごとの配列に入っている領域の数
+		//rseqのアセンブリはuint32_tとして直接書き込み、GetCachedObjectCountなどは他のCPUから読むため、アトミックにする
+		std::atomic<uint32_t> currents[kNumFreeList] = {};
+	};
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "rseq accesses Slab::currents as uint32_t");
+
+	//呼び出し元のスレッドが実行されているCPUの番号を取得
+	uint32_t CurrentCpu();
+	//cpuのSlabを取得、まだない場合は作成
+	Slab* GetSlab(uint32_t cpu);
+	//Slabのサイズクラスindexの配列の先頭
+	void** Slots(Slab* slab, size_t index) {
+		return reinterpret_cast<void**>(reinterpret_cast<char*>(slab) + _slot_offsets[index]);
+	}
+
+	//呼び出し元のCPUのサイズクラスindexの配列から一つ取り出す、空の場合はfalseを返す
+	bool Pop(size_t index, void*& ptr);
+	//呼び出し元のCPUのサイズクラスindexの配列に一つ入れる、満杯の場合はfalseを返す
+	bool Push(size_t index, void* ptr);
+
+	//配列が空の場合、CentralCacheからサイズクラスindexの領域を取得し、一つを返して残りを配列に入れる
+	void* FetchFromCentralCache(size_t index);
+	//配列が満杯の場合、ptrと配列の一部をまとめてCentralCacheに解放
+	void ReleaseToCentralCache(size_t index, void* ptr);
+
+	//rseqを使うか、構築時に決めてプロセス終了まで変えない
+	bool _use_rseq = false;
+	//CPUの数、CPUの番号がこれ以上の場合は余りを使う(スピンロックの場合のみ)
+	uint32_t _num_cpu = 1;
+	//サイズクラスごとの配列の長さと、Slabの先頭からの位置
+	uint32_t _capacities[kNumFreeList] = {};
+	size_t _slot_offsets[kNumFreeList] = {};
+	//Slab一つ分のページ数
+	size_t _num_slab_page = 0;
+	//CPUごとのSlab
+	std::atomic<Slab*> _slabs[kMaxCpu] = {};
+};
@@ -0,0 +1,210 @@
+#include "heap_profiler.h"
+#include <cmath>
+#include <cstring>
+#include <new>
+#ifdef _WIN32
+#include <Windows.h>
+#elif defined(__GLIBC__)
+#include <execinfo.h>
+#endif
+
+//サンプリングする平均のバイト間隔を設定、0の場合はサンプリングを止める
+//glibcのbacktraceは初回にlibgcc_sを読み込んでmallocを呼ぶため、有効にする前に一度呼んでおく
+void HeapProfiler::SetSampleInterval(size_t bytes) {
+#if !defined(_WIN32) && defined(__GLIBC__)
+	if (0 != bytes) {
+		void* stack[1];
+		backtrace(stack, 1);
+	}
+#endif
+	_sample_interval.store(bytes, std::memory_order_relaxed);
+}
+
+//平均がintervalの指数分布に従って次のサンプルまでのバイト数を決める
+//一様乱数uから-log(u) * intervalを求める(xorshift64*)
+ptrdiff_t HeapProfiler::NextInterval(uint64_t& rng, size_t interval) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	uint64_t bits = rng * 0x2545F4914F6CDD1DULL;
+	//(0, 1]の一様乱数
+	double u = static_cast<double>((bits >> 11) + 1) * (1.0 / 9007199254740992.0);
+	double next = -std::log(u) * static_cast<double>(interval);
+	if (next < 1.0) {
+		return 1;
+	}
+	if (next > static_cast<double>(PTRDIFF_MAX / 2)) {
+		return PTRDIFF_MAX / 2;
+	}
+	return static_cast<ptrdiff_t>(next);
+}
+
+//次のサンプルまでのバイト数を使い切った場合に呼び出し、ptrを記録して次の間隔を決める
+//スレッドの初回は乱数を初期化して間隔を決めるだけで、記録しない
+void HeapProfiler::Sample(void* ptr, size_t bytes) {
+	HeapSamplerState& state = heap_sampler_state;
+	size_t interval = getSampleInterval();
+	if (0 == interval) {
+		//止めた後は、次に有効にされるまでこの関数に来ないよう間隔を最大にする
+		state.bytes_until_sample = PTRDIFF_MAX / 2;
+		return;
+	}
+	if (0 == state.rng) {
+		state.rng = (reinterpret_cast<uint64_t>(&state) ^ static_cast<uint64_t>(
+			std::chrono::steady_clock::now().time_since_epoch().count())) | 1;
+		state.bytes_until_sample = NextInterval(state.rng, interval);
+		return;
+	}
+	state.bytes_until_sample = NextInterval(state.rng, interval);
+	if (state.in_sample) {
+		return;
+	}
+	state.in_sample = true;
+
+	SampledObject* sample = NewObject<SampledObject>();
+	sample->ptr = ptr;
+	sample->bytes = bytes;
+#ifdef _WIN32
+	sample->depth = CaptureStackBackTrace(1, kMaxStackDepth, sample->stack, nullptr);
+#elif defined(__GLIBC__)
+	//先頭はこの関数自身のため除く
+	int depth = backtrace(sample->stack, kMaxStackDepth);
+	if (depth > 1) {
+		memmove(sample->stack, sample->stack + 1, (depth - 1) * sizeof(void*));
+		sample->depth = depth - 1;
+	}
+#endif
+	Span* p_span = PageCache::GetInsatnce().GetSpanRefFromPageId(reinterpret_cast<PageId>(ptr) >> kPageShift);
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		if (nullptr == _buckets) {
+			size_t num_page = SizeClass::RoundUp(kHeapProfileBuckets * sizeof(SampledObject*), 1 << kPageShift) >> kPageShift;
+			//SystemAllocの領域は0で埋められている
+			_buckets = static_cast<SampledObject**>(SystemAlloc(num_page));
+		}
+		SampledObject*& head = _buckets[Bucket(ptr)];
+		sample->next = head;
+		head = sample;
+		p_span->setSampledObjectCount(p_span->getSampledObjectCount() + 1);
+		_sampled_bytes += bytes;
+		_num_sample.fetch_add(1, std::memory_order_relaxed);
+	}
+	state.in_sample = false;
+}
+
+//ptrが所属するSpanにサンプリングした領域がある場合に、解放する直前に呼び出す
+//(16*4kb,+∞]の領域はSpanに一つだけのため、アライメントを揃えて領域の途中を指すptrでもSpanの先頭で引く
+void HeapProfiler::RecordFree(void* ptr, Span* p_span) {
+	if (p_span->getObjectSize() > kMaxBytes) {
+		ptr = reinterpret_cast<void*>(p_span->getStartPageId() << kPageShift);
+	}
+	SampledObject* sample = nullptr;
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		if (nullptr == _buckets) {
+			return;
+		}
+		for (SampledObject** link = &_buckets[Bucket(ptr)]; nullptr != *link; link = &(*link)->next) {
+			if ((*link)->ptr == ptr) {
+				sample = *link;
+				*link = sample->next;
+				p_span->setSampledObjectCount(p_span->getSampledObjectCount() - 1);
+				_sampled_bytes -= sample->bytes;
+				_num_sample.fetch_sub(1, std::memory_order_relaxed);
+				break;
+			}
+		}
+	}
+	if (nullptr != sample) {
+		DeleteObject(sample);
+	}
+}
+
+//サンプリングした領域をreallocがその場で伸縮した場合に呼び出し、記録したバイト数をbytesに変更する
+void HeapProfiler::RecordResize(void* ptr, size_t bytes) {
+	Span* p_span = PageCache::GetInsatnce().GetSpanRefFromPageId(reinterpret_cast<PageId>(ptr) >> kPageShift);
+	if (p_span->getObjectSize() > kMaxBytes) {
+		ptr = reinterpret_cast<void*>(p_span->getStartPageId() << kPageShift);
+	}
+	std::lock_guard<std::mutex> lck(_mtx);
+	if (nullptr == _buckets) {
+		return;
+	}
+	for (SampledObject* sample = _buckets[Bucket(ptr)]; nullptr != sample; sample = sample->next) {
+		if (sample->ptr == ptr) {
+			_sampled_bytes = _sampled_bytes - sample->bytes + bytes;
+			sample->bytes = bytes;
+			break;
+		}
+	}
+}
+
+//サンプリングした使用中の領域の数と、それらが要求したバイト数の合計を取得
+void HeapProfiler::GetStats(size_t& num_sample, size_t& sampled_bytes) {
+	std::lock_guard<std::mutex> lck(_mtx);
+	num_sample = _num_sample.load(std::memory_order_relaxed);
+	sampled_bytes = _sampled_bytes;
+}
+
+//使用中の領域のプロファイルをpprofのheap_v2形式でfpに書き出す
+//書き出しがmallocやfreeを呼んでもロックを取り合わないよう、ロックを保持している間にSystemAllocの領域へ写してから書き出す
+//一行が一つのサンプルで、pprofが同じスタックトレースの行をまとめる
+void HeapProfiler::WriteProfile(FILE* fp) {
+	size_t num_page = 0;
+	size_t num_sample = 0;
+	size_t sampled_bytes = 0;
+	SampledObject* samples = nullptr;
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		num_sample = _num_sample.load(std::memory_order_relaxed);
+		sampled_bytes = _sampled_bytes;
+		if (num_sample > 0) {
+			num_page = SizeClass::RoundUp(num_sample * sizeof(SampledObject), 1 << kPageShift) >> kPageShift;
+			samples = static_cast<SampledObject*>(SystemAlloc(num_page));
+			size_t i = 0;
+			for (size_t bucket = 0; bucket < kHeapProfileBuckets; ++bucket) {
+				for (SampledObject* sample = _buckets[bucket]; nullptr != sample; sample = sample->next) {
+					samples[i++] = *sample;
+				}
+			}
+		}
+	}
+
+	fprintf(fp, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+		num_sample, sampled_bytes, num_sample, sampled_bytes, getSampleInterval());
+	for (size_t i = 0; i < num_sample; ++i) {
+		const SampledObject& sample = samples[i];
+		fprintf(fp, "%6d: %8zu [%6d: %8zu] @", 1, sample.bytes, 1, sample.bytes);
+		for (size_t depth = 0; depth < sample.depth; ++depth) {
+			fprintf(fp, " %p", sample.stack[depth]);
+		}
+		fprintf(fp, "\n");
+	}
+	if (nullptr != samples) {
+		SystemFree(samples, num_page);
+	}
+
+#ifndef _WIN32
+	fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (nullptr != maps) {
+		char buffer[4096];
+		size_t num_read = 0;
+		while (0 != (num_read = fread(buffer, 1, sizeof(buffer), maps))) {
+			fwrite(buffer, 1, num_read, fp);
+		}
+		fclose(maps);
+	}
+#endif
+}
+
+//pathのファイルにWriteProfileで書き出す、作成できない場合はfalseを返す
+bool HeapProfiler::WriteProfile(const char* path) {
+	FILE* fp = fopen(path, "w");
+	if (nullptr == fp) {
+		return false;
+	}
+	WriteProfile(fp);
+	fclose(fp);
+	return true;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include "common.h"
+#include "page_cache.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+//MyMallocの確保を平均SetSampleIntervalバイトごとにサンプリングし、使用中の領域のスタックトレースを記録するヒーププロファイラ
+//スレッドごとに次のサンプルまでのバイト数を指数分布(幾何分布の連続近似)で決め、確保したバイト数を引いて負になったらサンプリングする
+//大きい領域ほど選ばれやすく、平均して確保したSetSampleIntervalバイトに一回だけスタックトレースを取る
+//サンプリングした領域はポインタをキーとする表に保持し、そのSpanに数を記録する
+//解放の際はSpanの数が0でなければ表から外す
+//WriteProfileはpprofが読めるheap_v2形式で使用中の領域を書き出す(pprofがサンプリング間隔から元の大きさを推定する)
+class HeapProfiler {
+public:
+	//サンプリングする平均のバイト間隔を設定、0の場合はサンプリングを止める(記録済みの領域は解放されるまで残る)
+	static void SetSampleInterval(size_t bytes);
+
+	static size_t getSampleInterval() {
+		return _sample_interval.load(std::memory_order_relaxed);
+	}
+
+	static bool IsEnabled() {
+		return 0 != _sample_interval.load(std::memory_order_relaxed);
+	}
+
+	//サンプリングした使用中の領域があるか、ない場合はMyFreeSizedがSpanを引かずに解放できる
+	static bool HasSamples() {
+		return 0 != _num_sample.load(std::memory_order_relaxed);
+	}
+
+	//MyMallocで確保した直後に呼び出す、次のサンプルまでのバイト数を使い切った場合のみSampleを呼ぶ
+	static void RecordMalloc(void* ptr, size_t bytes);
+
+	//ptrが所属するSpanにサンプリングした領域がある場合に、解放する直前に呼び出す
+	static void RecordFree(void* ptr, Span* p_span);
+
+	//サンプリングした領域をreallocがその場で伸縮した場合に呼び出し、記録したバイト数をbytesに変更する
+	static void RecordResize(void* ptr, size_t bytes);
+
+	//ptrがサンプリングした領域か
+	static bool IsSampled(void* ptr) {
+		if (!HasSamples()) {
+			return false;
+		}
+		Span* p_span = PageCache::GetInsatnce().GetSpanRefFromPageId(reinterpret_cast<PageId>(ptr) >> kPageShift);
+		return nullptr != p_span && 0 != p_span->getSampledObjectCount();
+	}
+
+	//使用中の領域のプロファイルをpprofのheap_v2形式でfpに書き出す
+	//POSIXでは、pprofがアドレスをシンボルに変換できるよう、/proc/self/mapsの内容を後ろに付ける
+	static void WriteProfile(FILE* fp);
+	//pathのファイルにWriteProfileで書き出す、作成できない場合はfalseを返す
+	static bool WriteProfile(const char* path);
+
+	//サンプリングした使用中の領域の数と、それらが要求したバイト数の合計を取得
+	static void GetStats(size_t& num_sample, size_t& sampled_bytes);
+private:
+	//サンプリングした領域一つ分
+	struct SampledObject {
+		SampledObject* next = nullptr;
+		void* ptr = nullptr;
+		size_t bytes = 0;
+		size_t depth = 0;
+		void* stack[kMaxStackDepth] = {};
+	};
+
+	//次のサンプルまでのバイト数を使い切った場合に呼び出し、ptrを記録して次の間隔を決める
+	static void Sample(void* ptr, size_t bytes);
+	//平均がintervalの指数分布に従って次のサンプルまでのバイト数を決める、rngはスレッドごとの乱数の状態
+	static ptrdiff_t NextInterval(uint64_t& rng, size_t interval);
+	//ptrのバケットの番号
+	static size_t Bucket(void* ptr) {
+		return (reinterpret_cast<uintptr_t>(ptr) >> 4) % kHeapProfileBuckets;
+	}
+
+	inline static std::atomic<size_t> _sample_interval{ 0 };
+	inline static std::atomic<size_t> _num_sample{ 0 };
+	//以下は_mtxで保護する
+	inline static std::mutex _mtx;
+	//ポインタをキーとするハッシュ表、初めてサンプリングする際にSystemAllocで確保する
+	inline static SampledObject** _buckets = nullptr;
+	inline static size_t _sampled_bytes = 0;
+};
+
+//スレッドごとのサンプリングの状態
+struct HeapSamplerState {
+	//次のサンプルまでのバイト数
+	ptrdiff_t bytes_until_sample = 0;
+	//乱数の状態、0の場合はまだ初期化していない
+	uint64_t rng = 0;
+	//Sampleの実行中か、スタックトレースの取得がmallocを呼んでも再帰しないように
+	bool in_sample = false;
+};
+//TLS、共有ライブラリとしてLD_PRELOADされた場合でもmallocを呼ばないようinitial-execモデルにする
+#if defined(__GNUC__) && !defined(_WIN32)
+inline thread_local HeapSamplerState heap_sampler_state __attribute__((tls_model("initial-exec")));
+#else
+inline thread_local HeapSamplerState heap_sampler_state;
+#endif
+
+inline void HeapProfiler::RecordMalloc(void* ptr, size_t bytes) {
+	HeapSamplerState& state = heap_sampler_state;
+	state.bytes_until_sample -= static_cast<ptrdiff_t>(bytes);
+	if (state.bytes_until_sample < 0) {
+		Sample(ptr, bytes);
+	}
+}
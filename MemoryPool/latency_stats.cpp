@@ -0,0 +1,235 @@
+#include "common.h"
+#include <new>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+namespace {
+	//呼び出し元のスレッドが記録に使っているバッファ
+#if defined(__GNUC__) && !defined(_WIN32)
+	thread_local void* p_latency_buffer __attribute__((tls_model("initial-exec"))) = nullptr;
+#else
+	thread_local void* p_latency_buffer = nullptr;
+#endif
+
+#ifdef _WIN32
+	//スレッド終了時にそのスレッドのバッファを空きに戻すためのクラス
+	class LatencyBufferReleaser {
+	public:
+		void (*release)(void*) = nullptr;
+		~LatencyBufferReleaser() {
+			if (nullptr != p_latency_buffer && nullptr != release) {
+				void* buffer = p_latency_buffer;
+				p_latency_buffer = nullptr;
+				release(buffer);
+			}
+		}
+	};
+	thread_local LatencyBufferReleaser latency_buffer_releaser;
+#endif
+
+	//経過時間nsが入るバケットの番号
+	size_t Bucket(uint64_t ns) {
+		if (0 == ns) {
+			return 0;
+		}
+		size_t bucket = FloorLog2(ns) + 1;
+		return bucket < LatencyStats::kNumBucket ? bucket : LatencyStats::kNumBucket - 1;
+	}
+}
+
+//割合ratioの点を含むバケットの上限(ナノ秒)
+//最後のバケットは上限がないため、その下限を返す
+uint64_t LatencyStats::Histogram::Percentile(double ratio) const {
+	if (0 == total_count) {
+		return 0;
+	}
+	uint64_t target = static_cast<uint64_t>(ratio * static_cast<double>(total_count));
+	if (target >= total_count) {
+		target = total_count - 1;
+	}
+	uint64_t sum = 0;
+	for (size_t bucket = 0; bucket < kNumBucket; ++bucket) {
+		sum += count[bucket];
+		if (sum > target) {
+			return 0 == bucket ? 0 : (bucket + 1 < kNumBucket ? uint64_t(1) << bucket : uint64_t(1) << (bucket - 1));
+		}
+	}
+	return uint64_t(1) << (kNumBucket - 2);
+}
+
+//所有するスレッドだけが書き込むため、fetch_addではなくload/storeで加える
+void LatencyStats::Record(Timer timer, size_t index, uint64_t ns) {
+	Buffer* buffer = static_cast<Buffer*>(p_latency_buffer);
+	if (nullptr == buffer) {
+		buffer = GetBuffer();
+	}
+	size_t bucket = Bucket(ns);
+	Counters& counters = buffer->timers[timer];
+	counters.count[bucket].store(counters.count[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	counters.total_ns.store(counters.total_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+	if (static_cast<size_t>(timer) < kNumSizeClassTimer && index < kNumFreeList) {
+		Counters& size_class = buffer->SizeClasses()[index * kNumSizeClassTimer + timer];
+		size_class.count[bucket].store(size_class.count[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		size_class.total_ns.store(size_class.total_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+	}
+}
+
+size_t LatencyStats::NumBufferPage() {
+	size_t bytes = Buffer::SizeClassOffset() + sizeof(Counters) * kNumFreeList * kNumSizeClassTimer;
+	return SizeClass::RoundUp(bytes, 1 << kPageShift) >> kPageShift;
+}
+
+//空きのバッファがなければSystemAllocで作成してリストに加える
+//スレッド終了時の登録がmallocを呼ぶことがあるため、先にp_latency_bufferを設定しておく
+LatencyStats::Buffer* LatencyStats::GetBuffer() {
+	Buffer* buffer = nullptr;
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		for (Buffer* free_buffer = _buffers.load(std::memory_order_relaxed); nullptr != free_buffer; free_buffer = free_buffer->next) {
+			if (!free_buffer->in_use) {
+				buffer = free_buffer;
+				break;
+			}
+		}
+		if (nullptr == buffer) {
+			//SystemAllocの領域は0で埋められているため、ヒストグラムは0から始まる
+			buffer = new(SystemAlloc(NumBufferPage())) Buffer;
+			buffer->next = _buffers.load(std::memory_order_relaxed);
+			_buffers.store(buffer, std::memory_order_release);
+		}
+		buffer->in_use = true;
+	}
+	p_latency_buffer = buffer;
+#ifdef _WIN32
+	latency_buffer_releaser.release = ReleaseBuffer;
+#else
+	static pthread_key_t key = [] {
+		pthread_key_t key;
+		pthread_key_create(&key, [](void* ptr) {
+			p_latency_buffer = nullptr;
+			ReleaseBuffer(ptr);
+		});
+		return key;
+	}();
+	pthread_setspecific(key, buffer);
+#endif
+	return buffer;
+}
+
+void LatencyStats::ReleaseBuffer(void* ptr) {
+	std::lock_guard<std::mutex> lck(_mtx);
+	static_cast<Buffer*>(ptr)->in_use = false;
+}
+
+//バッファはリストの先頭にのみ加え、破棄しないため、ロックなしでたどれる
+template <class GetCounters>
+void LatencyStats::Merge(Histogram& histogram, GetCounters get_counters) {
+	histogram = Histogram();
+	for (Buffer* buffer = _buffers.load(std::memory_order_acquire); nullptr != buffer; buffer = buffer->next) {
+		const Counters& counters = get_counters(buffer);
+		for (size_t bucket = 0; bucket < kNumBucket; ++bucket) {
+			uint64_t count = counters.count[bucket].load(std::memory_order_relaxed);
+			histogram.count[bucket] += count;
+			histogram.total_count += count;
+		}
+		histogram.total_ns += counters.total_ns.load(std::memory_order_relaxed);
+	}
+}
+
+void LatencyStats::GetHistogram(Timer timer, Histogram& histogram) {
+	Merge(histogram, [timer](Buffer* buffer) -> const Counters& {
+		return buffer->timers[timer];
+	});
+}
+
+void LatencyStats::GetHistogram(Timer timer, size_t index, Histogram& histogram) {
+	if (static_cast<size_t>(timer) >= kNumSizeClassTimer || index >= kNumFreeList) {
+		histogram = Histogram();
+		return;
+	}
+	Merge(histogram, [timer, index](Buffer* buffer) -> const Counters& {
+		return buffer->SizeClasses()[index * kNumSizeClassTimer + timer];
+	});
+}
+
+//記録中のスレッドと同時に呼び出した場合、そのスレッドが書き戻した分は0に戻らないことがある
+void LatencyStats::Reset() {
+	auto reset = [](Counters* counters, size_t num_counters) {
+		for (size_t i = 0; i < num_counters; ++i) {
+			for (size_t bucket = 0; bucket < kNumBucket; ++bucket) {
+				counters[i].count[bucket].store(0, std::memory_order_relaxed);
+			}
+			counters[i].total_ns.store(0, std::memory_order_relaxed);
+		}
+	};
+	for (Buffer* buffer = _buffers.load(std::memory_order_acquire); nullptr != buffer; buffer = buffer->next) {
+		reset(buffer->timers, kNumTimer);
+		reset(buffer->SizeClasses(), kNumFreeList * kNumSizeClassTimer);
+	}
+}
+
+const char* LatencyStats::TimerName(Timer timer) {
+	switch (timer) {
+	case kThreadCacheHit: return "thread_cache_hit";
+	case kThreadCacheMiss: return "thread_cache_miss";
+	case kCentralFetchRange: return "central_fetch_range";
+	case kSpanListWait: return "span_list_wait";
+	case kSpanListHold: return "span_list_hold";
+	case kPageNewSpan: return "page_new_span";
+	case kSystemAllocPage: return "system_alloc_page";
+	default: return "unknown";
+	}
+}
+
+//処理ごとのヒストグラムと、サイズクラスごとの回数、平均、パーセンタイルを人が読む形式でfpに書き出す
+//Histogramは小さいため、スタックに取得する
+void LatencyStats::Print(FILE* fp) {
+	fprintf(fp, "------------------------------------------------\n");
+	if (!IsCompiled()) {
+		fprintf(fp, "LATENCY: not compiled (build with MEMORY_POOL_LATENCY)\n");
+		return;
+	}
+	fprintf(fp, "%-20s %12s %10s %10s %10s %10s\n", "LATENCY(ns)", "count", "mean", "p50<=", "p99<=", "p99.9<=");
+	Histogram histogram;
+	for (size_t timer = 0; timer < kNumTimer; ++timer) {
+		GetHistogram(static_cast<Timer>(timer), histogram);
+		fprintf(fp, "%-20s %12llu %10.1f %10llu %10llu %10llu\n", TimerName(static_cast<Timer>(timer)),
+			static_cast<unsigned long long>(histogram.total_count),
+			0 == histogram.total_count ? 0.0 : static_cast<double>(histogram.total_ns) / histogram.total_count,
+			static_cast<unsigned long long>(histogram.Percentile(0.5)),
+			static_cast<unsigned long long>(histogram.Percentile(0.99)),
+			static_cast<unsigned long long>(histogram.Percentile(0.999)));
+	}
+	fprintf(fp, "------------------------------------------------\n");
+	for (size_t timer = 0; timer < kNumTimer; ++timer) {
+		GetHistogram(static_cast<Timer>(timer), histogram);
+		if (0 == histogram.total_count) {
+			continue;
+		}
+		fprintf(fp, "%s:\n", TimerName(static_cast<Timer>(timer)));
+		for (size_t bucket = 0; bucket < kNumBucket; ++bucket) {
+			if (0 == histogram.count[bucket]) {
+				continue;
+			}
+			uint64_t low = 0 == bucket ? 0 : uint64_t(1) << (bucket - 1);
+			fprintf(fp, "  >= %10llu ns: %12llu\n", static_cast<unsigned long long>(low),
+				static_cast<unsigned long long>(histogram.count[bucket]));
+		}
+	}
+	fprintf(fp, "------------------------------------------------\n");
+	fprintf(fp, "%5s %6s %-20s %12s %10s %10s %10s\n", "class", "bytes", "timer", "count", "mean", "p50<=", "p99<=");
+	for (size_t index = 0; index < kNumFreeList; ++index) {
+		for (size_t timer = 0; timer < kNumSizeClassTimer; ++timer) {
+			GetHistogram(static_cast<Timer>(timer), index, histogram);
+			if (0 == histogram.total_count) {
+				continue;
+			}
+			fprintf(fp, "%5zu %6zu %-20s %12llu %10.1f %10llu %10llu\n", index, SizeClass::Info(index).bytes_object,
+				TimerName(static_cast<Timer>(timer)), static_cast<unsigned long long>(histogram.total_count),
+				static_cast<double>(histogram.total_ns) / histogram.total_count,
+				static_cast<unsigned long long>(histogram.Percentile(0.5)),
+				static_cast<unsigned long long>(histogram.Percentile(0.99)));
+		}
+	}
+}
@@ -0,0 +1,159 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+//各層の処理時間を対数のバケットのヒストグラムに記録する計測機能
+//MEMORY_POOL_LATENCYを定義してビルドした場合のみ計測点が埋め込まれ、定義しない場合は計測点が空の文になる
+//埋め込んだ場合も、SetEnabled(true)を呼ぶまでは時刻を取得しない
+//ヒストグラムはスレッドごとのバッファに記録し、読み出す際にすべてのバッファを合計する
+//バッファはSystemAllocで確保するため、記録中にmallocを呼ばない
+//common.hから読み込まれるため、このヘッダはcommon.hに依存しない
+class LatencyStats {
+public:
+	//計測する処理
+	enum Timer {
+		//ThreadCache::Allocate、FreeListに領域があった場合(他のスレッドから返された領域を使う場合を含む)
+		kThreadCacheHit = 0,
+		//ThreadCache::Allocate、CentralCacheから取得した場合
+		kThreadCacheMiss,
+		//CentralCache::FetchRange
+		kCentralFetchRange,
+		//CentralCacheのSpanListのロックを待った時間と保持した時間
+		kSpanListWait,
+		kSpanListHold,
+		//PageCache::NewSpan
+		kPageNewSpan,
+		//PageCache::SystemAllocPage
+		kSystemAllocPage,
+		kNumTimer,
+	};
+	//kNumSizeClassTimerより前の処理は、全体に加えてサイズクラスごとのヒストグラムにも記録する
+	static constexpr size_t kNumSizeClassTimer = kPageNewSpan;
+	//バケットの数、バケットbは[2^(b-1), 2^b)ナノ秒(0は0ナノ秒)で、最後のバケットはそれ以上すべて
+	static constexpr size_t kNumBucket = 32;
+
+	//読み出したヒストグラム一つ分
+	struct Histogram {
+		uint64_t count[kNumBucket] = {};
+		uint64_t total_count = 0;
+		uint64_t total_ns = 0;
+
+		//割合ratioの点を含むバケットの上限(ナノ秒)
+		uint64_t Percentile(double ratio) const;
+	};
+
+	//MEMORY_POOL_LATENCYを定義してビルドしたか
+	static constexpr bool IsCompiled() {
+#ifdef MEMORY_POOL_LATENCY
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	//計測を始める(止める)、計測点を埋め込んでいない場合は何もしない
+	static void SetEnabled(bool enabled) {
+		_enabled.store(IsCompiled() && enabled, std::memory_order_relaxed);
+	}
+
+	static bool IsEnabled() {
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	static uint64_t Now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	//timerのヒストグラムに経過時間nsを加える、indexはサイズクラスの番号(kNumSizeClassTimer以降は使わない)
+	static void Record(Timer timer, size_t index, uint64_t ns);
+
+	//すべてのスレッドのバッファを合計し、timerの全体のヒストグラムを取得
+	static void GetHistogram(Timer timer, Histogram& histogram);
+	//すべてのスレッドのバッファを合計し、timerのサイズクラスindexのヒストグラムを取得
+	static void GetHistogram(Timer timer, size_t index, Histogram& histogram);
+	//すべてのバッファのヒストグラムを0に戻す
+	static void Reset();
+
+	//処理ごとのヒストグラムと、サイズクラスごとの回数、平均、パーセンタイルを人が読む形式でfpに書き出す
+	static void Print(FILE* fp);
+
+	static const char* TimerName(Timer timer);
+private:
+	//ヒストグラム一つ分、所有するスレッドだけが書き込み、他のスレッドは読み出すだけのため、アトミック操作はload/storeのみ
+	struct Counters {
+		std::atomic<uint64_t> count[kNumBucket];
+		std::atomic<uint64_t> total_ns;
+	};
+	//スレッド一つ分のバッファ
+	//スレッドが終了したら空きに戻し、次に記録を始めたスレッドがヒストグラムを引き継いで使う
+	struct Buffer {
+		bool in_use = false;
+		Buffer* next = nullptr;
+		Counters timers[kNumTimer];
+
+		//サイズクラスごと、[index * kNumSizeClassTimer + timer]
+		//SystemAllocで確保した同じ領域のBufferの直後に置く
+		Counters* SizeClasses() {
+			return reinterpret_cast<Counters*>(reinterpret_cast<char*>(this) + SizeClassOffset());
+		}
+
+		static size_t SizeClassOffset() {
+			return (sizeof(Buffer) + alignof(Counters) - 1) / alignof(Counters) * alignof(Counters);
+		}
+	};
+
+	//呼び出し元のスレッドのバッファを取得、まだない場合は空きのバッファを割り当てる
+	static Buffer* GetBuffer();
+	//スレッド終了時にバッファを空きに戻す
+	static void ReleaseBuffer(void* buffer);
+	//バッファ一つのページ数
+	static size_t NumBufferPage();
+	//timerのcountersをすべてのバッファで合計してhistogramに加える
+	template <class GetCounters>
+	static void Merge(Histogram& histogram, GetCounters get_counters);
+
+	inline static std::atomic<bool> _enabled{ false };
+	//バッファのリストを保護、バッファはプロセス終了まで破棄しない
+	inline static std::mutex _mtx;
+	inline static std::atomic<Buffer*> _buffers{ nullptr };
+};
+
+//スコープの開始から終了までの時間を記録するクラス
+//開始時に計測が有効でなければ、終了時にも何もしない
+class LatencyScope {
+public:
+	LatencyScope(LatencyStats::Timer timer, size_t index)
+		: _timer(timer), _index(index), _begin(LatencyStats::IsEnabled() ? LatencyStats::Now() : 0) {}
+
+	LatencyScope(const LatencyScope&) = delete;
+	LatencyScope& operator=(const LatencyScope&) = delete;
+
+	~LatencyScope() {
+		if (0 != _begin) {
+			LatencyStats::Record(_timer, _index, LatencyStats::Now() - _begin);
+		}
+	}
+
+	//スコープの途中で記録先の処理を変える(ThreadCache::Allocateのヒットとミスなど)
+	void setTimer(LatencyStats::Timer timer) {
+		_timer = timer;
+	}
+private:
+	LatencyStats::Timer _timer;
+	size_t _index;
+	uint64_t _begin;
+};
+
+//計測点、MEMORY_POOL_LATENCYを定義しない場合は何も生成しない
+#ifdef MEMORY_POOL_LATENCY
+#define MEMORY_POOL_LATENCY_SCOPE(timer, index) LatencyScope latency_scope(LatencyStats::timer, index)
+#define MEMORY_POOL_LATENCY_SET_TIMER(timer) latency_scope.setTimer(LatencyStats::timer)
+#else
+#define MEMORY_POOL_LATENCY_SCOPE(timer, index) ((void)0)
+#define MEMORY_POOL_LATENCY_SET_TIMER(timer) ((void)0)
+#endif
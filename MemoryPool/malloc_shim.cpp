@@ -0,0 +1,211 @@
+#include "my_malloc.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+//mallocファミリーをMyMalloc/MyFreeに置き換える
+//共有ライブラリ(libmy_malloc.so)としてビルドし、LD_PRELOADで既存のプログラムに差し込んで使う
+//operator new/deleteはmy_new_delete.cppを一緒にリンクして置き換える
+//環境変数MY_MALLOC_CPU_CACHE=1を指定すると、ThreadCacheの代わりにCpuCacheを使う
+//環境変数MY_MALLOC_REMOTE_FREE=0を指定すると、他のスレッドが取得した領域を取得したスレッドに返さず、解放するスレッドのThreadCacheに入れる
+//環境変数MY_MALLOC_HUGETLB=1を指定すると、PageCacheの領域をMAP_HUGETLBのヒュージページで確保する
+//環境変数MY_MALLOC_RELEASE_INTERVAL_MS=nを指定すると、nミリ秒以上空いているヒュージページをバックグラウンドでシステムに返す
+//環境変数MY_MALLOC_LARGE_CACHE_BYTES=nを指定すると、解放した512KB超の領域をnバイトまでキャッシュする
+//環境変数MY_MALLOC_TRACE=pathを指定すると、確保と解放をpath.<pid>に記録する(trace_replayで再生できる)
+//環境変数MY_MALLOC_STATS=1(jsonの場合はJSON)を指定すると、終了時に統計情報を標準エラー出力に書き出す
+//環境変数MY_MALLOC_HEAP_PROFILE=pathを指定すると、確保をサンプリングし、終了時に使用中の領域のプロファイルをpath.<pid>.heapに書き出す
+//サンプリングの平均のバイト間隔はMY_MALLOC_HEAP_SAMPLE_INTERVAL=nで変更できる(デフォルトは2MB)
+//環境変数MY_MALLOC_LATENCY=1を指定すると、各層の処理時間を計測し、終了時にヒストグラムを標準エラー出力に書き出す
+//(MEMORY_POOL_LATENCYを有効にしてビルドした場合のみ)
+
+namespace {
+	//alignにアライメントされたbytes分のメモリ領域を確保
+	//ページ内のSpanはページ境界から始まり、サイズクラスの大きさはそのクラスの刻み幅の倍数のため、
+	//bytesをalignの倍数に切り上げれば、ページサイズ以下のalignは自然に満たされる
+	//ページサイズを超えるalignは、PageCacheからalign分多く確保し、領域内のアライメントされたアドレスを返す
+	//alignを足すと(alignの倍数に切り上げると)桁あふれするbytesは、確保できないためstd::bad_allocを投げる
+	void* AlignedAlloc(size_t align, size_t bytes) {
+		if (bytes > SIZE_MAX - align) {
+			throw std::bad_alloc();
+		}
+		if (align <= (1 << kPageShift)) {
+			return MyMalloc(SizeClass::RoundUp(bytes == 0 ? 1 : bytes, align));
+		}
+		size_t bytes_padded = bytes + align;
+		if (bytes_padded <= kMaxBytes) {
+			bytes_padded = kMaxBytes + 1;
+		}
+		void* ptr = MyMalloc(bytes_padded);
+		return reinterpret_cast<void*>(SizeClass::RoundUp(reinterpret_cast<size_t>(ptr), align));
+	}
+
+	bool IsPowerOfTwo(size_t n) {
+		return 0 != n && 0 == (n & (n - 1));
+	}
+
+	//ライブラリの読み込み時に、環境変数からフロントエンドとその動作、ページの確保、解放の方法を選ぶ
+	__attribute__((constructor)) void SelectFrontEnd() {
+		const char* value = getenv("MY_MALLOC_CPU_CACHE");
+		if (nullptr != value && '1' == value[0]) {
+			CpuCache::SetEnabled(true);
+		}
+		value = getenv("MY_MALLOC_REMOTE_FREE");
+		if (nullptr != value) {
+			ThreadCache::SetRemoteFree('0' != value[0]);
+		}
+		value = getenv("MY_MALLOC_HUGETLB");
+		if (nullptr != value && '1' == value[0]) {
+			PageCache::SetHugeTlb(true);
+		}
+		value = getenv("MY_MALLOC_RELEASE_INTERVAL_MS");
+		if (nullptr != value) {
+			long interval = strtol(value, nullptr, 10);
+			if (interval > 0) {
+				PageCache::GetInsatnce().SetReleaseInterval(std::chrono::milliseconds(interval));
+			}
+		}
+		value = getenv("MY_MALLOC_LARGE_CACHE_BYTES");
+		if (nullptr != value) {
+			PageCache::GetInsatnce().SetLargeCacheLimit(strtoull(value, nullptr, 10));
+		}
+		value = getenv("MY_MALLOC_TRACE");
+		if (nullptr != value && '\0' != value[0]) {
+			//execした先のプログラムも同じ環境変数を引き継ぐため、プロセスごとに別のファイルに書く
+			char path[4096];
+			snprintf(path, sizeof(path), "%s.%ld", value, static_cast<long>(getpid()));
+			TraceRecorder::Start(path);
+		}
+		value = getenv("MY_MALLOC_HEAP_PROFILE");
+		if (nullptr != value && '\0' != value[0]) {
+			size_t interval = kDefaultHeapSampleInterval;
+			const char* interval_value = getenv("MY_MALLOC_HEAP_SAMPLE_INTERVAL");
+			if (nullptr != interval_value && 0 != strtoull(interval_value, nullptr, 10)) {
+				interval = strtoull(interval_value, nullptr, 10);
+			}
+			HeapProfiler::SetSampleInterval(interval);
+		}
+		value = getenv("MY_MALLOC_LATENCY");
+		if (nullptr != value && '1' == value[0]) {
+			LatencyStats::SetEnabled(true);
+		}
+	}
+
+	//プログラムの終了時に、記録の残りとヒーププロファイル、統計情報、処理時間のヒストグラムを書き出す
+	__attribute__((destructor)) void ReportAtExit() {
+		TraceRecorder::Stop();
+		const char* value = getenv("MY_MALLOC_HEAP_PROFILE");
+		if (nullptr != value && '\0' != value[0]) {
+			char path[4096];
+			snprintf(path, sizeof(path), "%s.%ld.heap", value, static_cast<long>(getpid()));
+			HeapProfiler::WriteProfile(path);
+		}
+		value = getenv("MY_MALLOC_STATS");
+		if (nullptr != value && 0 == strcmp(value, "json")) {
+			PrintMallocStatsJson(stderr);
+		}
+		else if (nullptr != value && '1' == value[0]) {
+			PrintMallocStats(stderr);
+		}
+		value = getenv("MY_MALLOC_LATENCY");
+		if (nullptr != value && '1' == value[0]) {
+			LatencyStats::SetEnabled(false);
+			LatencyStats::Print(stderr);
+		}
+	}
+}
+
+extern "C" {
+
+void* malloc(size_t bytes) {
+	try {
+		return MyMalloc(bytes);
+	}
+	catch (const std::bad_alloc&) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+void free(void* ptr) {
+	if (nullptr != ptr) {
+		MyFree(ptr);
+	}
+}
+
+void* calloc(size_t num, size_t bytes) {
+	if (0 != bytes && num > static_cast<size_t>(-1) / bytes) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+	void* ptr = malloc(num * bytes);
+	if (nullptr != ptr) {
+		memset(ptr, 0, num * bytes);
+	}
+	return ptr;
+}
+
+void* realloc(void* ptr, size_t bytes) {
+	if (nullptr != ptr && 0 == bytes) {
+		free(ptr);
+		return nullptr;
+	}
+	try {
+		return MyRealloc(ptr, bytes);
+	}
+	catch (const std::bad_alloc&) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+int posix_memalign(void** memptr, size_t align, size_t bytes) {
+	if (!IsPowerOfTwo(align) || 0 != align % sizeof(void*)) {
+		return EINVAL;
+	}
+	try {
+		*memptr = AlignedAlloc(align, bytes);
+	}
+	catch (const std::bad_alloc&) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+void* aligned_alloc(size_t align, size_t bytes) {
+	if (!IsPowerOfTwo(align)) {
+		errno = EINVAL;
+		return nullptr;
+	}
+	try {
+		return AlignedAlloc(align, bytes);
+	}
+	catch (const std::bad_alloc&) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+void* memalign(size_t align, size_t bytes) {
+	return aligned_alloc(align, bytes);
+}
+
+void* valloc(size_t bytes) {
+	return aligned_alloc(1 << kPageShift, bytes);
+}
+
+void* pvalloc(size_t bytes) {
+	if (bytes > SIZE_MAX - (1 << kPageShift)) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+	return aligned_alloc(1 << kPageShift, SizeClass::RoundUp(bytes, 1 << kPageShift));
+}
+
+size_t malloc_usable_size(void* ptr) {
+	if (nullptr == ptr) {
+		return 0;
+	}
+	return MyMallocUsableSize(ptr);
+}
+
+}
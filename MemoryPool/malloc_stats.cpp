@@ -0,0 +1,138 @@
+#include "malloc_stats.h"
+#include <new>
+
+//メモリプール全体の統計情報を取得
+void GetMallocStats(MallocStats& stats) {
+	stats = MallocStats();
+	//サイズクラスの数だけ並ぶため、スタックではなくSystemAllocで確保する
+	size_t num_thread_stats_page = SizeClass::RoundUp(sizeof(FreeListStats) * kNumFreeList, 1 << kPageShift) >> kPageShift;
+	FreeListStats* thread_stats = new(SystemAlloc(num_thread_stats_page)) FreeListStats[kNumFreeList];
+	ThreadCache::GetOverallStats(thread_stats, stats.num_thread_cache, stats.thread_cache_bytes);
+	CpuCache* cpu_cache = CpuCache::IsEnabled() ? &CpuCache::GetInsatnce() : nullptr;
+	CentralCache& central_cache = CentralCache::GetInsatnce();
+	for (size_t index = 0; index < kNumFreeList; ++index) {
+		MallocStats::SizeClassStats& size_class = stats.size_classes[index];
+		size_class.bytes_object = SizeClass::Info(index).bytes_object;
+		size_class.thread_cache = thread_stats[index];
+		size_class.central_cache = central_cache.GetStats(index);
+		if (nullptr != cpu_cache) {
+			size_class.num_cpu_cache_object = cpu_cache->GetCachedObjectCount(index);
+		}
+		const CentralCacheStats& central = size_class.central_cache;
+		size_t num_cached = central.num_free_object + central.num_transfer_object
+			+ size_class.thread_cache.num_object + size_class.num_cpu_cache_object;
+		size_class.num_in_use = central.num_object > num_cached ? central.num_object - num_cached : 0;
+
+		stats.cpu_cache_bytes += size_class.num_cpu_cache_object * size_class.bytes_object;
+		stats.central_free_bytes += central.num_free_object * size_class.bytes_object;
+		stats.transfer_cache_bytes += central.num_transfer_object * size_class.bytes_object;
+		stats.small_in_use_bytes += size_class.num_in_use * size_class.bytes_object;
+	}
+	SystemFree(thread_stats, num_thread_stats_page);
+
+	PageCache& page_cache = PageCache::GetInsatnce();
+	page_cache.GetStats(stats.page_cache);
+	for (size_t num_page = 1; num_page <= kMaxPage; ++num_page) {
+		stats.page_cache_free_bytes += (stats.page_cache.num_span[num_page] * num_page) << kPageShift;
+	}
+	central_cache.GetLockWaitStats(stats.central_lock_wait, stats.central_lock_wait_ns);
+	page_cache.GetLockWaitStats(stats.page_lock_wait, stats.page_lock_wait_ns);
+}
+
+namespace {
+	//SystemAllocで確保した領域にMallocStatsを取得し、funcに渡す
+	template <class Func>
+	void WithMallocStats(Func func) {
+		size_t num_page = SizeClass::RoundUp(sizeof(MallocStats), 1 << kPageShift) >> kPageShift;
+		MallocStats* stats = new(SystemAlloc(num_page)) MallocStats;
+		GetMallocStats(*stats);
+		func(*stats);
+		stats->~MallocStats();
+		SystemFree(stats, num_page);
+	}
+}
+
+//統計情報を人が読む形式でfpに書き出す
+//サイズクラスとSpanListは、空でないものだけを書き出す
+void PrintMallocStats(FILE* fp) {
+	WithMallocStats([fp](const MallocStats& stats) {
+		const PageCacheStats& page_cache = stats.page_cache;
+		fprintf(fp, "------------------------------------------------\n");
+		fprintf(fp, "MALLOC: %12zu bytes in use (<= %zu bytes)\n", stats.small_in_use_bytes, kMaxBytes);
+		fprintf(fp, "MALLOC: %12zu bytes in thread caches (%zu threads)\n", stats.thread_cache_bytes, stats.num_thread_cache);
+		fprintf(fp, "MALLOC: %12zu bytes in cpu caches\n", stats.cpu_cache_bytes);
+		fprintf(fp, "MALLOC: %12zu bytes in transfer caches\n", stats.transfer_cache_bytes);
+		fprintf(fp, "MALLOC: %12zu bytes free in central spans\n", stats.central_free_bytes);
+		fprintf(fp, "MALLOC: %12zu bytes free in page cache\n", stats.page_cache_free_bytes);
+		fprintf(fp, "MALLOC: %12zu bytes committed (%zu by MAP_HUGETLB, %zu released)\n",
+			page_cache.committed_bytes, page_cache.huge_tlb_bytes, page_cache.released_bytes);
+		fprintf(fp, "MALLOC: %12zu bytes mapped for large objects (%zu cached, hit %zu, miss %zu)\n",
+			page_cache.mapped_bytes, page_cache.large_cached_bytes, page_cache.num_large_hit, page_cache.num_large_miss);
+		fprintf(fp, "MALLOC: %12zu spans taken from page cache, %zu returned\n", page_cache.num_new_span, page_cache.num_free_span);
+		fprintf(fp, "MALLOC: %12zu central lock waits (%.3f ms), %zu page lock waits (%.3f ms)\n",
+			stats.central_lock_wait, stats.central_lock_wait_ns / 1e6, stats.page_lock_wait, stats.page_lock_wait_ns / 1e6);
+		fprintf(fp, "------------------------------------------------\n");
+		fprintf(fp, "%5s %6s %10s %10s %8s %8s %8s %8s %6s %10s %10s %10s %10s %8s %8s\n",
+			"class", "bytes", "in_use", "thread", "cpu", "transfer", "central", "spans",
+			"span+", "alloc", "free", "fetch", "release", "xfer_hit", "span-");
+		for (size_t index = 0; index < kNumFreeList; ++index) {
+			const MallocStats::SizeClassStats& size_class = stats.size_classes[index];
+			const FreeListStats& thread = size_class.thread_cache;
+			const CentralCacheStats& central = size_class.central_cache;
+			if (0 == central.num_span && 0 == thread.num_allocate && 0 == central.num_span_fetch) {
+				continue;
+			}
+			fprintf(fp, "%5zu %6zu %10zu %10zu %8zu %8zu %8zu %8zu %6zu %10zu %10zu %10zu %10zu %8zu %8zu\n",
+				index, size_class.bytes_object, size_class.num_in_use, thread.num_object, size_class.num_cpu_cache_object,
+				central.num_transfer_object, central.num_free_object, central.num_span, central.num_span_fetch,
+				thread.num_allocate, thread.num_deallocate, thread.num_fetch, thread.num_release,
+				central.num_transfer_hit, central.num_span_release);
+		}
+		fprintf(fp, "------------------------------------------------\n");
+		fprintf(fp, "page cache free spans by page count:\n");
+		for (size_t num_page = 1; num_page <= kMaxPage; ++num_page) {
+			if (0 != page_cache.num_span[num_page]) {
+				fprintf(fp, "%5zu pages: %8zu spans\n", num_page, page_cache.num_span[num_page]);
+			}
+		}
+	});
+}
+
+//統計情報をJSONでfpに書き出す
+//サイズクラスとSpanListは、空のものも含めてすべて書き出す
+void PrintMallocStatsJson(FILE* fp) {
+	WithMallocStats([fp](const MallocStats& stats) {
+		const PageCacheStats& page_cache = stats.page_cache;
+		fprintf(fp, "{\"num_thread_cache\":%zu,\"thread_cache_bytes\":%zu,\"cpu_cache_bytes\":%zu,"
+			"\"transfer_cache_bytes\":%zu,\"central_free_bytes\":%zu,\"small_in_use_bytes\":%zu,\"page_cache_free_bytes\":%zu,",
+			stats.num_thread_cache, stats.thread_cache_bytes, stats.cpu_cache_bytes,
+			stats.transfer_cache_bytes, stats.central_free_bytes, stats.small_in_use_bytes, stats.page_cache_free_bytes);
+		fprintf(fp, "\"central_lock_wait\":%zu,\"central_lock_wait_ns\":%zu,\"page_lock_wait\":%zu,\"page_lock_wait_ns\":%zu,",
+			stats.central_lock_wait, stats.central_lock_wait_ns, stats.page_lock_wait, stats.page_lock_wait_ns);
+		fprintf(fp, "\"page_cache\":{\"num_new_span\":%zu,\"num_free_span\":%zu,\"committed_bytes\":%zu,\"huge_tlb_bytes\":%zu,"
+			"\"released_bytes\":%zu,\"mapped_bytes\":%zu,\"large_cached_bytes\":%zu,\"num_large_hit\":%zu,\"num_large_miss\":%zu,\"num_span\":[",
+			page_cache.num_new_span, page_cache.num_free_span, page_cache.committed_bytes, page_cache.huge_tlb_bytes,
+			page_cache.released_bytes, page_cache.mapped_bytes, page_cache.large_cached_bytes,
+			page_cache.num_large_hit, page_cache.num_large_miss);
+		for (size_t num_page = 0; num_page <= kMaxPage; ++num_page) {
+			fprintf(fp, "%s%zu", 0 == num_page ? "" : ",", page_cache.num_span[num_page]);
+		}
+		fprintf(fp, "]},\"size_classes\":[");
+		for (size_t index = 0; index < kNumFreeList; ++index) {
+			const MallocStats::SizeClassStats& size_class = stats.size_classes[index];
+			const FreeListStats& thread = size_class.thread_cache;
+			const CentralCacheStats& central = size_class.central_cache;
+			fprintf(fp, "%s{\"index\":%zu,\"bytes\":%zu,\"in_use\":%zu,\"cpu_cache\":%zu,"
+				"\"thread_cache\":{\"objects\":%zu,\"max_size\":%zu,\"allocate\":%zu,\"deallocate\":%zu,\"fetch\":%zu,\"fetch_objects\":%zu,"
+				"\"release\":%zu,\"release_objects\":%zu,\"drain\":%zu,\"drain_objects\":%zu},",
+				0 == index ? "" : ",", index, size_class.bytes_object, size_class.num_in_use, size_class.num_cpu_cache_object,
+				thread.num_object, thread.max_size, thread.num_allocate, thread.num_deallocate, thread.num_fetch, thread.num_fetch_object,
+				thread.num_release, thread.num_release_object, thread.num_drain, thread.num_drain_object);
+			fprintf(fp, "\"central_cache\":{\"spans\":%zu,\"objects\":%zu,\"free_objects\":%zu,\"transfer_objects\":%zu,"
+				"\"transfer_hit\":%zu,\"transfer_miss\":%zu,\"span_fetch\":%zu,\"span_release\":%zu}}",
+				central.num_span, central.num_object, central.num_free_object, central.num_transfer_object,
+				central.num_transfer_hit, central.num_transfer_miss, central.num_span_fetch, central.num_span_release);
+		}
+		fprintf(fp, "]}\n");
+	});
+}
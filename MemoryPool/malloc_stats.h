@@ -0,0 +1,53 @@
+#pragma once
+#include "common.h"
+#include "thread_cache.h"
+#include "cpu_cache.h"
+#include "central_cache.h"
+#include "page_cache.h"
+#include <cstdio>
+
+//メモリプール全体の統計情報
+//各層のカウンタはスレッド、CPU(シャード、アリーナ)ごとに持ち、確保、解放の際にロックやアトミック操作を増やさない
+//GetMallocStatsがそれらを順に集計するため、層をまたいだ合計は集計中の確保、解放の分だけずれることがある
+struct MallocStats {
+	//サイズクラス一つ分
+	struct SizeClassStats {
+		size_t bytes_object = 0;
+		//アプリケーションが使用中の領域の数(Spanから取り出された数から、各キャッシュが保有している数を引いたもの)
+		size_t num_in_use = 0;
+		//CpuCacheが保有している領域の数
+		size_t num_cpu_cache_object = 0;
+		//すべてのThreadCacheの合計
+		FreeListStats thread_cache;
+		CentralCacheStats central_cache;
+	};
+	SizeClassStats size_classes[kNumFreeList];
+
+	//ThreadCacheの数と保有しているバイト数、CpuCacheが保有しているバイト数
+	size_t num_thread_cache = 0;
+	size_t thread_cache_bytes = 0;
+	size_t cpu_cache_bytes = 0;
+	//CentralCacheのSpan、TransferCacheにある空いている領域のバイト数
+	size_t central_free_bytes = 0;
+	size_t transfer_cache_bytes = 0;
+	//[1b,16*4kb]の領域のうち、アプリケーションが使用中のバイト数
+	size_t small_in_use_bytes = 0;
+	//PageCacheの空いているSpanのバイト数
+	size_t page_cache_free_bytes = 0;
+	PageCacheStats page_cache;
+
+	//CentralCache、PageCacheのロックを待った回数と時間
+	size_t central_lock_wait = 0;
+	size_t central_lock_wait_ns = 0;
+	size_t page_lock_wait = 0;
+	size_t page_lock_wait_ns = 0;
+};
+
+//メモリプール全体の統計情報を取得
+//MallocStatsは数十KBあるため、スタックの小さいスレッドではSystemAllocなどで確保した領域に取得する
+void GetMallocStats(MallocStats& stats);
+//統計情報を人が読む形式でfpに書き出す
+//書き出しの間にmallocを呼ばないよう、MallocStatsはSystemAllocで確保する
+void PrintMallocStats(FILE* fp);
+//統計情報をJSONでfpに書き出す
+void PrintMallocStatsJson(FILE* fp);
@@ -1,15 +1,32 @@
 #pragma once
 #include "thread_cache.h"
+#include "cpu_cache.h"
+#include "heap_profiler.h"
+#include "malloc_stats.h"
+#include "trace_recorder.h"
+#include <cstring>
 
-//bytesサイズ分のメモリ領域を確保
-static void* MyMalloc(size_t bytes) {
-	//スレッドごとにThreadCacheを保持する
+//呼び出し元のスレッドのThreadCacheを取得、まだない場合は作成
+inline ThreadCache* GetThreadCache() {
+	//スレッドごとにThreadCacheを保持し、スレッド終了時に破棄する
 	if (nullptr == p_thread_cache) {
-		p_thread_cache = new ThreadCache();//TODO
+		return ThreadCache::Create();
 	}
-	//[1b,16*4kb] ThreadCacheより確保
+	return p_thread_cache;
+}
+
+//bytesサイズ分のメモリ領域を確保、TraceRecorderに記録しない
+inline void* MyMallocUntraced(size_t bytes) {
+	//0バイトの場合も一意のポインタを返すため、1バイトとして扱う
+	if (0 == bytes) {
+		bytes = 1;
+	}
+	//[1b,16*4kb] ThreadCache(CpuCache::SetEnabledで有効にした場合はCpuCache)より確保
 	if (bytes <= kMaxBytes) {
-		return p_thread_cache->Allocate(bytes);
+		if (CpuCache::IsEnabled()) {
+			return CpuCache::GetInsatnce().Allocate(bytes);
+		}
+		return GetThreadCache()->Allocate(bytes);
 	}
 	//(16*4kb,128*4kb] PageCacheより確保
 	else if (bytes <= (kMaxPage << kPageShift)) {
@@ -28,26 +45,140 @@ static void* MyMalloc(size_t bytes) {
 		return PageCache::GetInsatnce().SystemAllocPage(num_page);
 	}
 }
-//ptrが指しているメモリ領域を解放
-static void MyFree(void* ptr) {
+//ptrが指しているメモリ領域を解放、TraceRecorderに記録しない
+inline void MyFreeUntraced(void* ptr) {
 	//ptrより、確保されているメモリが所属するページのIDを取得
 	PageId id = reinterpret_cast<PageId>(ptr) >> kPageShift;
 	Span* p_span = PageCache::GetInsatnce().GetSpanRefFromPageId(id);
 	if (p_span) {
+		//HeapProfilerがサンプリングした領域があるSpanの場合のみ、その表から外す
+		if (0 != p_span->getSampledObjectCount()) {
+			HeapProfiler::RecordFree(ptr, p_span);
+		}
 		size_t bytes_object = p_span->getObjectSize();
-		//[1b,16*4kb] ThreadCacheより解放
+		//[1b,16*4kb] ThreadCache(CpuCache::SetEnabledで有効にした場合はCpuCache)より解放
 		if (bytes_object <= kMaxBytes) {
-			p_thread_cache->Deallocate(ptr, bytes_object);
+			if (CpuCache::IsEnabled()) {
+				CpuCache::GetInsatnce().Deallocate(ptr, bytes_object);
+				return;
+			}
+			ThreadCache* thread_cache = GetThreadCache();
+			//Spanの領域をすべて他の一つのスレッドがCentralCacheから取得した場合、そのスレッドに返す
+			//そのスレッドが破棄済みの場合は、まとめた領域を返す際に呼び出し元のスレッドに入る
+			uint64_t owner = p_span->getOwner();
+			if (ThreadCache::IsRemoteFree() && owner > kSharedSpanOwner && owner != thread_cache->getOwnerId()) {
+				thread_cache->DeallocateRemote(owner, ptr, bytes_object);
+			}
+			else {
+				thread_cache->Deallocate(ptr, bytes_object);
+			}
 		}
 		//(16*4kb,128*4kb] PageCacheより解放
 		else if (bytes_object <= (kMaxPage << kPageShift)) {
 			p_span->Clear();
 			PageCache::GetInsatnce().FreeSpan(p_span);
 		}
+		//(128*4kb,+∞] システムのインタフェースより解放
+		else {
+			PageCache::GetInsatnce().SystemFreePage(p_span);
+		}
+	}
+	//メモリプールが確保した領域でない場合、システムに渡さず無視する
+}
+
+//bytesサイズ分のメモリ領域を確保
+inline void* MyMalloc(size_t bytes) {
+	void* ptr = MyMallocUntraced(bytes);
+	if (TraceRecorder::IsEnabled()) {
+		TraceRecorder::RecordMalloc(ptr, bytes);
+	}
+	if (HeapProfiler::IsEnabled()) {
+		HeapProfiler::RecordMalloc(ptr, bytes);
+	}
+	return ptr;
+}
+//ptrが指しているメモリ領域を解放
+inline void MyFree(void* ptr) {
+	if (TraceRecorder::IsEnabled()) {
+		TraceRecorder::RecordFree(ptr);
+	}
+	MyFreeUntraced(ptr);
+}
+
+
+//大きさがbytesとわかっているptrが指しているメモリ領域を解放
+//bytesはMyMallocに渡した大きさと同じであること
+//[1b,16*4kb]の場合、ページIDからSpanを引かずに直接呼び出し元のThreadCacheに返す
+//Spanを引かないため、他のスレッドが取得した領域でもそのスレッドには返さない
+//HeapProfilerがサンプリングした領域がある間は、サンプリングした領域かを調べるためMyFreeと同じくSpanを引く
+inline void MyFreeSized(void* ptr, size_t bytes) {
+	if (0 == bytes) {
+		bytes = 1;
+	}
+	if (bytes <= kMaxBytes && !HeapProfiler::HasSamples()) {
+		if (TraceRecorder::IsEnabled()) {
+			TraceRecorder::RecordFree(ptr);
+		}
+		if (CpuCache::IsEnabled()) {
+			CpuCache::GetInsatnce().Deallocate(ptr, bytes);
+		}
+		else {
+			GetThreadCache()->Deallocate(ptr, bytes);
+		}
 	}
-	//(128*4kb,+∞] システムのインタフェースより解放
 	else {
-		PageCache::GetInsatnce().SystemFreePage(ptr);
+		MyFree(ptr);
+	}
+}
+
+//ptrが指しているメモリ領域のうち、ptrから利用できるバイト数を取得
+//メモリプールが確保した領域でない場合は0を返す
+inline size_t MyMallocUsableSize(void* ptr) {
+	PageId id = reinterpret_cast<PageId>(ptr) >> kPageShift;
+	Span* p_span = PageCache::GetInsatnce().GetSpanRefFromPageId(id);
+	if (p_span) {
+		size_t bytes_object = p_span->getObjectSize();
+		//[1b,16*4kb] ptrはサイズクラスの領域の先頭
+		if (bytes_object <= kMaxBytes) {
+			return bytes_object;
+		}
+		//(16*4kb,+∞] Spanの先頭から数える
+		char* end = reinterpret_cast<char*>(p_span->getStartPageId() << kPageShift) + bytes_object;
+		return end - static_cast<char*>(ptr);
 	}
+	return 0;
 }
 
+//ptrが指しているメモリ領域の大きさをbytesに変更し、新しい領域へのポインタを返す、ptrがnullptrの場合はMyMallocと同じ
+//縮小する場合、無駄が半分以下であれば領域をそのまま使う
+//PageCacheを経由せずシステムから確保した領域同士の場合、mremapでコピーせずに広げる
+inline void* MyRealloc(void* ptr, size_t bytes) {
+	if (nullptr == ptr) {
+		return MyMalloc(bytes);
+	}
+	size_t bytes_usable = MyMallocUsableSize(ptr);
+	if (bytes <= bytes_usable && bytes >= bytes_usable / 2) {
+		//サンプリングした領域は、プロファイルが伸縮後の大きさを示すよう記録を直す
+		if (HeapProfiler::IsSampled(ptr)) {
+			HeapProfiler::RecordResize(ptr, bytes);
+		}
+		return ptr;
+	}
+	//サンプリングした領域は、HeapProfilerの表のキーが変わらないようコピーで移す
+	if (bytes > (kMaxPage << kPageShift) && !HeapProfiler::IsSampled(ptr)) {
+		PageId num_page = static_cast<PageId>(SizeClass::RoundUp(bytes, 1 << kPageShift) >> kPageShift);
+		void* new_ptr = PageCache::GetInsatnce().SystemReallocPage(ptr, num_page);
+		if (nullptr != new_ptr) {
+			//mremapで移した場合も、解放と確保の組として記録する
+			if (TraceRecorder::IsEnabled()) {
+				TraceRecorder::RecordFree(ptr);
+				TraceRecorder::RecordMalloc(new_ptr, bytes);
+			}
+			return new_ptr;
+		}
+	}
+	void* new_ptr = MyMalloc(bytes);
+	memcpy(new_ptr, ptr, bytes < bytes_usable ? bytes : bytes_usable);
+	MyFree(ptr);
+	return new_ptr;
+}
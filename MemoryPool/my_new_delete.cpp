@@ -0,0 +1,68 @@
+#include "my_malloc.h"
+
+//グローバルのoperator new/deleteをMyMalloc/MyFreeに置き換える
+//このファイルをリンクしたプログラムでは、new/deleteがすべてメモリプールから確保・解放される
+//大きさがわかるdelete(C++14のsized delete)はMyFreeSizedを呼び、ページIDからSpanを引く処理を省く
+//アライメント指定のnew/delete(std::align_val_t)は置き換えず、標準ライブラリの実装のまま
+
+void* operator new(size_t bytes) {
+	return MyMalloc(bytes);
+}
+
+void* operator new[](size_t bytes) {
+	return MyMalloc(bytes);
+}
+
+void* operator new(size_t bytes, const std::nothrow_t&) noexcept {
+	try {
+		return MyMalloc(bytes);
+	}
+	catch (const std::bad_alloc&) {
+		return nullptr;
+	}
+}
+
+void* operator new[](size_t bytes, const std::nothrow_t&) noexcept {
+	try {
+		return MyMalloc(bytes);
+	}
+	catch (const std::bad_alloc&) {
+		return nullptr;
+	}
+}
+
+void operator delete(void* ptr) noexcept {
+	if (nullptr != ptr) {
+		MyFree(ptr);
+	}
+}
+
+void operator delete[](void* ptr) noexcept {
+	if (nullptr != ptr) {
+		MyFree(ptr);
+	}
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+	if (nullptr != ptr) {
+		MyFree(ptr);
+	}
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+	if (nullptr != ptr) {
+		MyFree(ptr);
+	}
+}
+
+void operator delete(void* ptr, size_t bytes) noexcept {
+	if (nullptr != ptr) {
+		MyFreeSized(ptr, bytes);
+	}
+}
+
+void operator delete[](void* ptr, size_t bytes) noexcept {
+	if (nullptr != ptr) {
+		MyFreeSized(ptr, bytes);
+	}
+}
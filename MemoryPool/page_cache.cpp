@@ -1,4 +1,5 @@
 #include "page_cache.h"
+#include <thread>
 
 //シングルトン、PageCacheのInsatnceを取得
 PageCache& PageCache::GetInsatnce() {
@@ -6,156 +7,784 @@ PageCache& PageCache::GetInsatnce() {
 	std::unique_lock<std::mutex> lck(_mtx, std::defer_lock);
 	lck.lock();
 	if (nullptr == _p_instance) {
-		_p_instance.reset(new PageCache());
+		_p_instance = NewObject<PageCache>();
 	}
 	lck.unlock();
 	return *_p_instance;
 }
 
+//アリーナの数をCPUの数から決める
+//Windowsではアリーナごとの予約領域がないため、Mergeがアリーナをまたがないよう一つにする
+PageCache::PageCache() {
+#ifndef _WIN32
+	size_t num_cpu = GetCpuCount();
+	_num_arena = num_cpu < kMaxPageArena ? num_cpu : kMaxPageArena;
+#endif
+}
+
 //マルチスレッド対応
+//呼び出し元のCPUのアリーナから取得し、他のCPUのスレッドとはロックを取り合わない
 Span* PageCache::NewSpan(PageId num_page) {
-	std::unique_lock<std::mutex> lck(_mtx, std::defer_lock);
-	lck.lock();
-	Span* new_span = _NewSpan(num_page);
-	lck.unlock();
+	MEMORY_POOL_LATENCY_SCOPE(kPageNewSpan, 0);
+	size_t arena = GetCurrentCpu() % _num_arena;
+	std::mutex& mtx = _arenas[arena].mtx;
+	_lock_wait_stats.Lock(mtx);
+	std::lock_guard<std::mutex> lck(mtx, std::adopt_lock);
+	Span* new_span = _NewSpan(arena, num_page);
+	++_arenas[arena].num_new_span;
+	new_span->setInUse(true);
+	_CountUsedPage(new_span->getStartPageId(), new_span->getTotalPageCount(), true);
 	return new_span;
 }
 
 
 //未使用のメモリ領域の情報を保有するSpanを取得
-Span* PageCache::_NewSpan(PageId num_page) {
-	//_span_listsのindexがnum_pageのSpanListから取得
-	if (!_span_lists[num_page].Empty()) {
-		return _span_lists[num_page].PopFront();
-	}
-
-	//num_pageよりページ数が大きいSpanから取得
-	for (PageId i = num_page; i < kMaxPage + 1; ++i) {
-		if (!_span_lists[i].Empty()) {
+//num_page以上で最小のページ数のSpanを選び(best-fit)、大きい場合は分割する
+Span* PageCache::_NewSpan(size_t arena, PageId num_page) {
+	Arena& r_arena = _arenas[arena];
+	Span* p_original = _PopBestFit(r_arena, num_page);
+	if (nullptr != p_original) {
+		//ページ数がnum_pageのSpanがあった場合、そのまま返す
+		if (p_original->getTotalPageCount() == num_page) {
+			return p_original;
+		}
 
-			//p_originalの「頭」から、num_page個のページを切って、p_splitに入れる
-			Span* p_original = _span_lists[i].PopFront();
-			Span* p_split = new Span();//TODO
-			p_split->setStartPageId(p_original->getStartPageId() + p_original->getTotalPageCount() - num_page);
-			p_split->setTotalPageCount(num_page);
+		//p_originalの「頭」から、num_page個のページを切って、p_splitに入れる
+		Span* p_split = NewObject<Span>();
+		p_split->setStartPageId(p_original->getStartPageId() + p_original->getTotalPageCount() - num_page);
+		p_split->setTotalPageCount(num_page);
+		p_split->setArena(arena);
 
-			//p_originalが保有するページ数が少なくなったため、別のSpanListに入れる
-			p_original->setTotalPageCount(p_original->getTotalPageCount() - num_page);
-			_span_lists[p_original->getTotalPageCount()].PushFront(p_original);
+		//p_originalが保有するページ数が少なくなったため、別のSpanListに入れる
+		p_original->setTotalPageCount(p_original->getTotalPageCount() - num_page);
+		r_arena.PushSpan(p_original);
 
-			//p_originalからp_splitに移ったページの情報を_id_span_mapに更新
-			for (PageId id = 0; id < p_split->getTotalPageCount(); ++id) {
-				_id_span_map[p_split->getStartPageId() + id] = p_split;
-			}
+		//p_originalからp_splitに移ったページの情報を_page_mapに更新
+		_RegisterSpan(p_split);
 
-			return p_split;
-		}
+		return p_split;
 	}
 
 	//上記処理からSpanが取得できない場合、システムから128ページを纏めて取得し、128ページのメモリ領域を保有するSpanを新規作成
-	void* ptr = SystemAllocPage(kMaxPage);
-	Span* new_span = new Span();//TODO
+	void* ptr = _CommitPage(arena);
+	Span* new_span = NewObject<Span>();
 	new_span->setStartPageId(reinterpret_cast<PageId>(ptr) >> kPageShift);
 	new_span->setTotalPageCount(kMaxPage);
+	new_span->setArena(arena);
+	new_span->setFreeSince(_NowNanoseconds());
 
 	//新しく取得した128ページのIDとnew_spanと紐づける
-	for (PageId id = 0; id < new_span->getTotalPageCount(); ++id) {
-		_id_span_map[new_span->getStartPageId() + id] = new_span;
+	if (!_page_map.Ensure(new_span->getStartPageId(), new_span->getTotalPageCount())) {
+		throw std::bad_alloc();
 	}
+	_RegisterSpan(new_span);
 
 	//新規作成のSpanをPageCacheに保存
-	_span_lists[new_span->getTotalPageCount()].PushFront(new_span);
+	r_arena.PushSpan(new_span);
 
 	//ここまで来るとはもともとPageCacheに使えるSpanは存在しなかったことを意味する
 	//そのため_NewSpanをもう一度呼び出し、上記取得した128ページのSpanを「頭」からnum_pageのページを切って、
 	//NewSpanを作って、呼び出し元に返す
-	return _NewSpan(num_page);
+	return _NewSpan(arena, num_page);
 }
 
 //SpanをPageCacheに返し、
 //それに保有する最小のページの前のページも他のSpanに管理され、しかもそのSpanが未使用の場合、二つのSpanをMerge
 //それに保有する最大のページの後のページも他のSpanに管理され、しかもそのSpanが未使用の場合、二つのSpanをMerge
+//Mergeは同じ予約領域、つまり同じアリーナのSpanとのみ行う
 void PageCache::FreeSpan(Span* p_span) {
+	//マルチスレッド対応、p_spanが所属するアリーナのロックで保護する
+	Arena& r_arena = _arenas[p_span->getArena()];
+	std::mutex& mtx = r_arena.mtx;
+	_lock_wait_stats.Lock(mtx);
+	std::lock_guard<std::mutex> lck(mtx, std::adopt_lock);
+	++r_arena.num_free_span;
+	p_span->setInUse(false);
+	//Mergeした場合も、一番最近返されたこの時刻を使う
+	p_span->setFreeSince(_NowNanoseconds());
+	_CountUsedPage(p_span->getStartPageId(), p_span->getTotalPageCount(), false);
 
 	//前へMerge
 	while (true) {
 		//p_spanに保有する最小のページの前のページのIDを計算
 		PageId id_prev = p_span->getStartPageId() - 1;
 
-		//前のページのIDが_id_span_mapに存在しない、つまりPageCacheに管理されていない場合、前へMergeを中止
-		auto itr = _id_span_map.find(id_prev);
-		if (itr == _id_span_map.end()) {
+		//前のページが別の予約領域にある場合、別のアリーナのSpanの可能性があるため、前へMergeを中止
+		if (!_SameRegion(id_prev, p_span->getStartPageId())) {
+			break;
+		}
+
+		//前のページのIDが_page_mapに存在しない、つまりPageCacheに管理されていない場合、前へMergeを中止
+		Span* p_span_prev = _page_map.Get(id_prev);
+		if (nullptr == p_span_prev) {
 			break;
 		}
 
 		//前ののSpanが存在し、それが利用中もしくは合併したら128ページ超え、PageCacheが格納できない場合、前へMergeを中止
-		Span* p_span_prev = itr->second;
-		if (!p_span_prev->Full() || p_span->getTotalPageCount() + p_span_prev->getTotalPageCount() > kMaxPage) {
+		if (p_span_prev->InUse() || p_span->getTotalPageCount() + p_span_prev->getTotalPageCount() > kMaxPage) {
 			break;
 		}
 
 		//p_span_prevをp_spanにMerge
-		_span_lists[p_span_prev->getTotalPageCount()].Erase(p_span_prev);
+		r_arena.EraseSpan(p_span_prev);
 		p_span->setStartPageId(p_span_prev->getStartPageId());
 		p_span->setTotalPageCount(p_span_prev->getTotalPageCount() + p_span->getTotalPageCount());
 
-		//Merge後_id_span_mapを更新
+		//Merge後_page_mapを更新
 		for (PageId id = 0; id < p_span_prev->getTotalPageCount(); ++id) {
-			_id_span_map[p_span_prev->getStartPageId() + id] = p_span;
+			_page_map.Set(p_span_prev->getStartPageId() + id, p_span);
 		}
-		delete p_span_prev;//TODO
+		DeleteObject(p_span_prev);
 	}
 
 	//後ろへMerge
 	while (true) {
 		PageId id_next = p_span->getStartPageId() + p_span->getTotalPageCount();
-		auto itr = _id_span_map.find(id_next);
-		if (itr == _id_span_map.end()) {
+		if (!_SameRegion(id_next, p_span->getStartPageId())) {
+			break;
+		}
+		Span* p_span_next = _page_map.Get(id_next);
+		if (nullptr == p_span_next) {
 			break;
 		}
-		Span* p_span_next = itr->second;
-		if (!p_span_next->Full() || p_span->getTotalPageCount() + p_span_next->getTotalPageCount() > kMaxPage) {
+		if (p_span_next->InUse() || p_span->getTotalPageCount() + p_span_next->getTotalPageCount() > kMaxPage) {
 			break;
 		}
-		_span_lists[p_span_next->getTotalPageCount()].Erase(p_span_next);
+		r_arena.EraseSpan(p_span_next);
 
 		p_span->setTotalPageCount(p_span_next->getTotalPageCount() + p_span->getTotalPageCount());
 
 		for (PageId id = 0; id < p_span_next->getTotalPageCount(); ++id) {
-			_id_span_map[p_span_next->getStartPageId() + id] = p_span;
+			_page_map.Set(p_span_next->getStartPageId() + id, p_span);
 		}
-		delete p_span_next;//TODO
+		DeleteObject(p_span_next);
 	}
-	_span_lists[p_span->getTotalPageCount()].PushFront(p_span);
+	r_arena.PushSpan(p_span);
+}
+
+//アリーナのnum_page以上で最小のページ数のSpanListから、使用中のページが最も多いヒュージページにあるSpanを取り出す
+//同じページ数のSpanであれば、すでに使われているヒュージページから切り出すことで、他のヒュージページを空いたままにする
+//SpanListの先頭からkMaxHugePageScan個までを比べ、それ以降は調べない
+Span* PageCache::_PopBestFit(Arena& arena, PageId num_page) {
+	size_t num_page_fit = arena.BestFitPageCount(num_page);
+	if (0 == num_page_fit) {
+		return nullptr;
+	}
+	SpanList& list = arena.span_lists[num_page_fit];
+	Span* p_best = nullptr;
+	ptrdiff_t num_used_best = 0;
+	size_t num_scan = 0;
+	for (SpanListIterator it = list.Begin(); it != list.End() && num_scan < kMaxHugePageScan; ++it, ++num_scan) {
+		ptrdiff_t num_used = _GetUsedPage(it->getStartPageId());
+		if (nullptr == p_best || num_used > num_used_best) {
+			p_best = &it;
+			num_used_best = num_used;
+		}
+	}
+	arena.EraseSpan(p_best);
+	return p_best;
 }
 
 //ページIDからそのページを保有するSpanを取得
+//_page_mapの読み込みはロック不要のため、どのスレッドからも呼び出せる
 Span* PageCache::GetSpanRefFromPageId(PageId id) {
-	auto itr = _id_span_map.find(id);
-	if (itr != _id_span_map.end()) {
-		return itr->second;
+	return _page_map.Get(id);
+}
+
+//p_spanが保有するすべてのページのIDをp_spanと紐づける
+void PageCache::_RegisterSpan(Span* p_span) {
+	for (PageId id = 0; id < p_span->getTotalPageCount(); ++id) {
+		_page_map.Set(p_span->getStartPageId() + id, p_span);
 	}
-	return nullptr;
+}
+
+//p_spanが保有するすべてのページのIDの紐づけを外す
+void PageCache::_UnregisterSpan(Span* p_span) {
+	for (PageId id = 0; id < p_span->getTotalPageCount(); ++id) {
+		_page_map.Set(p_span->getStartPageId() + id, nullptr);
+	}
+}
+
+//[start, start + num_page)のページが所属するヒュージページの使用中のページ数を、usedならば増やし、そうでなければ減らす
+//Mergeの結果Spanがヒュージページの境界をまたぐことがあるため、ヒュージページごとに分けて数える
+void PageCache::_CountUsedPage(PageId start, PageId num_page, bool used) {
+#ifdef _WIN32
+	(void)start;
+	(void)num_page;
+	(void)used;
+#else
+	Region* region = _region_map.Get(start / kRegionPage);
+	for (PageId id = start; id < start + num_page;) {
+		PageId id_end = (id / kHugePagePage + 1) * kHugePagePage;
+		if (id_end > start + num_page) {
+			id_end = start + num_page;
+		}
+		size_t index = (id % kRegionPage) / kHugePagePage;
+		uint16_t& num_used_page = region->num_used_page[index];
+		if (used) {
+			num_used_page += static_cast<uint16_t>(id_end - id);
+			//物理メモリを返したページを再利用する場合、触れたページからページフォルトで割り当て直される
+			if (0 != region->num_released_page[index]) {
+				size_t num_page = region->ClearReleased(id % kRegionPage, (id_end - 1) % kRegionPage + 1);
+				_released_bytes.fetch_sub(num_page << kPageShift, std::memory_order_relaxed);
+			}
+		}
+		else {
+			num_used_page -= static_cast<uint16_t>(id_end - id);
+			if (0 == num_used_page) {
+				region->free_since[index] = _NowNanoseconds();
+			}
+		}
+		id = id_end;
+	}
+#endif
+}
+
+//ページが所属するヒュージページの使用中のページ数を取得、すべてのページの物理メモリを返したヒュージページは-1
+ptrdiff_t PageCache::_GetUsedPage(PageId id) {
+#ifdef _WIN32
+	(void)id;
+	return 0;
+#else
+	Region* region = _region_map.Get(id / kRegionPage);
+	size_t index = (id % kRegionPage) / kHugePagePage;
+	if (kHugePagePage == region->num_released_page[index]) {
+		return -1;
+	}
+	return region->num_used_page[index];
+#endif
+}
+
+//空いているページの物理メモリを、合計bytes以上になるまでシステムに返し、返したバイト数を取得
+size_t PageCache::ReleaseFreeMemory(size_t bytes) {
+	return _Release(bytes, 0);
+}
+
+//空いてからmin_idle_ns以上経ったページの物理メモリを、合計bytes以上になるまでシステムに返す
+//まずすべてのアリーナでヒュージページ全体が空いているものを返し、THPのヒュージページをなるべく分割させない
+//足りない場合は、使用中のページがあるヒュージページにある空きSpanのページを返す(THPが無効な環境ではこれが主になる)
+//Spanはそのままアリーナに残し、再利用時にページフォルトで物理メモリを割り当て直す
+size_t PageCache::_Release(size_t bytes, uint64_t min_idle_ns) {
+#ifdef _WIN32
+	(void)bytes;
+	(void)min_idle_ns;
+	return 0;
+#else
+	size_t bytes_released = 0;
+	Region* regions = nullptr;
+	{
+		std::unique_lock<std::mutex> lck(_system_mtx);
+		regions = _regions;
+	}
+	for (size_t arena = 0; arena < _num_arena && bytes_released < bytes; ++arena) {
+		std::mutex& mtx = _arenas[arena].mtx;
+		_lock_wait_stats.Lock(mtx);
+		std::lock_guard<std::mutex> lck(mtx, std::adopt_lock);
+		bytes_released += _ReleaseHugePage(arena, regions, bytes - bytes_released, min_idle_ns);
+	}
+	for (size_t arena = 0; arena < _num_arena && bytes_released < bytes; ++arena) {
+		std::mutex& mtx = _arenas[arena].mtx;
+		_lock_wait_stats.Lock(mtx);
+		std::lock_guard<std::mutex> lck(mtx, std::adopt_lock);
+		bytes_released += _ReleaseFreeSpan(arena, bytes - bytes_released, min_idle_ns);
+	}
+
+	//足りない場合、SystemFreePageでキャッシュした領域も古いものからmunmapする
+	if (bytes_released < bytes) {
+		Mapping* evicted = nullptr;
+		{
+			std::unique_lock<std::mutex> lck(_system_mtx);
+			evicted = _EvictLargeCache(bytes - bytes_released, min_idle_ns);
+		}
+		bytes_released += _UnmapLargeCache(evicted);
+	}
+	return bytes_released;
+#endif
+}
+
+#ifndef _WIN32
+//arena番目のアリーナのうち、すべてのページが空いてからmin_idle_ns以上経ったヒュージページを、合計bytes以上になるまで返す
+//madviseが失敗した場合は返したものとして扱わず、次のヒュージページに進む
+size_t PageCache::_ReleaseHugePage(size_t arena, Region* regions, size_t bytes, uint64_t min_idle_ns) {
+	const size_t bytes_huge_page = kHugePagePage << kPageShift;
+	Arena& r_arena = _arenas[arena];
+	size_t bytes_released = 0;
+	uint64_t now = _NowNanoseconds();
+	//Regionのリストは先頭に追加するだけで、取り出した後の要素は変わらない
+	for (Region* region = regions; nullptr != region && bytes_released < bytes; region = region->next) {
+		if (region->arena != arena) {
+			continue;
+		}
+		//アリーナが最新の予約領域として使っている場合、まだSpanとして渡していない部分は対象外
+		char* end = region->start + (kRegionPage << kPageShift);
+		if (end == r_arena.region_end) {
+			end = r_arena.region_cur;
+		}
+		for (size_t index = 0; index < kRegionPage / kHugePagePage && bytes_released < bytes; ++index) {
+			char* ptr = region->start + index * bytes_huge_page;
+			if (ptr + bytes_huge_page > end) {
+				break;
+			}
+			if (0 != region->num_used_page[index] || kHugePagePage == region->num_released_page[index]
+				|| now - region->free_since[index] < min_idle_ns) {
+				continue;
+			}
+			if (0 != madvise(ptr, bytes_huge_page, MADV_DONTNEED)) {
+				continue;
+			}
+			//一部のページをすでにページ単位で返している場合、その分は数えない
+			size_t num_page = region->MarkReleased(index * kHugePagePage, (index + 1) * kHugePagePage);
+			bytes_released += num_page << kPageShift;
+		}
+	}
+	_released_bytes.fetch_add(bytes_released, std::memory_order_relaxed);
+	return bytes_released;
+}
+
+//arena番目のアリーナの空いてからmin_idle_ns以上経ったSpanのページを、合計bytes以上になるまで返す
+//一回のmadviseで多く返せるよう、ページ数の大きいSpanListから調べる
+//使用中のページがあるTHPのヒュージページは分割されるが、しばらく使われていないページのみを対象にする
+//MAP_HUGETLBで確保したヒュージページの一部はmadviseが失敗するため、返したものとして扱わない
+size_t PageCache::_ReleaseFreeSpan(size_t arena, size_t bytes, uint64_t min_idle_ns) {
+	Arena& r_arena = _arenas[arena];
+	size_t bytes_released = 0;
+	uint64_t now = _NowNanoseconds();
+	for (size_t num_page = kMaxPage; num_page > 0 && bytes_released < bytes; --num_page) {
+		SpanList& list = r_arena.span_lists[num_page];
+		for (SpanListIterator it = list.Begin(); it != list.End() && bytes_released < bytes; ++it) {
+			Span* p_span = &it;
+			if (now - p_span->getFreeSince() < min_idle_ns) {
+				continue;
+			}
+			//同じアリーナのSpanは同じ予約領域の中にのみMergeされるため、Spanは一つの予約領域に収まる
+			PageId start = p_span->getStartPageId();
+			Region* region = _region_map.Get(start / kRegionPage);
+			size_t first = start % kRegionPage;
+			size_t last = first + num_page;
+			bool all_released = true;
+			for (size_t page = first; page < last && all_released; ++page) {
+				all_released = region->Released(page);
+			}
+			if (all_released) {
+				continue;
+			}
+			if (0 != madvise(reinterpret_cast<void*>(start << kPageShift), num_page << kPageShift, MADV_DONTNEED)) {
+				continue;
+			}
+			bytes_released += region->MarkReleased(first, last) << kPageShift;
+		}
+	}
+	_released_bytes.fetch_add(bytes_released, std::memory_order_relaxed);
+	return bytes_released;
+}
+#endif
+
+//空いてからinterval以上経ったヒュージページとSpanを、バックグラウンドのスレッドで定期的にシステムに返す
+void PageCache::SetReleaseInterval(std::chrono::milliseconds interval) {
+	std::unique_lock<std::mutex> lck(_release_mtx);
+	_release_interval = interval;
+	if (interval.count() > 0 && !_release_thread_started) {
+		_release_thread_started = true;
+		std::thread(&PageCache::_ReleaseLoop, this).detach();
+	}
+	_release_cv.notify_all();
+}
+
+//バックグラウンドで定期的に_Releaseを呼び出すスレッドの処理
+//PageCacheはプロセス終了まで破棄しないため、スレッドも終了させない
+void PageCache::_ReleaseLoop() {
+	std::unique_lock<std::mutex> lck(_release_mtx);
+	while (true) {
+		std::chrono::milliseconds interval = _release_interval;
+		if (interval.count() <= 0) {
+			_release_cv.wait(lck);
+			continue;
+		}
+		//待っている間に間隔が変わった場合、新しい間隔で待ち直す
+		if (_release_cv.wait_for(lck, interval, [&]() { return _release_interval != interval; })) {
+			continue;
+		}
+		lck.unlock();
+		_Release(static_cast<size_t>(-1), static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count()));
+		lck.lock();
+	}
+}
+
+//二つのページが同じアリーナの予約領域にあり、それらのSpanをMergeできるか
+//予約領域はkRegionPageページ境界に揃えているため、ページIDをkRegionPageで割った値で判定できる
+bool PageCache::_SameRegion(PageId id1, PageId id2) {
+#ifdef _WIN32
+	(void)id1;
+	(void)id2;
+	return true;
+#else
+	return id1 / kRegionPage == id2 / kRegionPage;
+#endif
+}
+
+//arena番目のアリーナにkMaxPageページのメモリ領域を用意
+//POSIXではアリーナの予約領域からヒュージページ単位でコミットし、足りない場合は新たに予約する
+//一つのヒュージページをkMaxPageページずつ渡し切ってから、次のヒュージページをコミットする
+//WindowsではVirtualAllocで直接確保する、SystemAllocPageはMappingを作成するため使わない
+void* PageCache::_CommitPage(size_t arena) {
+#ifdef _WIN32
+	(void)arena;
+	void* ptr = VirtualAlloc(0, kMaxPage << kPageShift, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (ptr == nullptr) throw std::bad_alloc();
+	return ptr;
+#else
+	Arena& r_arena = _arenas[arena];
+	if (r_arena.region_cur == r_arena.region_committed) {
+		if (r_arena.region_committed == r_arena.region_end) {
+			char* region = _ReserveRegion(arena);
+			if (nullptr == region) {
+				throw std::bad_alloc();
+			}
+			r_arena.region_cur = region;
+			r_arena.region_committed = region;
+			r_arena.region_end = region + (kRegionPage << kPageShift);
+		}
+		_CommitHugePage(r_arena.region_committed);
+		//まだ一度も使っていないヒュージページも、コミットした時点から空いているものとして扱う
+		PageId id = reinterpret_cast<PageId>(r_arena.region_committed) >> kPageShift;
+		_region_map.Get(id / kRegionPage)->free_since[(id % kRegionPage) / kHugePagePage] = _NowNanoseconds();
+		r_arena.region_committed += kHugePagePage << kPageShift;
+	}
+	void* ptr = r_arena.region_cur;
+	r_arena.region_cur += kMaxPage << kPageShift;
+	return ptr;
+#endif
 }
 
 
 //システムからnum_page個のページを確保
+//確保した領域はSpanとして_page_mapに登録し、他の領域と同じくGetSpanRefFromPageIdで引ける
+//POSIXではページ数をサイズクラスに切り上げ、キャッシュに同じサイズクラスの領域があれば再利用する
+//キャッシュしている領域は_page_mapに登録したままのため、再利用時に登録し直さない
 void* PageCache::SystemAllocPage(PageId num_page) {
+	MEMORY_POOL_LATENCY_SCOPE(kSystemAllocPage, 0);
 #ifdef _WIN32
 	void* ptr = VirtualAlloc(0, num_page * (1 << kPageShift),
 		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (ptr == nullptr) throw std::bad_alloc();
+	Mapping* mapping = _NewMapping(ptr, num_page);
 #else
-	// brk mmapなど
+	size_t cls = _LargeClass(num_page);
+	Mapping* mapping = nullptr;
+	{
+		std::unique_lock<std::mutex> lck(_system_mtx);
+		mapping = _PopLargeCache(cls);
+	}
+	if (nullptr != mapping) {
+		_num_large_hit.fetch_add(1, std::memory_order_relaxed);
+	}
+	else {
+		_num_large_miss.fetch_add(1, std::memory_order_relaxed);
+		mapping = _NewMapping(SystemAlloc(num_page), num_page);
+	}
 #endif
-	if (ptr == nullptr) throw std::bad_alloc();
-	return ptr;
+	mapping->setInUse(true);
+	return reinterpret_cast<void*>(mapping->getStartPageId() << kPageShift);
 }
 
-//システムにページを解放
-void PageCache::SystemFreePage(void* ptr) {
+//SystemAllocPageで確保した領域のSpanを渡し、システムにページを解放
+//POSIXでは上限までキャッシュに残し、上限を超える場合は古いものからmunmapする
+//物理メモリも残すため、再利用時にページフォルトが起きない
+void PageCache::SystemFreePage(Span* p_span) {
+	Mapping* mapping = static_cast<Mapping*>(p_span);
+	//二重解放の場合は何もしない
+	if (!mapping->InUse()) {
+		return;
+	}
+	mapping->setInUse(false);
+#ifndef _WIN32
+	Mapping* evicted = nullptr;
+	{
+		std::unique_lock<std::mutex> lck(_system_mtx);
+		size_t bytes = mapping->getTotalPageCount() << kPageShift;
+		PageId num_page = mapping->getTotalPageCount();
+		size_t cls = _LargeClass(num_page);
+		if (cls < kNumLargeClass && bytes <= _large_cache_limit) {
+			size_t cached_bytes = _large_cached_bytes.load(std::memory_order_relaxed) + bytes;
+			if (cached_bytes > _large_cache_limit) {
+				evicted = _EvictLargeCache(cached_bytes - _large_cache_limit, 0);
+			}
+			mapping->free_since = _NowNanoseconds();
+			mapping->cache_prev = nullptr;
+			mapping->cache_next = _large_cache[cls];
+			if (nullptr != mapping->cache_next) {
+				mapping->cache_next->cache_prev = mapping;
+			}
+			_large_cache[cls] = mapping;
+			mapping->lru_prev = nullptr;
+			mapping->lru_next = _lru_head;
+			if (nullptr != _lru_head) {
+				_lru_head->lru_prev = mapping;
+			}
+			else {
+				_lru_tail = mapping;
+			}
+			_lru_head = mapping;
+			_large_cached_bytes.fetch_add(bytes, std::memory_order_relaxed);
+			mapping = nullptr;
+		}
+	}
+	_UnmapLargeCache(evicted);
+#endif
+	//キャッシュに入らない場合、仮想アドレスごと返す
+	if (nullptr != mapping) {
+		_DeleteMapping(mapping);
+	}
+}
+
+//SystemAllocPageで確保した領域をnum_page個のページに広げる(縮める)、移動した場合は新しいアドレスを返す
+//Linuxではmremapでページテーブルを付け替えるため、中身をコピーしない
+//領域は呼び出し元のスレッドのみが使っているため、_page_mapの登録し直しにロックは不要
+void* PageCache::SystemReallocPage(void* ptr, PageId num_page) {
+#ifdef __linux__
+	Span* p_span = _page_map.Get(reinterpret_cast<PageId>(ptr) >> kPageShift);
+	if (nullptr == p_span || !p_span->InUse() || p_span->getObjectSize() <= (kMaxPage << kPageShift)
+		|| reinterpret_cast<void*>(p_span->getStartPageId() << kPageShift) != ptr) {
+		return nullptr;
+	}
+	_LargeClass(num_page);
+	if (p_span->getTotalPageCount() == num_page) {
+		return ptr;
+	}
+	//mremapの後では古いアドレスが他のmmapに使われている可能性があるため、先に登録を外す
+	_UnregisterSpan(p_span);
+	void* new_ptr = mremap(ptr, p_span->getTotalPageCount() << kPageShift,
+		static_cast<size_t>(num_page) << kPageShift, MREMAP_MAYMOVE);
+	if (MAP_FAILED == new_ptr) {
+		_RegisterSpan(p_span);
+		return nullptr;
+	}
+	_mapped_bytes.fetch_add((static_cast<size_t>(num_page) - p_span->getTotalPageCount()) << kPageShift, std::memory_order_relaxed);
+	p_span->setStartPageId(reinterpret_cast<PageId>(new_ptr) >> kPageShift);
+	p_span->setTotalPageCount(num_page);
+	p_span->setObjectSize(static_cast<size_t>(num_page) << kPageShift);
+	if (!_page_map.Ensure(p_span->getStartPageId(), p_span->getTotalPageCount())) {
+		throw std::bad_alloc();
+	}
+	_RegisterSpan(p_span);
+	return new_ptr;
+#else
+	(void)ptr;
+	(void)num_page;
+	return nullptr;
+#endif
+}
+
+//SystemFreePageで解放した領域をキャッシュするバイト数の上限を設定、0の場合はキャッシュしない
+void PageCache::SetLargeCacheLimit(size_t bytes) {
 #ifdef _WIN32
-	VirtualFree(ptr, 0, MEM_RELEASE);
+	(void)bytes;
 #else
-	// brk mmapなど
+	Mapping* evicted = nullptr;
+	{
+		std::unique_lock<std::mutex> lck(_system_mtx);
+		_large_cache_limit = bytes;
+		size_t cached_bytes = _large_cached_bytes.load(std::memory_order_relaxed);
+		if (cached_bytes > bytes) {
+			evicted = _EvictLargeCache(cached_bytes - bytes, 0);
+		}
+	}
+	_UnmapLargeCache(evicted);
 #endif
 }
+
+//統計情報を取得、SpanListを数えるために各アリーナのロックを順に取る
+void PageCache::GetStats(PageCacheStats& stats) {
+	stats = PageCacheStats();
+	for (size_t arena = 0; arena < _num_arena; ++arena) {
+		Arena& r_arena = _arenas[arena];
+		std::lock_guard<std::mutex> lck(r_arena.mtx);
+		stats.num_new_span += r_arena.num_new_span;
+		stats.num_free_span += r_arena.num_free_span;
+		for (size_t num_page = 1; num_page <= kMaxPage; ++num_page) {
+			SpanList& span_list = r_arena.span_lists[num_page];
+			for (SpanListIterator it = span_list.Begin(); it != span_list.End(); ++it) {
+				++stats.num_span[num_page];
+			}
+		}
+	}
+	GetHugePageStats(stats.committed_bytes, stats.huge_tlb_bytes);
+	stats.released_bytes = GetReleasedBytes();
+	stats.mapped_bytes = _mapped_bytes.load(std::memory_order_relaxed);
+	GetLargeCacheStats(stats.num_large_hit, stats.num_large_miss, stats.large_cached_bytes);
+}
+
+//Mappingを生成し、[ptr, ptr + num_page)のページを_page_mapに登録
+PageCache::Mapping* PageCache::_NewMapping(void* ptr, PageId num_page) {
+	Mapping* mapping = NewObject<Mapping>();
+	mapping->setStartPageId(reinterpret_cast<PageId>(ptr) >> kPageShift);
+	mapping->setTotalPageCount(num_page);
+	mapping->setObjectSize(static_cast<size_t>(num_page) << kPageShift);
+	if (!_page_map.Ensure(mapping->getStartPageId(), mapping->getTotalPageCount())) {
+		SystemFree(ptr, num_page);
+		DeleteObject(mapping);
+		throw std::bad_alloc();
+	}
+	_RegisterSpan(mapping);
+	_mapped_bytes.fetch_add(static_cast<size_t>(num_page) << kPageShift, std::memory_order_relaxed);
+	return mapping;
+}
+
+//Mappingのページの登録を外してシステムに返し、Mappingを破棄
+void PageCache::_DeleteMapping(Mapping* mapping) {
+	_mapped_bytes.fetch_sub(mapping->getTotalPageCount() << kPageShift, std::memory_order_relaxed);
+	_UnregisterSpan(mapping);
+	SystemFree(reinterpret_cast<void*>(mapping->getStartPageId() << kPageShift), mapping->getTotalPageCount());
+	DeleteObject(mapping);
+}
+
+#ifndef _WIN32
+//mmapで仮想アドレス空間をkRegionPageページ分予約(コミットしない)し、先頭アドレスを返す、失敗した場合はnullptr
+//領域の先頭をkRegionPageページ境界に揃えるため、倍の大きさで予約し前後の余分をmunmap
+//kRegionPageページ境界はヒュージページ境界でもあるため、領域内のヒュージページもすべて境界に揃う
+char* PageCache::_ReserveRegion(size_t arena) {
+	size_t bytes_region = kRegionPage << kPageShift;
+	void* p = mmap(nullptr, bytes_region * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (MAP_FAILED == p) {
+		return nullptr;
+	}
+	char* raw = static_cast<char*>(p);
+	char* aligned = reinterpret_cast<char*>(SizeClass::RoundUp(reinterpret_cast<size_t>(raw), bytes_region));
+	if (aligned > raw) {
+		munmap(raw, aligned - raw);
+	}
+	munmap(aligned + bytes_region, raw + bytes_region * 2 - (aligned + bytes_region));
+
+#ifdef MADV_HUGEPAGE
+	//領域全体をTHP(Transparent Huge Pages)の対象にする、THPが無効な環境では失敗するが、通常のページで動作する
+	madvise(aligned, bytes_region, MADV_HUGEPAGE);
+#endif
+
+	Region* region = NewObject<Region>();
+	region->start = aligned;
+	region->arena = arena;
+	PageId index = (reinterpret_cast<PageId>(aligned) >> kPageShift) / kRegionPage;
+	if (!_region_map.Ensure(index, 1)) {
+		throw std::bad_alloc();
+	}
+	_region_map.Set(index, region);
+	std::unique_lock<std::mutex> lck(_system_mtx);
+	region->next = _regions;
+	_regions = region;
+	return aligned;
+}
+
+//予約領域のヒュージページをコミット、MAP_HUGETLBを指定している場合はまずそれで確保を試す
+//MAP_HUGETLBは事前に用意されたヒュージページが足りないと失敗するため、その場合は通常のページでコミットする
+void PageCache::_CommitHugePage(char* ptr) {
+	size_t bytes = kHugePagePage << kPageShift;
+#ifdef MAP_HUGETLB
+	if (_huge_tlb.load(std::memory_order_relaxed)) {
+		void* p = mmap(ptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+		if (MAP_FAILED != p) {
+			_huge_bytes.fetch_add(bytes, std::memory_order_relaxed);
+			_huge_tlb_bytes.fetch_add(bytes, std::memory_order_relaxed);
+			return;
+		}
+		//失敗した場合も予約が外れている可能性があるため、同じアドレスに通常のページで割り当て直す
+		p = mmap(ptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+		if (MAP_FAILED == p) {
+			throw std::bad_alloc();
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+		_huge_bytes.fetch_add(bytes, std::memory_order_relaxed);
+		return;
+	}
+#endif
+	if (0 != mprotect(ptr, bytes, PROT_READ | PROT_WRITE)) {
+		throw std::bad_alloc();
+	}
+	_huge_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+
+//num_pageをサイズクラスのページ数に切り上げ、サイズクラスの番号を返す
+//サイズクラスは2のべき乗ごとに8段階で、切り上げによる無駄は1/8以下
+//サイズクラスの数を超える大きさの場合は切り上げず、kNumLargeClassを返す(キャッシュしない)
+size_t PageCache::_LargeClass(PageId& num_page) {
+	assert(num_page > kMaxPage);
+	size_t log2 = FloorLog2(num_page - 1);
+	size_t shift = log2 - 3;
+	size_t cls = (log2 - FloorLog2(kMaxPage)) * 8 + ((num_page - 1) >> shift) - 8;
+	if (cls >= kNumLargeClass) {
+		return kNumLargeClass;
+	}
+	num_page = (((num_page - 1) >> shift) + 1) << shift;
+	return cls;
+}
+
+//キャッシュからサイズクラスclsの領域を取り出す、ない場合はnullptr
+//clsが空の場合、kLargeClassSlack個上のサイズクラスまで探し、無駄を1/4程度に抑えつつ再利用率を上げる
+PageCache::Mapping* PageCache::_PopLargeCache(size_t cls) {
+	for (size_t i = cls; i < kNumLargeClass && i <= cls + kLargeClassSlack; ++i) {
+		Mapping* mapping = _large_cache[i];
+		if (nullptr != mapping) {
+			_UnlinkLargeCache(mapping);
+			return mapping;
+		}
+	}
+	return nullptr;
+}
+
+//キャッシュしている領域を二つのリストから外す
+void PageCache::_UnlinkLargeCache(Mapping* mapping) {
+	if (nullptr != mapping->cache_prev) {
+		mapping->cache_prev->cache_next = mapping->cache_next;
+	}
+	else {
+		PageId num_page = mapping->getTotalPageCount();
+		_large_cache[_LargeClass(num_page)] = mapping->cache_next;
+	}
+	if (nullptr != mapping->cache_next) {
+		mapping->cache_next->cache_prev = mapping->cache_prev;
+	}
+	if (nullptr != mapping->lru_prev) {
+		mapping->lru_prev->lru_next = mapping->lru_next;
+	}
+	else {
+		_lru_head = mapping->lru_next;
+	}
+	if (nullptr != mapping->lru_next) {
+		mapping->lru_next->lru_prev = mapping->lru_prev;
+	}
+	else {
+		_lru_tail = mapping->lru_prev;
+	}
+	mapping->cache_next = mapping->cache_prev = mapping->lru_next = mapping->lru_prev = nullptr;
+	_large_cached_bytes.fetch_sub(mapping->getTotalPageCount() << kPageShift, std::memory_order_relaxed);
+}
+
+//キャッシュから、解放が古い順にmin_idle_ns以上経った領域を合計bytes以上になるまで外し、そのリストを返す
+PageCache::Mapping* PageCache::_EvictLargeCache(size_t bytes, uint64_t min_idle_ns) {
+	Mapping* list = nullptr;
+	size_t bytes_evicted = 0;
+	uint64_t now = _NowNanoseconds();
+	while (nullptr != _lru_tail && bytes_evicted < bytes && now - _lru_tail->free_since >= min_idle_ns) {
+		Mapping* mapping = _lru_tail;
+		_UnlinkLargeCache(mapping);
+		bytes_evicted += mapping->getTotalPageCount() << kPageShift;
+		mapping->cache_next = list;
+		list = mapping;
+	}
+	return list;
+}
+
+//_EvictLargeCacheで外した領域をmunmapし、そのバイト数を返す
+size_t PageCache::_UnmapLargeCache(Mapping* list) {
+	size_t bytes = 0;
+	while (nullptr != list) {
+		Mapping* mapping = list;
+		list = list->cache_next;
+		bytes += mapping->getTotalPageCount() << kPageShift;
+		_DeleteMapping(mapping);
+	}
+	return bytes;
+}
+#endif
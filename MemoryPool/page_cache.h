@@ -1,6 +1,36 @@
 #pragma once
 #include "common.h"
+#include "page_map.h"
+#include <condition_variable>
 
+//PageCacheの統計情報
+struct PageCacheStats {
+	//ページ数ごとのSpanListにある空いているSpanの数(すべてのアリーナの合計)、indexがページ数
+	size_t num_span[kMaxPage + 1] = {};
+	//NewSpan、FreeSpanを呼び出した回数
+	size_t num_new_span = 0;
+	size_t num_free_span = 0;
+	//ヒュージページ単位でコミットしたバイト数と、そのうちMAP_HUGETLBで確保したバイト数
+	size_t committed_bytes = 0;
+	size_t huge_tlb_bytes = 0;
+	//システムに返したまま、まだ再利用されていないバイト数
+	size_t released_bytes = 0;
+	//SystemAllocPageでシステムから確保している領域のバイト数(キャッシュしているものを含む)と、そのうちキャッシュしているバイト数
+	size_t mapped_bytes = 0;
+	size_t large_cached_bytes = 0;
+	//SystemAllocPageがキャッシュから再利用した回数と、システムから確保した回数
+	size_t num_large_hit = 0;
+	size_t num_large_miss = 0;
+};
+
+//ページ単位のSpanを管理するクラス
+//空いているSpanはアリーナ(kMaxPageArenaまで、CPUの数)ごとに保持し、ロックもアリーナごとに分ける
+//POSIXでは各アリーナがkRegionPageページの領域を予約してそこからコミットするため、
+//予約領域の中のSpanはすべて同じアリーナに所属し、MergeもSpanが所属するアリーナのロックだけで済む
+//コミットは2MBのヒュージページ単位で行い、TLBミスを減らす
+//Spanを選ぶ際は使用中のページが多いヒュージページを優先し、空いているヒュージページはなるべく空いたままにする
+//すべてのページが空いているヒュージページは、ReleaseFreeMemoryかバックグラウンドのスレッドで物理メモリをシステムに返す
+//ヒュージページ全体が空いていない場合も、しばらく使われていない空きSpanのページはページ単位で返す
 class PageCache {
 public:
 	//シングルトン
@@ -18,21 +48,286 @@ public:
 	Span* GetSpanRefFromPageId(PageId id);
 
 	//システムからnum_page個のページを確保
+	//確保した領域はSpanとして_page_mapに登録し、他の領域と同じくGetSpanRefFromPageIdで引ける
+	//POSIXではページ数をサイズクラスに切り上げ、キャッシュに同じサイズクラスの領域があれば再利用する
 	void* SystemAllocPage(PageId num_page);
-	//システムにページを解放
-	void SystemFreePage(void* ptr);
+	//SystemAllocPageで確保した領域のSpanを渡し、システムにページを解放
+	//POSIXでは上限までキャッシュに残し、上限を超える場合は古いものからmunmapする
+	void SystemFreePage(Span* p_span);
+	//SystemAllocPageで確保した領域をnum_page個のページに広げる(縮める)、移動した場合は新しいアドレスを返す
+	//mremapが使えない場合や、ptrがSystemAllocPageで確保した領域の先頭でない場合はnullptrを返し、呼び出し元でコピーする
+	void* SystemReallocPage(void* ptr, PageId num_page);
+
+	size_t getArenaCount() {
+		return _num_arena;
+	}
+
+	//予約領域のヒュージページをMAP_HUGETLBで確保するかを設定、確保できない場合は通常のページでコミットする
+	//有効にする前にコミットした領域には影響しない
+	static void SetHugeTlb(bool enable) {
+		_huge_tlb.store(enable, std::memory_order_relaxed);
+	}
+
+	//空いているページの物理メモリを、合計bytes以上になるまでシステムに返し、返したバイト数を取得
+	//すべてのページが空いているヒュージページを先に返し、足りない場合は空いているSpanのページを返す
+	//仮想アドレスはコミットしたままにするため、再び使う際はページフォルトで物理メモリが割り当て直される
+	//足りない場合はSystemFreePageでキャッシュした領域もmunmapする
+	size_t ReleaseFreeMemory(size_t bytes);
+
+	//空いてからinterval以上経ったヒュージページとSpanを、バックグラウンドのスレッドで定期的にシステムに返す
+	//初めて0以外を設定した際にスレッドを起動し、0を設定すると停止する(スレッドは待機したまま残る)
+	void SetReleaseInterval(std::chrono::milliseconds interval);
 
+	//SystemFreePageで解放した領域をキャッシュするバイト数の上限を設定、0の場合はキャッシュしない
+	void SetLargeCacheLimit(size_t bytes);
 
+	//SystemAllocPageがキャッシュから再利用した回数、システムから確保した回数、キャッシュしているバイト数を取得
+	void GetLargeCacheStats(size_t& num_hit, size_t& num_miss, size_t& cached_bytes) {
+		num_hit = _num_large_hit.load(std::memory_order_relaxed);
+		num_miss = _num_large_miss.load(std::memory_order_relaxed);
+		cached_bytes = _large_cached_bytes.load(std::memory_order_relaxed);
+	}
+
+	//システムに返したまま、まだ再利用されていないバイト数を取得
+	//コミットしたバイト数(GetHugePageStatsのhuge_bytes)からこれを引いた値が、物理メモリを割り当て得るバイト数
+	size_t GetReleasedBytes() {
+		return _released_bytes.load(std::memory_order_relaxed);
+	}
+
+	//ヒュージページ単位でコミットしたバイト数(MAP_HUGETLBか、MADV_HUGEPAGEでTHPの対象にした領域)と、
+	//そのうちMAP_HUGETLBで確保したバイト数を取得
+	void GetHugePageStats(size_t& huge_bytes, size_t& huge_tlb_bytes) {
+		huge_bytes = _huge_bytes.load(std::memory_order_relaxed);
+		huge_tlb_bytes = _huge_tlb_bytes.load(std::memory_order_relaxed);
+	}
+
+	//ロックを待った回数と時間の合計を取得
+	void GetLockWaitStats(size_t& num_wait, size_t& wait_ns) {
+		num_wait = _lock_wait_stats.getWaitCount();
+		wait_ns = _lock_wait_stats.getWaitNanoseconds();
+	}
+
+	//統計情報を取得、SpanListを数えるために各アリーナのロックを順に取る
+	void GetStats(PageCacheStats& stats);
 private:
 	//シングルトン
-	PageCache() {};
-	inline static std::unique_ptr<PageCache> _p_instance;
+	//システムのヒープを経由しないようObjectPoolで生成し、プロセス終了まで破棄しない
+	PageCache();
+	friend class ObjectPool<PageCache>;
+	inline static PageCache* _p_instance = nullptr;
 	inline static std::mutex _mtx;
+	inline static std::atomic<bool> _huge_tlb{ false };
+
+	//空いているSpanとコミット前の予約領域をアリーナごとに保持
+	struct Arena {
+		//アリーナのSpanListと予約領域のマルチスレッド対策
+		std::mutex mtx;
+		//indexがページ数のSpanList
+		//span_listsを直接操作せず、occupancyを更新する下記の関数を使う
+		SpanList span_lists[kMaxPage + 1];
+		//span_lists[1, kMaxPage]が空でないかを表すbit、span_lists[i]はi - 1番目のbit
+		uint64_t occupancy[kMaxPage / 64] = {};
+		//NewSpan、FreeSpanを呼び出した回数、アリーナのロックで保護する
+		size_t num_new_span = 0;
+		size_t num_free_span = 0;
+
+		//p_spanをそのページ数のSpanListに入れる
+		void PushSpan(Span* p_span) {
+			size_t num_page = p_span->getTotalPageCount();
+			span_lists[num_page].PushFront(p_span);
+			occupancy[(num_page - 1) / 64] |= uint64_t(1) << ((num_page - 1) % 64);
+		}
+
+		//p_spanをそのページ数のSpanListから外す
+		void EraseSpan(Span* p_span) {
+			size_t num_page = p_span->getTotalPageCount();
+			span_lists[num_page].Erase(p_span);
+			if (span_lists[num_page].Empty()) {
+				occupancy[(num_page - 1) / 64] &= ~(uint64_t(1) << ((num_page - 1) % 64));
+			}
+		}
+
+		//num_page以上で空でないSpanListのうち、最小のページ数を取得、ない場合は0
+		//occupancyの最下位bitを探すだけで済み、SpanListを走査しない
+		size_t BestFitPageCount(size_t num_page) {
+			for (size_t word = (num_page - 1) / 64; word < kMaxPage / 64; ++word) {
+				uint64_t bits = occupancy[word];
+				if (word == (num_page - 1) / 64) {
+					bits &= ~uint64_t(0) << ((num_page - 1) % 64);
+				}
+				if (0 != bits) {
+					return word * 64 + CountTrailingZeros(bits) + 1;
+				}
+			}
+			return 0;
+		}
+#ifndef _WIN32
+		//最新の予約領域のうち、まだPageCacheに渡していない部分の先頭、コミット済みの部分の末尾、領域の末尾
+		//コミットはヒュージページ単位で行い、渡すのはkMaxPageページずつ
+		char* region_cur = nullptr;
+		char* region_committed = nullptr;
+		char* region_end = nullptr;
+#endif
+	};
+
+	//arena番目のアリーナからSpanを取得、アリーナのロックを保持して呼び出す
+	Span* _NewSpan(size_t arena, PageId num_page);
+	//アリーナのnum_page以上で最小のページ数のSpanListから、使用中のページが最も多いヒュージページにあるSpanを取り出す
+	//ない場合はnullptr、アリーナのロックを保持して呼び出す
+	Span* _PopBestFit(Arena& arena, PageId num_page);
+	//p_spanが保有するすべてのページのIDをp_spanと紐づける
+	void _RegisterSpan(Span* p_span);
+	//p_spanが保有するすべてのページのIDの紐づけを外す
+	void _UnregisterSpan(Span* p_span);
+	//[start, start + num_page)のページが所属するヒュージページの使用中のページ数を、usedならば増やし、そうでなければ減らす
+	void _CountUsedPage(PageId start, PageId num_page, bool used);
+	//ページが所属するヒュージページの使用中のページ数を取得
+	//すべてのページが空いている場合、物理メモリをシステムに返していないものを優先するため、返したものは-1とする
+	ptrdiff_t _GetUsedPage(PageId id);
+	//空いてからmin_idle_ns以上経ったページの物理メモリと、
+	//キャッシュしてからmin_idle_ns以上経った領域を、合計bytes以上になるまでシステムに返す
+	size_t _Release(size_t bytes, uint64_t min_idle_ns);
+	//バックグラウンドで定期的に_Releaseを呼び出すスレッドの処理
+	void _ReleaseLoop();
+	//現在の時刻(ナノ秒)
+	static uint64_t _NowNanoseconds() {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+	//二つのページが同じアリーナの予約領域にあり、それらのSpanをMergeできるか
+	static bool _SameRegion(PageId id1, PageId id2);
+	//arena番目のアリーナにkMaxPageページのメモリ領域を用意、アリーナのロックを保持して呼び出す
+	void* _CommitPage(size_t arena);
+
+	//kMaxPageを超えるページ数をシステムから直接確保した領域のSpan
+	//領域のすべてのページを_page_mapに登録するため、アライメント指定で領域の途中を指すポインタからも引ける
+	//ObjectSizeは領域全体のバイト数で、kMaxPage << kPageShiftを超えることで他のSpanと区別する
+	struct Mapping : public Span {
+		//以下は解放後にキャッシュしている間のみ使う
+		//サイズクラスごとのリストではcache_nextとcache_prev、全体の解放順のリストではlru_nextとlru_prevで繋ぐ
+		Mapping* cache_next = nullptr;
+		Mapping* cache_prev = nullptr;
+		Mapping* lru_next = nullptr;
+		Mapping* lru_prev = nullptr;
+		//キャッシュに入れた時刻(ナノ秒)
+		uint64_t free_since = 0;
+	};
+	//Mappingを生成し、[ptr, ptr + num_page)のページを_page_mapに登録
+	Mapping* _NewMapping(void* ptr, PageId num_page);
+	//Mappingのページの登録を外してシステムに返し、Mappingを破棄
+	void _DeleteMapping(Mapping* mapping);
+
+#ifndef _WIN32
+	//arena番目のアリーナのために、mmapで仮想アドレス空間をkRegionPageページ分予約(コミットしない)し、先頭アドレスを返す
+	char* _ReserveRegion(size_t arena);
+	//予約領域のヒュージページをコミット、MAP_HUGETLBを指定している場合はまずそれで確保を試す
+	void _CommitHugePage(char* ptr);
+
+	//予約した領域の先頭アドレスのリスト
+	struct Region {
+		char* start = nullptr;
+		Region* next = nullptr;
+		//この領域からコミットするアリーナの番号
+		size_t arena = 0;
+		//以下はヒュージページごとの情報、アリーナのロックで保護する
+		//PageCacheからSpanとして取り出されて使用中のページ数
+		uint16_t num_used_page[kRegionPage / kHugePagePage] = {};
+		//すべてのページが空いた時刻(ナノ秒)
+		uint64_t free_since[kRegionPage / kHugePagePage] = {};
+		//物理メモリをシステムに返したページ数
+		uint16_t num_released_page[kRegionPage / kHugePagePage] = {};
+		//以下はページごとの情報、アリーナのロックで保護する
+		//物理メモリをシステムに返したかを表すbit、領域内のi番目のページはi番目のbit
+		uint64_t released_page[kRegionPage / 64] = {};
+
+		//領域内のpage番目のページの物理メモリをシステムに返したか
+		bool Released(size_t page) {
+			return 0 != (released_page[page / 64] & (uint64_t(1) << (page % 64)));
+		}
+
+		//領域内の[first, last)のページを返したものとして記録し、新たに記録したページ数を取得
+		size_t MarkReleased(size_t first, size_t last) {
+			size_t num_page = 0;
+			for (size_t page = first; page < last; ++page) {
+				if (!Released(page)) {
+					released_page[page / 64] |= uint64_t(1) << (page % 64);
+					++num_released_page[page / kHugePagePage];
+					++num_page;
+				}
+			}
+			return num_page;
+		}
+
+		//領域内の[first, last)のページの返した記録を消し、消したページ数を取得
+		size_t ClearReleased(size_t first, size_t last) {
+			size_t num_page = 0;
+			for (size_t page = first; page < last; ++page) {
+				if (Released(page)) {
+					released_page[page / 64] &= ~(uint64_t(1) << (page % 64));
+					--num_released_page[page / kHugePagePage];
+					++num_page;
+				}
+			}
+			return num_page;
+		}
+	};
+	Region* _regions = nullptr;
+	//arena番目のアリーナのうち、すべてのページが空いてからmin_idle_ns以上経ったヒュージページを、合計bytes以上になるまで返す
+	//アリーナのロックを保持して呼び出す
+	size_t _ReleaseHugePage(size_t arena, Region* regions, size_t bytes, uint64_t min_idle_ns);
+	//arena番目のアリーナの空いてからmin_idle_ns以上経ったSpanのページを、合計bytes以上になるまで返す
+	//アリーナのロックを保持して呼び出す
+	size_t _ReleaseFreeSpan(size_t arena, size_t bytes, uint64_t min_idle_ns);
+	//予約領域の番号(ページID / kRegionPage)から予約領域の情報を引くMap
+	PageMap<kAddressBits - kPageShift - kRegionPageShift, Region> _region_map;
+
+	//num_pageをサイズクラスのページ数に切り上げ、サイズクラスの番号を返す
+	static size_t _LargeClass(PageId& num_page);
+	//キャッシュからサイズクラスcls(ない場合はkLargeClassSlack個上まで)の領域を取り出す、ない場合はnullptr、_system_mtxを保持して呼び出す
+	Mapping* _PopLargeCache(size_t cls);
+	//キャッシュしている領域を二つのリストから外す、_system_mtxを保持して呼び出す
+	void _UnlinkLargeCache(Mapping* mapping);
+	//キャッシュから、解放が古い順にmin_idle_ns以上経った領域を合計bytes以上になるまで外し、そのリストを返す
+	//munmapはロックの外で_UnmapLargeCacheで行う、_system_mtxを保持して呼び出す
+	Mapping* _EvictLargeCache(size_t bytes, uint64_t min_idle_ns);
+	//_EvictLargeCacheで外した領域をmunmapし、そのバイト数を返す
+	size_t _UnmapLargeCache(Mapping* list);
 
-	Span* _NewSpan(PageId num_page);
+	//解放した領域のサイズクラスごとのリスト(新しいものが先頭)
+	Mapping* _large_cache[kNumLargeClass] = {};
+	//すべてのサイズクラスの、解放した順のリストの先頭(新しい)と末尾(古い)
+	Mapping* _lru_head = nullptr;
+	Mapping* _lru_tail = nullptr;
+	size_t _large_cache_limit = kDefaultLargeCacheBytes;
+	//上記システムメモリに関する情報のマルチスレッド対策
+	std::mutex _system_mtx;
+#endif
 
 	//ページIDとそのページが所属するSpanのMap
-	std::unordered_map<PageId, Span*> _id_span_map;
+	//ロックなしで読み込めるため、MyFreeなどから直接参照できる
+	//書き込みはSpanが所属するアリーナのロックを保持して行う
+	//Mappingのページは、確保と解放を行うスレッドがキャッシュの外で書き込む(キャッシュ中は書き込まない)
+	SpanPageMap _page_map;
 
-	SpanList _span_lists[kMaxPage + 1];
+	Arena _arenas[kMaxPageArena];
+	size_t _num_arena = 1;
+	//アリーナのロックを待った回数と時間
+	LockWaitStats _lock_wait_stats;
+	//ヒュージページ単位でコミットしたバイト数と、そのうちMAP_HUGETLBで確保したバイト数
+	std::atomic<size_t> _huge_bytes{ 0 };
+	std::atomic<size_t> _huge_tlb_bytes{ 0 };
+	//システムに返したまま、まだ再利用されていないバイト数
+	std::atomic<size_t> _released_bytes{ 0 };
+	//SystemAllocPageがキャッシュから再利用した回数、システムから確保した回数と、キャッシュしているバイト数
+	std::atomic<size_t> _num_large_hit{ 0 };
+	std::atomic<size_t> _num_large_miss{ 0 };
+	std::atomic<size_t> _large_cached_bytes{ 0 };
+	//SystemAllocPageでシステムから確保している領域のバイト数
+	std::atomic<size_t> _mapped_bytes{ 0 };
+	//バックグラウンドで返す間隔(ミリ秒)、0の場合は返さない
+	std::chrono::milliseconds _release_interval{ 0 };
+	bool _release_thread_started = false;
+	//上記2つのマルチスレッド対策と、間隔の変更をスレッドに知らせる条件変数
+	std::mutex _release_mtx;
+	std::condition_variable _release_cv;
 };
@@ -0,0 +1,114 @@
+#pragma once
+#include "common.h"
+#include <atomic>
+
+//ページIDからSpanへのMapを3段の基数木(radix tree)で管理するクラス
+//ページIDをkBits個のbitとして、上位から根、中間、葉のindexに分ける
+//値の型はTで変更でき、PageCacheは予約領域の番号から予約領域の情報を引くためにも使う
+//読み込みはロック不要、ハッシュ計算もなく、ポインタを三回辿るだけで済む
+//Setは書き込むページのSpanが所属するPageCacheのアリーナのロックを保持した状態で行う
+//Ensureは複数のアリーナから同時に呼ばれるため、ノードの登録をCASで行い、負けた方は破棄する
+//一度確保したノードは解放しないため、読み込み側は途中のノードが消える心配がない
+template <size_t kBits, class T = Span>
+class PageMap {
+	//各段のindexに使うbit数
+	static const size_t kLeafBits = kBits / 3;
+	static const size_t kLeafLength = 1 << kLeafBits;
+	static const size_t kInteriorBits = kBits / 3;
+	static const size_t kInteriorLength = 1 << kInteriorBits;
+	static const size_t kRootBits = kBits - kLeafBits - kInteriorBits;
+	static const size_t kRootLength = 1 << kRootBits;
+
+	struct Leaf {
+		std::atomic<T*> values[kLeafLength];
+	};
+
+	struct Node {
+		std::atomic<Leaf*> leafs[kInteriorLength];
+	};
+public:
+	PageMap() {
+		for (size_t i = 0; i < kRootLength; ++i) {
+			_root[i].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	//ページIDからそのページを保有するSpanを取得、登録されていない場合はnullptr
+	T* Get(PageId id) const {
+		if ((id >> kBits) > 0) {
+			return nullptr;
+		}
+		Node* node = _root[RootIndex(id)].load(std::memory_order_acquire);
+		if (nullptr == node) {
+			return nullptr;
+		}
+		Leaf* leaf = node->leafs[InteriorIndex(id)].load(std::memory_order_acquire);
+		if (nullptr == leaf) {
+			return nullptr;
+		}
+		return leaf->values[LeafIndex(id)].load(std::memory_order_acquire);
+	}
+
+	//ページIDとSpanを紐づける、事前にEnsureでノードを用意しておくこと
+	void Set(PageId id, T* p_value) {
+		assert((id >> kBits) == 0);
+		Node* node = _root[RootIndex(id)].load(std::memory_order_relaxed);
+		Leaf* leaf = node->leafs[InteriorIndex(id)].load(std::memory_order_relaxed);
+		leaf->values[LeafIndex(id)].store(p_value, std::memory_order_release);
+	}
+
+	//[start, start + num_page)のページIDを格納するためのノードを用意
+	bool Ensure(PageId start, size_t num_page) {
+		for (PageId id = start; id < start + num_page;) {
+			if ((id >> kBits) > 0) {
+				return false;
+			}
+			std::atomic<Node*>& root = _root[RootIndex(id)];
+			Node* node = root.load(std::memory_order_acquire);
+			if (nullptr == node) {
+				Node* new_node = NewObject<Node>();
+				for (size_t i = 0; i < kInteriorLength; ++i) {
+					new_node->leafs[i].store(nullptr, std::memory_order_relaxed);
+				}
+				if (root.compare_exchange_strong(node, new_node, std::memory_order_acq_rel)) {
+					node = new_node;
+				}
+				else {
+					DeleteObject(new_node);
+				}
+			}
+			std::atomic<Leaf*>& interior = node->leafs[InteriorIndex(id)];
+			Leaf* leaf = interior.load(std::memory_order_acquire);
+			if (nullptr == leaf) {
+				Leaf* new_leaf = NewObject<Leaf>();
+				for (size_t i = 0; i < kLeafLength; ++i) {
+					new_leaf->values[i].store(nullptr, std::memory_order_relaxed);
+				}
+				if (!interior.compare_exchange_strong(leaf, new_leaf, std::memory_order_acq_rel)) {
+					DeleteObject(new_leaf);
+				}
+			}
+			//次の葉の先頭のページIDへ
+			id = ((id >> kLeafBits) + 1) << kLeafBits;
+		}
+		return true;
+	}
+private:
+	static size_t RootIndex(PageId id) {
+		return static_cast<size_t>(id >> (kLeafBits + kInteriorBits));
+	}
+
+	static size_t InteriorIndex(PageId id) {
+		return static_cast<size_t>((id >> kLeafBits) & (kInteriorLength - 1));
+	}
+
+	static size_t LeafIndex(PageId id) {
+		return static_cast<size_t>(id & (kLeafLength - 1));
+	}
+
+	std::atomic<Node*> _root[kRootLength];
+};
+
+//64bit環境ではユーザ空間のアドレスが48bit、32bit環境では32bit
+const size_t kAddressBits = (sizeof(void*) < 8) ? 32 : 48;
+typedef PageMap<kAddressBits - kPageShift> SpanPageMap;
@@ -1,16 +1,200 @@
 #include "thread_cache.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+//リモート解放リストを初期化し、_slotsに番号を登録
+//ThreadCacheは再利用するため、ここでの初期化は最初に作成した際の一度だけ行われる
+ThreadCache::ThreadCache() {
+	for (size_t index = 0; index < kNumFreeList; ++index) {
+		_remote_lists[index].store(nullptr, std::memory_order_relaxed);
+		_remote_counts[index].store(0, std::memory_order_relaxed);
+	}
+
+	std::lock_guard<std::mutex> lck(_threads_mtx);
+	if (_num_slot < kMaxThreadCacheSlot) {
+		_slot = static_cast<uint32_t>(_num_slot++);
+		_owner_id = (static_cast<uint64_t>(_generation.load(std::memory_order_relaxed)) << 32) | _slot;
+		_slots[_slot].store(this, std::memory_order_release);
+	}
+}
+
+//予算からkMinThreadCacheBytesを配分し、すべてのThreadCacheのリストに加える、_threads_mtxを保持して呼び出す
+void ThreadCache::Attach() {
+	_max_bytes.store(kMinThreadCacheBytes, std::memory_order_relaxed);
+	_unclaimed_budget -= kMinThreadCacheBytes;
+
+	_prev = nullptr;
+	_next = _threads;
+	if (nullptr != _threads) {
+		_threads->_prev = this;
+	}
+	_threads = this;
+}
+
+#ifdef _WIN32
+namespace {
+	//スレッド終了時にそのスレッドのThreadCacheを破棄するためのクラス
+	class ThreadCacheReleaser {
+	public:
+		~ThreadCacheReleaser() {
+			if (nullptr != p_thread_cache) {
+				ThreadCache* thread_cache = p_thread_cache;
+				p_thread_cache = nullptr;
+				ThreadCache::Destroy(thread_cache);
+			}
+		}
+	};
+	thread_local ThreadCacheReleaser thread_cache_releaser;
+}
+#else
+namespace {
+	//スレッド終了時にpthreadから呼び出され、そのスレッドのThreadCacheを破棄
+	//破棄後に同じスレッドで再びThreadCacheが作成された場合、pthreadがもう一度呼び出す
+	void ReleaseThreadCache(void* ptr) {
+		p_thread_cache = nullptr;
+		ThreadCache::Destroy(static_cast<ThreadCache*>(ptr));
+	}
+
+	pthread_key_t MakeThreadCacheKey() {
+		pthread_key_t key;
+		pthread_key_create(&key, ReleaseThreadCache);
+		return key;
+	}
+}
+#endif
+
+//呼び出し元のスレッドのThreadCacheを作成してp_thread_cacheに設定し、スレッド終了時に破棄されるよう登録
+//破棄したThreadCacheがあれば、閉じたリモート解放リストを開き直して再利用する
+//終了時の登録がmallocを呼ぶことがあるため、先にp_thread_cacheを設定しておく
+ThreadCache* ThreadCache::Create() {
+	ThreadCache* thread_cache = nullptr;
+	{
+		std::lock_guard<std::mutex> lck(_threads_mtx);
+		thread_cache = _free_caches;
+		if (nullptr != thread_cache) {
+			_free_caches = thread_cache->_next;
+		}
+	}
+	if (nullptr != thread_cache) {
+		for (size_t index = 0; index < kNumFreeList; ++index) {
+			FreeList& free_list = thread_cache->_free_lists[index];
+			free_list.Clear();
+			free_list.setMaxSize(1);
+			free_list.setOverageCount(0);
+			thread_cache->_stats[index].Reset();
+			void* closed = RemoteClosed();
+			thread_cache->_remote_lists[index].compare_exchange_strong(closed, nullptr, std::memory_order_relaxed);
+		}
+		thread_cache->_bytes.store(0, std::memory_order_relaxed);
+	}
+	else {
+		thread_cache = NewObject<ThreadCache>();
+	}
+	{
+		std::lock_guard<std::mutex> lck(_threads_mtx);
+		thread_cache->Attach();
+	}
+
+	p_thread_cache = thread_cache;
+#ifdef _WIN32
+	(void)&thread_cache_releaser;
+#else
+	static pthread_key_t key = MakeThreadCacheKey();
+	pthread_setspecific(key, p_thread_cache);
+#endif
+	return p_thread_cache;
+}
+
+//保有するメモリ領域をすべてCentralCacheに返し、予算を返還してthread_cacheを再利用のリストに戻す
+//返したメモリ領域によって空になったSpanはPageCacheに戻り、隣接するSpanとMergeできるようになる
+//先に世代を進めるため、Spanや他のスレッドのRemoteBatchに残っている古いidはFindOwnerで見つからず、解放するスレッド自身に入る
+//世代を進める前にidを引いた他のスレッドの挿入は、リモート解放リストを閉じる前であれば下で取り出し、閉じた後であれば失敗する
+void ThreadCache::Destroy(ThreadCache* thread_cache) {
+	uint32_t generation = thread_cache->_generation.load(std::memory_order_relaxed) + 1;
+	if (0 == generation) {
+		generation = 1;
+	}
+	thread_cache->_generation.store(generation, std::memory_order_release);
+	if (kNoSpanOwner != thread_cache->_owner_id) {
+		thread_cache->_owner_id = (static_cast<uint64_t>(generation) << 32) | thread_cache->_slot;
+	}
+
+	for (size_t index = 0; index < kNumFreeList; ++index) {
+		thread_cache->FlushRemote(index);
+		//リモート解放リストを閉じ、以降の挿入は解放するスレッド自身のThreadCacheに入るようにする
+		void* start = thread_cache->_remote_lists[index].exchange(RemoteClosed(), std::memory_order_acquire);
+		if (nullptr != start) {
+			size_t num_object = 1;
+			void* end = start;
+			while (nullptr != NextObject(end)) {
+				end = NextObject(end);
+				++num_object;
+			}
+			thread_cache->_remote_counts[index].fetch_sub(num_object, std::memory_order_relaxed);
+			thread_cache->_free_lists[index].PushRange(start, end, num_object);
+			RelaxedAdd(thread_cache->_bytes, num_object * SizeClass::Info(index).bytes_object);
+		}
+		if (!thread_cache->_free_lists[index].Empty()) {
+			thread_cache->ReleaseToCentralCache(index, thread_cache->_free_lists[index].Size());
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lck(_threads_mtx);
+		for (size_t index = 0; index < kNumFreeList; ++index) {
+			FreeListStats& retired = _retired_stats[index];
+			FreeListStats stats;
+			thread_cache->_stats[index].Load(stats);
+			retired.num_allocate += stats.num_allocate;
+			retired.num_deallocate += stats.num_deallocate;
+			retired.num_fetch += stats.num_fetch;
+			retired.num_fetch_object += stats.num_fetch_object;
+			retired.num_release += stats.num_release;
+			retired.num_release_object += stats.num_release_object;
+			retired.num_drain += stats.num_drain;
+			retired.num_drain_object += stats.num_drain_object;
+		}
+		_unclaimed_budget += thread_cache->_max_bytes.load(std::memory_order_relaxed);
+		if (_steal_cursor == thread_cache) {
+			_steal_cursor = thread_cache->_next;
+		}
+		if (nullptr != thread_cache->_prev) {
+			thread_cache->_prev->_next = thread_cache->_next;
+		}
+		else {
+			_threads = thread_cache->_next;
+		}
+		if (nullptr != thread_cache->_next) {
+			thread_cache->_next->_prev = thread_cache->_prev;
+		}
+		thread_cache->_next = _free_caches;
+		_free_caches = thread_cache;
+	}
+}
+
+//すべてのThreadCacheが保有できるバイト数の合計を設定
+//既に配分した上限はそのままとし、各ThreadCacheが上限を増やそうとする際に新しい予算が反映される
+void ThreadCache::SetOverallBudget(size_t bytes) {
+	std::lock_guard<std::mutex> lck(_threads_mtx);
+	_unclaimed_budget += static_cast<ptrdiff_t>(bytes) - static_cast<ptrdiff_t>(_overall_budget);
+	_overall_budget = bytes;
+}
 
 //大きさがbytesのメモリ領域を確保
 void* ThreadCache::Allocate(size_t bytes) {
 	size_t index = SizeClass::Index(bytes);
+	MEMORY_POOL_LATENCY_SCOPE(kThreadCacheHit, index);
 	FreeList& free_list = _free_lists[index];
 
-	//ThreadCacheに保有するメモリ領域が足りない場合、CentralCacheから確保
-	if (free_list.Empty()) {
-		size_t bytes_aligned = SizeClass::RoundUp(bytes);
-		FetchFromCentralCache(bytes_aligned);
+	//ThreadCacheに保有するメモリ領域が足りない場合、他のスレッドから返された領域を使い、それもなければCentralCacheから確保
+	if (free_list.Empty() && 0 == DrainRemote(index)) {
+		MEMORY_POOL_LATENCY_SET_TIMER(kThreadCacheMiss);
+		FetchFromCentralCache(index);
 	}
 
+	RelaxedSub(_bytes, SizeClass::Info(index).bytes_object);
+	RelaxedAdd(_stats[index].num_allocate, 1);
 	return free_list.Pop();
 }
 
@@ -19,28 +203,280 @@ void ThreadCache::Deallocate(void* ptr, size_t bytes) {
 	size_t index = SizeClass::Index(bytes);
 	FreeList& free_list = _free_lists[index];
 	free_list.Push(ptr);
+	RelaxedAdd(_bytes, SizeClass::Info(index).bytes_object);
+	RelaxedAdd(_stats[index].num_deallocate, 1);
+
+	//ThreadCacheに保有するメモリ領域が上限を超える場合、CentralCacheにメモリ領域を解放
+	if (free_list.Size() > free_list.getMaxSize()) {
+		ListTooLong(index);
+	}
+	//ThreadCache全体で保有するバイト数が上限を超える場合、全FreeListから解放
+	else if (_bytes.load(std::memory_order_relaxed) > _max_bytes.load(std::memory_order_relaxed)) {
+		Scavenge();
+	}
+}
 
-	//ThreadCacheに保有するメモリ領域が特定の数を超える場合、CentralCacheにメモリ領域を解放
-	size_t bytes_aligned = SizeClass::RoundUp(bytes);
-	size_t num_free = SizeClass::NumFetchObject(bytes_aligned);
-	if (free_list.Size() >= num_free) {
-		ReleaseToCentralCache(free_list, num_free, bytes_aligned);
+//保有するバイト数が上限を超えた場合、各FreeListの半分をCentralCacheに解放し、上限を増やす
+//上限に達するほど解放するスレッドは、よく利用されているとみなして他のスレッドより多くの予算を配分する
+void ThreadCache::Scavenge() {
+	for (size_t index = 0; index < kNumFreeList; ++index) {
+		FlushRemote(index);
+		DrainRemote(index);
+		FreeList& free_list = _free_lists[index];
+		size_t num_free = (free_list.Size() + 1) / 2;
+		if (num_free > 0) {
+			ReleaseToCentralCache(index, num_free);
+		}
 	}
+
+	std::lock_guard<std::mutex> lck(_threads_mtx);
+	IncreaseCacheLimit();
 }
+
+//未配分の予算、または他のThreadCacheの上限を奪って自分の上限を増やす、_threads_mtxを保持して呼び出す
+void ThreadCache::IncreaseCacheLimit() {
+	size_t max_bytes = _max_bytes.load(std::memory_order_relaxed);
+	if (max_bytes + kStealBytes > kMaxThreadCacheBytes) {
+		return;
+	}
+
+	//未配分の予算があれば、そこから配分
+	if (_unclaimed_budget >= static_cast<ptrdiff_t>(kStealBytes)) {
+		_unclaimed_budget -= kStealBytes;
+		_max_bytes.store(max_bytes + kStealBytes, std::memory_order_relaxed);
+		return;
+	}
+
+	//他のThreadCacheの上限を順番に見て、kMinThreadCacheBytesより大きいものから奪う
+	//奪われたThreadCacheは次の解放時に上限を超え、Scavengeで保有するメモリ領域を減らす
+	for (size_t i = 0; i < kMaxStealTry; ++i) {
+		if (nullptr == _steal_cursor) {
+			_steal_cursor = _threads;
+		}
+		ThreadCache* victim = _steal_cursor;
+		_steal_cursor = victim->_next;
+		if (victim == this) {
+			continue;
+		}
+		size_t victim_max_bytes = victim->_max_bytes.load(std::memory_order_relaxed);
+		if (victim_max_bytes >= kMinThreadCacheBytes + kStealBytes) {
+			victim->_max_bytes.store(victim_max_bytes - kStealBytes, std::memory_order_relaxed);
+			_max_bytes.store(max_bytes + kStealBytes, std::memory_order_relaxed);
+			return;
+		}
+	}
+}
+
+//FreeListが上限を超えた場合、一度に取得する数だけCentralCacheに解放し、上限を調整
+//上限が一度に取得する数より小さい場合、解放も頻繁なサイズクラスとみなして上限を一つ増やす
+//上限が一度に取得する数より大きい場合、上限を超えた解放がkMaxOverage回続いたら一度に取得する数だけ減らす
+void ThreadCache::ListTooLong(size_t index) {
+	const SizeClassInfo& info = SizeClass::Info(index);
+	FreeList& free_list = _free_lists[index];
+	size_t num_free = free_list.Size() < info.num_fetch_object ? free_list.Size() : info.num_fetch_object;
+	ReleaseToCentralCache(index, num_free);
+
+	if (free_list.getMaxSize() < info.num_fetch_object) {
+		free_list.setMaxSize(free_list.getMaxSize() + 1);
+	}
+	else if (free_list.getMaxSize() > info.num_fetch_object) {
+		free_list.setOverageCount(free_list.getOverageCount() + 1);
+		if (free_list.getOverageCount() > kMaxOverage) {
+			free_list.setMaxSize(free_list.getMaxSize() - info.num_fetch_object);
+			free_list.setOverageCount(0);
+		}
+	}
+}
+
 //ThreadCacheに保有するメモリ領域が足りない場合、CentralCacheから確保
-void ThreadCache::FetchFromCentralCache(size_t bytes_object) {
-	size_t index = SizeClass::Index(bytes_object);
-	size_t num_object = SizeClass::NumFetchObject(bytes_object);
+//取得する数はFreeListの上限と一度に取得する数の小さい方とする(slow-start)
+//上限は一度に取得する数に達するまで一つずつ増やし、その後はnum_max_cache_objectまで一度に取得する数ずつ増やす
+void ThreadCache::FetchFromCentralCache(size_t index) {
+	const SizeClassInfo& info = SizeClass::Info(index);
+	FreeList& free_list = _free_lists[index];
+	size_t num_object = free_list.getMaxSize();
+	if (num_object < info.num_fetch_object) {
+		free_list.setMaxSize(num_object + 1);
+	}
+	else {
+		num_object = info.num_fetch_object;
+		size_t new_max = free_list.getMaxSize() + info.num_fetch_object;
+		if (new_max > info.num_max_cache_object) new_max = info.num_max_cache_object;
+		free_list.setMaxSize(new_max - new_max % info.num_fetch_object);
+	}
 	void* start = nullptr, * end = nullptr;
 
 	//CentralCacheから大きさがbytes_objectの領域をnum_object個取得するのを申し込み、実際にnum_acture個を取得
-	size_t num_acture = CentralCache::GetInsatnce().FetchRange(start, end, num_object, bytes_object);
-	_free_lists[index].PushRange(start, end, num_acture);
+	size_t num_acture = CentralCache::GetInsatnce().FetchRange(start, end, num_object, info.bytes_object,
+		IsRemoteFree() ? _owner_id : kNoSpanOwner);
+	free_list.PushRange(start, end, num_acture);
+	RelaxedAdd(_bytes, num_acture * info.bytes_object);
+
+	RelaxedAdd(_stats[index].num_fetch, 1);
+	RelaxedAdd(_stats[index].num_fetch_object, num_acture);
 }
-//ThreadCacheに保有するメモリ領域が特定の数を超える場合、CentralCacheにメモリ領域を解放
-void ThreadCache::ReleaseToCentralCache(FreeList& free_list, size_t num_free, size_t bytes_object) {
+//ThreadCacheに保有するメモリ領域が上限を超える場合、CentralCacheにメモリ領域を解放
+void ThreadCache::ReleaseToCentralCache(size_t index, size_t num_free) {
 	void* start = nullptr, * end = nullptr;
-	free_list.PopRange(start, end, num_free);
+	_free_lists[index].PopRange(start, end, num_free);
+	size_t bytes_object = SizeClass::Info(index).bytes_object;
 	CentralCache::GetInsatnce().ReleaseListToSpans(start, end, num_free, bytes_object);
+	RelaxedSub(_bytes, num_free * bytes_object);
+
+	RelaxedAdd(_stats[index].num_release, 1);
+	RelaxedAdd(_stats[index].num_release_object, num_free);
+}
+
+//idがownerのThreadCacheがCentralCacheから取得した、大きさがbytesのメモリ領域を解放
+//サイズクラスごとにまとめ、一定数たまったらownerのリモート解放リストに一度に入れる
+//ownerが変わった場合は、それまでまとめていた領域を先に返す
+void ThreadCache::DeallocateRemote(uint64_t owner, void* ptr, size_t bytes) {
+	size_t index = SizeClass::Index(bytes);
+	RelaxedAdd(_stats[index].num_deallocate, 1);
+	RemoteBatch& batch = _remote_batches[index];
+	if (batch.owner != owner) {
+		FlushRemote(index);
+		batch.owner = owner;
+	}
+	NextObject(ptr) = batch.start;
+	if (nullptr == batch.start) {
+		batch.end = ptr;
+	}
+	batch.start = ptr;
+	RelaxedAdd(batch.num_object, 1);
+
+	const SizeClassInfo& info = SizeClass::Info(index);
+	size_t num_max = info.num_fetch_object < kMaxRemoteBatch ? info.num_fetch_object : kMaxRemoteBatch;
+	if (batch.num_object.load(std::memory_order_relaxed) >= num_max) {
+		FlushRemote(index);
+	}
+}
+
+//DeallocateRemoteでまとめている領域を所有者に返す、所有者が破棄済みなど返せない場合は自分のFreeListに入れる
+void ThreadCache::FlushRemote(size_t index) {
+	RemoteBatch& batch = _remote_batches[index];
+	size_t num_object = batch.num_object.load(std::memory_order_relaxed);
+	if (0 == num_object) {
+		return;
+	}
+	ThreadCache* owner = FindOwner(batch.owner);
+	if (nullptr == owner || !owner->PushRemote(batch.start, batch.end, num_object, index)) {
+		FreeList& free_list = _free_lists[index];
+		free_list.PushRange(batch.start, batch.end, num_object);
+		RelaxedAdd(_bytes, num_object * SizeClass::Info(index).bytes_object);
+		if (free_list.Size() > free_list.getMaxSize()) {
+			ListTooLong(index);
+		}
+	}
+	batch.owner = kNoSpanOwner;
+	batch.start = nullptr;
+	batch.end = nullptr;
+	batch.num_object.store(0, std::memory_order_relaxed);
+}
+
+//[start, end]のnum_object個の領域をこのThreadCacheのリモート解放リストに入れる
+//このThreadCacheが破棄済み、またはリモート解放リストが上限に達した場合はfalseを返す
+bool ThreadCache::PushRemote(void* start, void* end, size_t num_object, size_t index) {
+	std::atomic<size_t>& count = _remote_counts[index];
+	if (count.load(std::memory_order_relaxed) + num_object > SizeClass::Info(index).num_max_cache_object) {
+		return false;
+	}
+	//先に数を増やしておき、取り出す側が引いても負にならないようにする
+	count.fetch_add(num_object, std::memory_order_relaxed);
+
+	std::atomic<void*>& head = _remote_lists[index];
+	void* old_head = head.load(std::memory_order_relaxed);
+	do {
+		if (RemoteClosed() == old_head) {
+			count.fetch_sub(num_object, std::memory_order_relaxed);
+			return false;
+		}
+		NextObject(end) = old_head;
+	} while (!head.compare_exchange_weak(old_head, start, std::memory_order_release, std::memory_order_relaxed));
+	return true;
+}
+
+//idがownerのThreadCacheを取得、破棄済み(世代が異なる)場合はnullptr
+//ThreadCacheは再利用するだけで解放しないため、破棄済みのThreadCacheの世代を読んでもよい
+//世代を確かめた直後に破棄された場合も、PushRemoteは閉じたリモート解放リストへの挿入に失敗する
+//さらに再利用された場合は新しいスレッドのリストに入るが、そのスレッドのFreeListに移るだけで領域は失われない
+ThreadCache* ThreadCache::FindOwner(uint64_t owner) {
+	uint32_t slot = static_cast<uint32_t>(owner);
+	if (kNoSpanOwner == owner || kSharedSpanOwner == owner || slot >= kMaxThreadCacheSlot) {
+		return nullptr;
+	}
+	ThreadCache* thread_cache = _slots[slot].load(std::memory_order_acquire);
+	if (nullptr == thread_cache || thread_cache->_generation.load(std::memory_order_acquire) != static_cast<uint32_t>(owner >> 32)) {
+		return nullptr;
+	}
+	return thread_cache;
+}
+
+//他のスレッドが取得した領域を解放する際、取得したスレッドに返すかを設定
+void ThreadCache::SetRemoteFree(bool enable) {
+	_remote_free.store(enable, std::memory_order_relaxed);
+}
+
+//リモート解放リストの領域をFreeListに移し、移した数を返す
+size_t ThreadCache::DrainRemote(size_t index) {
+	std::atomic<void*>& head = _remote_lists[index];
+	if (nullptr == head.load(std::memory_order_relaxed)) {
+		return 0;
+	}
+	void* start = head.exchange(nullptr, std::memory_order_acquire);
+	if (nullptr == start) {
+		return 0;
+	}
+	size_t num_object = 1;
+	void* end = start;
+	while (nullptr != NextObject(end)) {
+		end = NextObject(end);
+		++num_object;
+	}
+	_remote_counts[index].fetch_sub(num_object, std::memory_order_relaxed);
+	_free_lists[index].PushRange(start, end, num_object);
+	RelaxedAdd(_bytes, num_object * SizeClass::Info(index).bytes_object);
+
+	RelaxedAdd(_stats[index].num_drain, 1);
+	RelaxedAdd(_stats[index].num_drain_object, num_object);
+	return num_object;
+}
+
+//サイズクラスindexの統計情報を取得
+FreeListStats ThreadCache::GetStats(size_t index) {
+	FreeListStats stats;
+	_stats[index].Load(stats);
+	stats.max_size = _free_lists[index].getMaxSize();
+	stats.num_object = _free_lists[index].Size() + _remote_counts[index].load(std::memory_order_relaxed)
+		+ _remote_batches[index].num_object.load(std::memory_order_relaxed);
+	return stats;
+}
+
+//すべてのThreadCacheのサイズクラスごとの統計情報の合計を取得、回数には破棄したThreadCacheの分も含む
+void ThreadCache::GetOverallStats(FreeListStats stats[kNumFreeList], size_t& num_thread, size_t& cached_bytes) {
+	std::lock_guard<std::mutex> lck(_threads_mtx);
+	for (size_t index = 0; index < kNumFreeList; ++index) {
+		stats[index] = _retired_stats[index];
+	}
+	num_thread = 0;
+	cached_bytes = 0;
+	for (ThreadCache* thread_cache = _threads; nullptr != thread_cache; thread_cache = thread_cache->_next) {
+		++num_thread;
+		cached_bytes += thread_cache->getCachedBytes();
+		for (size_t index = 0; index < kNumFreeList; ++index) {
+			FreeListStats thread_stats = thread_cache->GetStats(index);
+			FreeListStats& total = stats[index];
+			total.max_size += thread_stats.max_size;
+			total.num_object += thread_stats.num_object;
+			total.num_allocate += thread_stats.num_allocate;
+			total.num_deallocate += thread_stats.num_deallocate;
+			total.num_fetch += thread_stats.num_fetch;
+			total.num_fetch_object += thread_stats.num_fetch_object;
+			total.num_release += thread_stats.num_release;
+			total.num_release_object += thread_stats.num_release_object;
+			total.num_drain += thread_stats.num_drain;
+			total.num_drain_object += thread_stats.num_drain_object;
+		}
+	}
 }
 
@@ -1,20 +1,200 @@
 #pragma once
 #include "common.h"
 #include "central_cache.h"
+#include <atomic>
+#include <cstddef>
 
+//ThreadCacheのサイズクラス一つ分の統計情報
+struct FreeListStats {
+	//現在保有できる領域の数の上限
+	size_t max_size = 0;
+	//現在保有している領域の数(他のスレッドから返されてまだ取り出していないものを含む)
+	size_t num_object = 0;
+	//Allocate、Deallocate(DeallocateRemoteを含む)を呼び出した回数
+	size_t num_allocate = 0;
+	size_t num_deallocate = 0;
+	//CentralCacheから取得した回数と領域の数
+	size_t num_fetch = 0;
+	size_t num_fetch_object = 0;
+	//CentralCacheに解放した回数と領域の数
+	size_t num_release = 0;
+	size_t num_release_object = 0;
+	//他のスレッドから返された領域を取り出した回数と領域の数
+	size_t num_drain = 0;
+	size_t num_drain_object = 0;
+};
+
+//すべてのThreadCacheが保有するバイト数の合計はkDefaultOverallThreadCacheBytes(SetOverallBudgetで変更可能)を目安とし、
+//その予算を各ThreadCacheの上限_max_bytesとして配分する
+//保有するバイト数が上限を超えたThreadCacheは、各FreeListの半分をCentralCacheに解放したうえで、
+//未配分の予算、または他のスレッドの上限からkStealBytesずつ奪って自分の上限を増やす
+//そのため、よく解放するスレッドの上限は大きく、あまり使われていないスレッドの上限はkMinThreadCacheBytesまで小さくなる
+//破棄したThreadCacheはメタデータ用のプールに返さずに再利用するため、他のスレッドが古いThreadCacheを参照しても解放済みのメモリは読まない
+//Spanの所有者は番号と世代を組み合わせたid(getOwnerId)で記録し、破棄する際に世代を進めて古いidを無効にする
 class ThreadCache {
 public:
+	ThreadCache();
+	//すべてのThreadCacheが保有できるバイト数の合計を設定
+	static void SetOverallBudget(size_t bytes);
+	//呼び出し元のスレッドのThreadCacheを作成(破棄したものがあれば再利用)してp_thread_cacheに設定し、スレッド終了時に破棄されるよう登録
+	static ThreadCache* Create();
+	//保有するメモリ領域をすべてCentralCacheに返し、予算を返還してthread_cacheを再利用のリストに戻す
+	static void Destroy(ThreadCache* thread_cache);
+
 	//大きさがbytesのメモリ領域を確保
 	void* Allocate(size_t bytes);
 	//ptrが指している大きさがbytesのメモリ領域を解放
 	void Deallocate(void* ptr, size_t bytes);
+	//idがownerのThreadCacheがCentralCacheから取得した、大きさがbytesのメモリ領域を解放
+	//サイズクラスごとにまとめ、一定数たまったらownerのリモート解放リストに一度に入れる
+	void DeallocateRemote(uint64_t owner, void* ptr, size_t bytes);
+	//他のスレッドが取得した領域を解放する際、取得したスレッドに返すかを設定
+	static void SetRemoteFree(bool enable);
+
+	static bool IsRemoteFree() {
+		return _remote_free.load(std::memory_order_relaxed);
+	}
+
+	//Spanの所有者として記録するid、番号を割り当てられなかった場合はkNoSpanOwner
+	uint64_t getOwnerId() {
+		return _owner_id;
+	}
+
+	//サイズクラスindexの統計情報を取得
+	FreeListStats GetStats(size_t index);
+	//すべてのThreadCacheのサイズクラスごとの統計情報の合計を取得、回数には破棄したThreadCacheの分も含む
+	//他のスレッドが更新中の値を読むため、おおよその値となる
+	static void GetOverallStats(FreeListStats stats[kNumFreeList], size_t& num_thread, size_t& cached_bytes);
+
+	size_t getCachedBytes() {
+		return _bytes.load(std::memory_order_relaxed);
+	}
+
+	size_t getMaxBytes() {
+		return _max_bytes.load(std::memory_order_relaxed);
+	}
 private:
-	//ThreadCacheに保有するメモリ領域が足りない場合、CentralCacheから確保
-	void FetchFromCentralCache(size_t bytes_object);
-	//ThreadCacheに保有するメモリ領域が特定の数を超える場合、CentralCacheにメモリ領域を解放
-	void ReleaseToCentralCache(FreeList& free_list, size_t num_free, size_t bytes_object);
+	//保有するバイト数が上限を超えた場合、各FreeListの半分をCentralCacheに解放し、上限を増やす
+	void Scavenge();
+	//未配分の予算、または他のThreadCacheの上限を奪って自分の上限を増やす、_threads_mtxを保持して呼び出す
+	void IncreaseCacheLimit();
+	//上限を奪う相手を探す最大回数
+	static const size_t kMaxStealTry = 10;
+	//リモート解放リストの領域をFreeListに移し、移した数を返す
+	size_t DrainRemote(size_t index);
+	//idがownerのThreadCacheを取得、破棄済み(世代が異なる)場合はnullptr
+	static ThreadCache* FindOwner(uint64_t owner);
+	//予算からkMinThreadCacheBytesを配分し、すべてのThreadCacheのリストに加える、_threads_mtxを保持して呼び出す
+	void Attach();
+	//[start, end]のnum_object個の領域をこのThreadCacheのリモート解放リストに入れる
+	//このThreadCacheが破棄済み、またはリモート解放リストが上限に達した場合はfalseを返す
+	bool PushRemote(void* start, void* end, size_t num_object, size_t index);
+	//DeallocateRemoteでまとめている領域を所有者に返す、返せない場合は自分のFreeListに入れる
+	void FlushRemote(size_t index);
+	//DeallocateRemoteで一度に所有者に返す領域の数の最大値
+	static const size_t kMaxRemoteBatch = 32;
+	//破棄済みのThreadCacheのリモート解放リストの先頭に置く値
+	static void* RemoteClosed() {
+		return reinterpret_cast<void*>(1);
+	}
+
+	//ThreadCacheに保有するメモリ領域が足りない場合、CentralCacheからサイズクラスindexの領域を確保
+	void FetchFromCentralCache(size_t index);
+	//ThreadCacheに保有するメモリ領域が上限を超える場合、CentralCacheにメモリ領域を解放
+	void ReleaseToCentralCache(size_t index, size_t num_free);
+	//FreeListが上限を超えた場合、CentralCacheに解放し、上限を調整
+	void ListTooLong(size_t index);
+	//上限を超えた解放がこの回数を超えて続いたら、上限を減らす
+	static const size_t kMaxOverage = 3;
 	//スレッド独占するメモリのキャッシュ
 	FreeList _free_lists[kNumFreeList];
+	//サイズクラスごとの統計情報の回数
+	//所有するスレッドだけが更新し、GetOverallStatsが他のスレッドから読むため、アトミック操作はload/storeのみ
+	struct Counters {
+		std::atomic<size_t> num_allocate{ 0 };
+		std::atomic<size_t> num_deallocate{ 0 };
+		std::atomic<size_t> num_fetch{ 0 };
+		std::atomic<size_t> num_fetch_object{ 0 };
+		std::atomic<size_t> num_release{ 0 };
+		std::atomic<size_t> num_release_object{ 0 };
+		std::atomic<size_t> num_drain{ 0 };
+		std::atomic<size_t> num_drain_object{ 0 };
+
+		//回数をstatsに書き出す
+		void Load(FreeListStats& stats) const {
+			stats.num_allocate = num_allocate.load(std::memory_order_relaxed);
+			stats.num_deallocate = num_deallocate.load(std::memory_order_relaxed);
+			stats.num_fetch = num_fetch.load(std::memory_order_relaxed);
+			stats.num_fetch_object = num_fetch_object.load(std::memory_order_relaxed);
+			stats.num_release = num_release.load(std::memory_order_relaxed);
+			stats.num_release_object = num_release_object.load(std::memory_order_relaxed);
+			stats.num_drain = num_drain.load(std::memory_order_relaxed);
+			stats.num_drain_object = num_drain_object.load(std::memory_order_relaxed);
+		}
+
+		//ThreadCacheを再利用する際に0に戻す
+		void Reset() {
+			for (std::atomic<size_t>* counter : { &num_allocate, &num_deallocate, &num_fetch, &num_fetch_object,
+				&num_release, &num_release_object, &num_drain, &num_drain_object }) {
+				counter->store(0, std::memory_order_relaxed);
+			}
+		}
+	};
+	Counters _stats[kNumFreeList];
+	//破棄したThreadCacheの統計情報の合計、_threads_mtxで保護する
+	inline static FreeListStats _retired_stats[kNumFreeList];
+
+	//他のスレッドから解放された、このThreadCacheが取得した領域のリスト(サイズクラスごと)
+	//他のスレッドはロックなしで先頭に挿入し、このスレッドはFreeListが空になった際にまとめて取り出す
+	std::atomic<void*> _remote_lists[kNumFreeList];
+	//リモート解放リストの領域の数、取り出しと挿入が重なる場合は実際より多いことがある
+	std::atomic<size_t> _remote_counts[kNumFreeList];
+	//他のスレッドが取得した領域を取得したスレッドに返すか
+	inline static std::atomic<bool> _remote_free{ true };
+
+	//_slotsでの番号と世代、Spanの所有者のidは(世代 << 32) | 番号
+	//世代は破棄するたびに進めるため、破棄前に記録したidはFindOwnerで見つからない
+	uint32_t _slot = 0;
+	std::atomic<uint32_t> _generation{ 1 };
+	uint64_t _owner_id = kNoSpanOwner;
+	//番号からThreadCacheを引く表、一度設定した番号は同じThreadCacheが使い続ける
+	inline static std::atomic<ThreadCache*> _slots[kMaxThreadCacheSlot];
+	inline static size_t _num_slot = 0;
+	//破棄して再利用を待つThreadCacheのリスト(_nextでつなぐ)、_threads_mtxで保護する
+	inline static ThreadCache* _free_caches = nullptr;
+
+	//他のスレッドに返すためにまとめている領域のリスト(サイズクラスごと)
+	//num_objectはGetOverallStatsが他のスレッドから読むため、アトミックにする
+	struct RemoteBatch {
+		uint64_t owner = kNoSpanOwner;
+		void* start = nullptr;
+		void* end = nullptr;
+		std::atomic<size_t> num_object{ 0 };
+	};
+	RemoteBatch _remote_batches[kNumFreeList];
+
+	//保有しているメモリ領域のバイト数の合計、所有するスレッドだけが更新し、GetOverallStatsが他のスレッドから読む
+	std::atomic<size_t> _bytes{ 0 };
+	//保有できるバイト数の上限、他のスレッドから減らされることがある
+	std::atomic<size_t> _max_bytes{ 0 };
+
+	//すべてのThreadCacheの双方向リスト
+	ThreadCache* _prev = nullptr;
+	ThreadCache* _next = nullptr;
+	inline static ThreadCache* _threads = nullptr;
+	//次に上限を奪う相手
+	inline static ThreadCache* _steal_cursor = nullptr;
+	//すべてのThreadCacheの上限の合計の目安
+	inline static size_t _overall_budget = kDefaultOverallThreadCacheBytes;
+	//どのThreadCacheにも配分していない予算、ThreadCacheが増えると負になることがある
+	inline static ptrdiff_t _unclaimed_budget = kDefaultOverallThreadCacheBytes;
+	//上記の予算とリストのマルチスレッド対策
+	inline static std::mutex _threads_mtx;
 };
 //TLS、スレッドごとにThreadCache一つ保有
-_declspec (thread) static ThreadCache* p_thread_cache = nullptr;
+//共有ライブラリとしてLD_PRELOADされた場合でも、TLSへのアクセスがmallocを呼ばないようinitial-execモデルにする
+#if defined(__GNUC__) && !defined(_WIN32)
+inline thread_local ThreadCache* p_thread_cache __attribute__((tls_model("initial-exec"))) = nullptr;
+#else
+inline thread_local ThreadCache* p_thread_cache = nullptr;
+#endif
@@ -0,0 +1,175 @@
+#include "trace_recorder.h"
+#include <cstring>
+#include <new>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+namespace {
+	//呼び出し元のスレッドが記録に使っているバッファ
+#if defined(__GNUC__) && !defined(_WIN32)
+	thread_local void* p_trace_buffer __attribute__((tls_model("initial-exec"))) = nullptr;
+#else
+	thread_local void* p_trace_buffer = nullptr;
+#endif
+
+	uint64_t NowNanoseconds() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	//fork後の子プロセスか、子プロセスでは親から引き継いだロックやファイルに触れない
+	bool forked = false;
+
+#ifdef _WIN32
+	//スレッド終了時にそのスレッドのバッファを空きに戻すためのクラス
+	class TraceBufferReleaser {
+	public:
+		void (*release)(void*) = nullptr;
+		~TraceBufferReleaser() {
+			if (nullptr != p_trace_buffer && nullptr != release) {
+				void* buffer = p_trace_buffer;
+				p_trace_buffer = nullptr;
+				release(buffer);
+			}
+		}
+	};
+	thread_local TraceBufferReleaser trace_buffer_releaser;
+#endif
+}
+
+bool TraceRecorder::Start(const char* path) {
+	std::lock_guard<std::mutex> lck(_mtx);
+	if (nullptr != _fp || forked) {
+		return false;
+	}
+	FILE* fp = fopen(path, "wb");
+	if (nullptr == fp) {
+		return false;
+	}
+	//書き出しはバッファ単位でまとめて行うため、stdioのバッファ(mallocで確保される)は使わない
+	setvbuf(fp, nullptr, _IONBF, 0);
+	if (sizeof(kMagic) != fwrite(kMagic, 1, sizeof(kMagic), fp)) {
+		fclose(fp);
+		return false;
+	}
+#ifndef _WIN32
+	static bool registered = (pthread_atfork(nullptr, nullptr, [] {
+		forked = true;
+		_enabled.store(false, std::memory_order_relaxed);
+	}), true);
+	(void)registered;
+#endif
+	_fp = fp;
+	_start_ns = NowNanoseconds();
+	_num_record.store(0, std::memory_order_relaxed);
+	_enabled.store(true, std::memory_order_release);
+	return true;
+}
+
+//バッファのロックを取ってから_mtxを取る順番で、Flushと揃える
+void TraceRecorder::Stop() {
+	_enabled.store(false, std::memory_order_relaxed);
+	if (forked) {
+		return;
+	}
+	Buffer* buffers = nullptr;
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		if (nullptr == _fp) {
+			return;
+		}
+		buffers = _buffers;
+	}
+	//バッファはプロセス終了まで破棄しないため、ロックを外してもリストをたどれる
+	for (Buffer* buffer = buffers; nullptr != buffer; buffer = buffer->next) {
+		while (buffer->lock.test_and_set(std::memory_order_acquire)) {}
+		Flush(buffer);
+		buffer->lock.clear(std::memory_order_release);
+	}
+	std::lock_guard<std::mutex> lck(_mtx);
+	fclose(_fp);
+	_fp = nullptr;
+}
+
+size_t TraceRecorder::Capacity() {
+	return ((kTraceBufferPage << kPageShift) - Buffer::RecordOffset()) / sizeof(Record);
+}
+
+void TraceRecorder::Append(uint8_t op, void* ptr, size_t bytes) {
+	Buffer* buffer = static_cast<Buffer*>(p_trace_buffer);
+	if (nullptr == buffer) {
+		buffer = GetBuffer();
+	}
+	uint64_t time_ns = NowNanoseconds() - _start_ns;
+	while (buffer->lock.test_and_set(std::memory_order_acquire)) {}
+	Record& record = buffer->Records()[buffer->count++];
+	record.time_ns = time_ns;
+	record.ptr = reinterpret_cast<uint64_t>(ptr);
+	record.bytes = bytes;
+	record.thread = buffer->thread;
+	record.op = op;
+	memset(record.reserved, 0, sizeof(record.reserved));
+	if (Capacity() == buffer->count) {
+		Flush(buffer);
+	}
+	buffer->lock.clear(std::memory_order_release);
+}
+
+//空きのバッファがなければSystemAllocで作成してリストに加える
+//スレッド終了時の登録がmallocを呼ぶことがあるため、先にp_trace_bufferを設定しておく
+TraceRecorder::Buffer* TraceRecorder::GetBuffer() {
+	Buffer* buffer = nullptr;
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		for (Buffer* free_buffer = _buffers; nullptr != free_buffer; free_buffer = free_buffer->next) {
+			if (!free_buffer->in_use) {
+				buffer = free_buffer;
+				break;
+			}
+		}
+		if (nullptr == buffer) {
+			buffer = new(SystemAlloc(kTraceBufferPage)) Buffer;
+			buffer->next = _buffers;
+			_buffers = buffer;
+		}
+		buffer->in_use = true;
+		buffer->thread = _next_thread.fetch_add(1, std::memory_order_relaxed);
+	}
+	p_trace_buffer = buffer;
+#ifdef _WIN32
+	trace_buffer_releaser.release = ReleaseBuffer;
+#else
+	static pthread_key_t key = [] {
+		pthread_key_t key;
+		pthread_key_create(&key, [](void* ptr) {
+			p_trace_buffer = nullptr;
+			ReleaseBuffer(ptr);
+		});
+		return key;
+	}();
+	pthread_setspecific(key, buffer);
+#endif
+	return buffer;
+}
+
+void TraceRecorder::Flush(Buffer* buffer) {
+	if (0 == buffer->count) {
+		return;
+	}
+	std::lock_guard<std::mutex> lck(_mtx);
+	if (nullptr != _fp && !forked) {
+		size_t num_written = fwrite(buffer->Records(), sizeof(Record), buffer->count, _fp);
+		_num_record.fetch_add(num_written, std::memory_order_relaxed);
+	}
+	buffer->count = 0;
+}
+
+void TraceRecorder::ReleaseBuffer(void* ptr) {
+	Buffer* buffer = static_cast<Buffer*>(ptr);
+	while (buffer->lock.test_and_set(std::memory_order_acquire)) {}
+	Flush(buffer);
+	buffer->lock.clear(std::memory_order_release);
+	std::lock_guard<std::mutex> lck(_mtx);
+	buffer->in_use = false;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include "common.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+//MyMalloc/MyFreeの呼び出しを二進のログに記録する
+//記録はスレッドごとのバッファに溜め、満杯になるか、スレッドが終了するか、Stopを呼んだときにファイルへ書き出す
+//バッファはSystemAllocで確保するため、記録中にmallocを呼ばない
+//記録したログはtrace_replayで読み込み、同じ確保と解放の列をメモリプールに流し直せる
+class TraceRecorder {
+public:
+	//操作の種類
+	enum Op : uint8_t {
+		kMalloc = 0,
+		kFree = 1,
+	};
+
+	//ログ一件分、ファイルにはこの構造体をそのまま並べる
+	//ptrは記録時のアドレスで、trace_replayは確保から解放までを一つの領域の識別子として使う
+	struct Record {
+		//記録を開始してからの経過時間(ナノ秒)
+		uint64_t time_ns;
+		uint64_t ptr;
+		//kMallocの場合に要求したバイト数、kFreeの場合は0
+		uint64_t bytes;
+		//記録を開始してから最初に記録した順に0から振るスレッドの番号
+		uint32_t thread;
+		uint8_t op;
+		uint8_t reserved[3];
+	};
+	static_assert(sizeof(Record) == 32, "trace record must stay 32 bytes");
+
+	//ファイルの先頭に書く識別子
+	static constexpr char kMagic[8] = { 'M', 'P', 'T', 'R', 'A', 'C', 'E', '1' };
+
+	//pathのファイルを作成して記録を始める、作成できない場合はfalseを返す
+	//fork後の子プロセスでは記録を止める(親と同じファイルに混ざらないように)
+	static bool Start(const char* path);
+	//すべてのスレッドのバッファを書き出し、ファイルを閉じて記録を終える
+	static void Stop();
+
+	static bool IsEnabled() {
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	//確保した直後に呼び出す
+	static void RecordMalloc(void* ptr, size_t bytes) {
+		Append(kMalloc, ptr, bytes);
+	}
+	//解放する直前に呼び出す、解放後に他のスレッドが同じアドレスを確保した記録より前になるように
+	static void RecordFree(void* ptr) {
+		Append(kFree, ptr, 0);
+	}
+
+	//書き出した件数を取得
+	static size_t GetRecordCount() {
+		return _num_record.load(std::memory_order_relaxed);
+	}
+private:
+	//スレッド一つ分のバッファ、kTraceBufferPage個のページに収まるだけのRecordを持つ
+	//スレッドが終了したら書き出して空きに戻し、次に記録を始めたスレッドが使い回す
+	struct Buffer {
+		//Stopが他のスレッドから書き出す場合との排他
+		std::atomic_flag lock = ATOMIC_FLAG_INIT;
+		//使っているスレッドがあるか
+		bool in_use = false;
+		uint32_t thread = 0;
+		uint32_t count = 0;
+		Buffer* next = nullptr;
+
+		//Recordの配列は、SystemAllocで確保した同じ領域のBufferの直後に置く
+		Record* Records() {
+			return reinterpret_cast<Record*>(reinterpret_cast<char*>(this) + RecordOffset());
+		}
+
+		static size_t RecordOffset() {
+			return SizeClass::RoundUp(sizeof(Buffer), alignof(Record));
+		}
+	};
+
+	static void Append(uint8_t op, void* ptr, size_t bytes);
+	//呼び出し元のスレッドのバッファを取得、まだない場合は空きのバッファを割り当てる
+	static Buffer* GetBuffer();
+	//バッファの中身をファイルに書き出して空にする、呼び出し元がbufferのlockを持っていること
+	static void Flush(Buffer* buffer);
+	//スレッド終了時にバッファを書き出して空きに戻す
+	static void ReleaseBuffer(void* buffer);
+	//1バッファに入るRecordの数
+	static size_t Capacity();
+
+	inline static std::atomic<bool> _enabled{ false };
+	inline static std::atomic<size_t> _num_record{ 0 };
+	inline static std::atomic<uint32_t> _next_thread{ 0 };
+	//記録を開始した時刻(steady_clockのナノ秒)
+	inline static uint64_t _start_ns = 0;
+	//ファイルへの書き出しとバッファのリストを保護
+	inline static std::mutex _mtx;
+	inline static FILE* _fp = nullptr;
+	inline static Buffer* _buffers = nullptr;
+};
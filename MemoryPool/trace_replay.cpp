@@ -0,0 +1,259 @@
+#include "my_malloc.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+//TraceRecorderが記録したログを読み込み、同じ確保と解放の列をMyMalloc/MyFreeに流し直す
+//  trace_replay <trace> [--interleave] [--cpu-cache] [--system] [--stats] [--latency]
+//記録したスレッドごとに一つのスレッドを作って再生する
+//デフォルトでは各スレッドができるだけ速く再生し、他のスレッドが確保した領域を解放する場合だけ確保を待つ
+//--interleaveを指定すると、すべての操作を記録した時刻の順に一つずつ実行し、元のスレッドの交互の順番を再現する
+//--cpu-cacheはThreadCacheの代わりにCpuCacheを使い、--systemは比較のためにシステムのmalloc/freeで再生する
+//--statsを指定すると、再生後にメモリプールの統計情報を書き出す
+//--latencyを指定すると、再生中の各層の処理時間を計測してヒストグラムを書き出す(MEMORY_POOL_LATENCYを有効にしてビルドした場合のみ)
+
+namespace {
+	using Record = TraceRecorder::Record;
+
+	//再生する操作一つ分、領域はアドレスの代わりにobjectの番号で指す
+	struct ReplayOp {
+		//記録した時刻の順の通し番号(--interleaveで使う)
+		uint64_t seq;
+		uint32_t object;
+		uint8_t op;
+	};
+
+	//プロセスの常駐メモリ(RSS)のバイト数を取得
+	size_t CurrentRssBytes() {
+#ifdef _WIN32
+		return 0;
+#else
+		size_t num_page_total = 0, num_page_resident = 0;
+		FILE* fp = fopen("/proc/self/statm", "r");
+		if (nullptr == fp) {
+			return 0;
+		}
+		if (2 != fscanf(fp, "%zu %zu", &num_page_total, &num_page_resident)) {
+			num_page_resident = 0;
+		}
+		fclose(fp);
+		return num_page_resident * sysconf(_SC_PAGESIZE);
+#endif
+	}
+
+	bool LoadTrace(const char* path, std::vector<Record>& records) {
+		FILE* fp = fopen(path, "rb");
+		if (nullptr == fp) {
+			return false;
+		}
+		char magic[sizeof(TraceRecorder::kMagic)];
+		if (sizeof(magic) != fread(magic, 1, sizeof(magic), fp) || 0 != memcmp(magic, TraceRecorder::kMagic, sizeof(magic))) {
+			fclose(fp);
+			return false;
+		}
+		Record record;
+		while (1 == fread(&record, sizeof(record), 1, fp)) {
+			records.push_back(record);
+		}
+		fclose(fp);
+		return true;
+	}
+
+	//記録した時刻の順に並べ、アドレスを領域の番号に置き換えてスレッドごとの操作の列に分ける
+	//記録を始める前に確保された領域の解放は、対応する確保がないため捨てる
+	//確保したアドレスの途中を指す解放(アライメントを揃えたposix_memalignなど)は、その領域の解放として扱う
+	void BuildReplay(std::vector<Record>& records, std::vector<std::vector<ReplayOp>>& threads, std::vector<size_t>& object_bytes) {
+		//スレッドごとのバッファは書き出す順番が前後するため、時刻で並べ直す
+		//同じスレッドの記録はファイル内で順番どおりのため、安定ソートで順番を保つ
+		std::stable_sort(records.begin(), records.end(), [](const Record& a, const Record& b) {
+			return a.time_ns < b.time_ns;
+		});
+		std::map<uint64_t, uint32_t> live;
+		std::map<uint32_t, size_t> thread_index;
+		uint64_t seq = 0;
+		for (const Record& record : records) {
+			ReplayOp op{ seq, 0, record.op };
+			if (TraceRecorder::kMalloc == record.op) {
+				op.object = static_cast<uint32_t>(object_bytes.size());
+				object_bytes.push_back(record.bytes);
+				live[record.ptr] = op.object;
+			}
+			else {
+				auto it = live.upper_bound(record.ptr);
+				if (live.begin() == it) {
+					continue;
+				}
+				--it;
+				size_t bytes = object_bytes[it->second];
+				if (record.ptr != it->first && record.ptr >= it->first + (bytes == 0 ? 1 : bytes)) {
+					continue;
+				}
+				op.object = it->second;
+				live.erase(it);
+			}
+			auto [it_thread, inserted] = thread_index.emplace(record.thread, threads.size());
+			if (inserted) {
+				threads.emplace_back();
+			}
+			threads[it_thread->second].push_back(op);
+			++seq;
+		}
+	}
+
+	struct PoolAllocator {
+		static void* Allocate(size_t bytes) {
+			return MyMalloc(bytes);
+		}
+		static void Deallocate(void* ptr) {
+			MyFree(ptr);
+		}
+	};
+
+	struct SystemAllocator {
+		static void* Allocate(size_t bytes) {
+			return malloc(bytes);
+		}
+		static void Deallocate(void* ptr) {
+			free(ptr);
+		}
+	};
+
+	//操作の列をスレッドごとに再生し、経過時間(秒)を返す
+	template <class Allocator>
+	double Replay(const std::vector<std::vector<ReplayOp>>& threads, const std::vector<size_t>& object_bytes, bool interleave) {
+		std::unique_ptr<std::atomic<void*>[]> objects(new std::atomic<void*>[object_bytes.size()]);
+		for (size_t i = 0; i < object_bytes.size(); ++i) {
+			objects[i].store(nullptr, std::memory_order_relaxed);
+		}
+		//--interleaveで次に実行する操作の通し番号
+		std::atomic<uint64_t> next_seq{ 0 };
+		std::atomic<bool> start{ false };
+		std::vector<std::thread> vthread;
+		for (const std::vector<ReplayOp>& ops : threads) {
+			vthread.emplace_back([&, interleave]() {
+				while (!start.load(std::memory_order_acquire)) {
+					std::this_thread::yield();
+				}
+				for (const ReplayOp& op : ops) {
+					if (interleave) {
+						while (next_seq.load(std::memory_order_acquire) != op.seq) {
+							std::this_thread::yield();
+						}
+					}
+					if (TraceRecorder::kMalloc == op.op) {
+						void* ptr = Allocator::Allocate(object_bytes[op.object]);
+						objects[op.object].store(ptr, std::memory_order_release);
+					}
+					else {
+						//他のスレッドが確保した領域の場合、確保されるまで待つ
+						void* ptr;
+						while (nullptr == (ptr = objects[op.object].load(std::memory_order_acquire))) {
+							std::this_thread::yield();
+						}
+						Allocator::Deallocate(ptr);
+						objects[op.object].store(nullptr, std::memory_order_relaxed);
+					}
+					if (interleave) {
+						next_seq.store(op.seq + 1, std::memory_order_release);
+					}
+				}
+			});
+		}
+		auto begin = std::chrono::steady_clock::now();
+		start.store(true, std::memory_order_release);
+		for (std::thread& t : vthread) {
+			t.join();
+		}
+		auto end = std::chrono::steady_clock::now();
+		//記録の終わりまで解放されなかった領域
+		for (size_t i = 0; i < object_bytes.size(); ++i) {
+			void* ptr = objects[i].load(std::memory_order_relaxed);
+			if (nullptr != ptr) {
+				Allocator::Deallocate(ptr);
+			}
+		}
+		return std::chrono::duration<double>(end - begin).count();
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <trace> [--interleave] [--cpu-cache] [--system] [--stats] [--latency]\n", argv[0]);
+		return 2;
+	}
+	bool interleave = false, system = false, stats = false, latency = false;
+	for (int i = 2; i < argc; ++i) {
+		std::string option = argv[i];
+		if ("--interleave" == option) {
+			interleave = true;
+		}
+		else if ("--cpu-cache" == option) {
+			CpuCache::SetEnabled(true);
+		}
+		else if ("--system" == option) {
+			system = true;
+		}
+		else if ("--stats" == option) {
+			stats = true;
+		}
+		else if ("--latency" == option) {
+			latency = true;
+		}
+		else {
+			fprintf(stderr, "unknown option: %s\n", argv[i]);
+			return 2;
+		}
+	}
+
+	std::vector<Record> records;
+	if (!LoadTrace(argv[1], records)) {
+		fprintf(stderr, "cannot read trace: %s\n", argv[1]);
+		return 1;
+	}
+	size_t num_record = records.size();
+	std::vector<std::vector<ReplayOp>> threads;
+	std::vector<size_t> object_bytes;
+	BuildReplay(records, threads, object_bytes);
+	size_t num_op = 0;
+	for (const std::vector<ReplayOp>& ops : threads) {
+		num_op += ops.size();
+	}
+	records.clear();
+	records.shrink_to_fit();
+	printf("%zu records, %zu ops replayed, %zu objects, %zu threads, %s, %s\n",
+		num_record, num_op, object_bytes.size(), threads.size(),
+		interleave ? "interleaved" : "as fast as possible",
+		system ? "system malloc" : (CpuCache::IsEnabled() ? "CpuCache" : "ThreadCache"));
+
+	size_t rss_begin = CurrentRssBytes();
+	LatencyStats::SetEnabled(latency && !system);
+	double seconds = system ? Replay<SystemAllocator>(threads, object_bytes, interleave)
+		: Replay<PoolAllocator>(threads, object_bytes, interleave);
+	printf("elapsed %.1f ms, %.2f Mops/s, rss %zu KB -> %zu KB\n",
+		seconds * 1e3, num_op / seconds / 1e6, rss_begin >> 10, CurrentRssBytes() >> 10);
+	if (!system) {
+		size_t central_wait = 0, central_wait_ns = 0, page_wait = 0, page_wait_ns = 0;
+		CentralCache::GetInsatnce().GetLockWaitStats(central_wait, central_wait_ns);
+		PageCache::GetInsatnce().GetLockWaitStats(page_wait, page_wait_ns);
+		size_t num_hit = 0, num_miss = 0, cached_bytes = 0;
+		PageCache::GetInsatnce().GetLargeCacheStats(num_hit, num_miss, cached_bytes);
+		printf("CentralCache lock waits %zu (%.2f ms), PageCache lock waits %zu (%.2f ms), large cache hit %zu miss %zu\n",
+			central_wait, central_wait_ns / 1e6, page_wait, page_wait_ns / 1e6, num_hit, num_miss);
+	}
+	if (stats && !system) {
+		PrintMallocStats(stdout);
+	}
+	if (latency && !system) {
+		LatencyStats::Print(stdout);
+	}
+	return 0;
+}